@@ -3,11 +3,33 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
 #include <pthread.h>
 
 #define MIN_CELLS 1024
+#define CELL_SLAB_SIZE 256      // cells per malloc once the reserve runs dry
+#define CELL_CACHE_SIZE 32      // cells a thread keeps for itself
+#define CELL_CACHE_BATCH 16     // cells moved per trip to the shared free list
 #define BIO_PRISON_MAX_RANGE 1024
 #define BIO_PRISON_MAX_RANGE_SHIFT 10
+#define CACHE_LINE_SIZE 64
+
+// Region locks: twice the online CPUs, rounded up to a power of two
+#define DM_HASH_LOCKS_MAX 64
+#define DM_HASH_LOCKS_MULT 4294967291ULL
+#define DM_HASH_LOCKS_SHIFT 6
+
+/*
+ * Cells in a region are indexed by an rb-tree, as in the kernel, unless
+ * built with -DBIO_PRISON_HASH_INDEX for an open-addressing hash table.
+ */
+#ifdef BIO_PRISON_HASH_INDEX
+#define PRISON_HASH_MIN_SLOTS 16
+#define GOLDEN_RATIO_64 0x61C8864680B583EBULL
+#endif
 
 // Simplified types from Linux kernel
 typedef uint64_t dm_block_t;
@@ -15,6 +37,9 @@ typedef uint32_t dm_thin_id;
 typedef int gfp_t;
 #define GFP_KERNEL 0
 
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
 // Simplified bio structure
 struct bio {
     int bi_status;
@@ -47,25 +72,121 @@ struct rb_root {
     struct rb_node *rb_node;
 };
 
-// Cell structure
+#define RB_BLACK 0
+#define RB_RED 1
+#define rb_entry(ptr, type, member) container_of(ptr, type, member)
+
+struct work_struct {
+    void (*func)(struct work_struct *work);
+};
+
+// Doubly linked list, as in the kernel's list.h
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+#define LIST_HEAD_INIT(name) { &(name), &(name) }
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+
+static inline void INIT_LIST_HEAD(struct list_head *list) {
+    list->next = list->prev = list;
+}
+
+static inline bool list_empty(const struct list_head *head) {
+    return head->next == head;
+}
+
+static inline void list_add_tail(struct list_head *new, struct list_head *head) {
+    new->prev = head->prev;
+    new->next = head;
+    head->prev->next = new;
+    head->prev = new;
+}
+
+static inline void list_del(struct list_head *entry) {
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->next = entry->prev = NULL;
+}
+
+// Move every entry of list to the tail of head and reinitialise list
+static inline void list_splice_tail_init(struct list_head *list, struct list_head *head) {
+    if (list_empty(list))
+        return;
+
+    list->next->prev = head->prev;
+    head->prev->next = list->next;
+    list->prev->next = head;
+    head->prev = list->prev;
+    INIT_LIST_HEAD(list);
+}
+
+/*
+ * Cell structure. The v1 API uses holder; the v2 API leaves it NULL and
+ * tracks shared holders and an exclusive lock level instead.
+ */
 struct dm_bio_prison_cell {
     struct dm_cell_key key;
     struct bio *holder;
     struct bio_list bios;
+    bool exclusive_lock;
+    unsigned int exclusive_level;
+    unsigned int shared_count;
+    struct work_struct *quiesce_continuation;
     struct rb_node node;
+    struct dm_bio_prison_cell *next_free;
+};
+
+struct prison_cell_slab {
+    struct prison_cell_slab *next;
+    struct dm_bio_prison_cell cells[CELL_SLAB_SIZE];
+};
+
+struct dm_bio_prison;
+
+// Cells owned by one thread, reached through prison->cache_key
+struct prison_cell_cache {
+    struct prison_cell_cache *next;
+    struct dm_bio_prison *prison;
+    unsigned int nr;
+    struct dm_bio_prison_cell *cells[CELL_CACHE_SIZE];
 };
 
-// Prison region structure
+#ifdef BIO_PRISON_HASH_INDEX
+// The key hash is kept next to the cell so probes rarely touch the cell
+struct prison_hash_slot {
+    uint64_t hash;
+    struct dm_bio_prison_cell *cell;    // NULL if the slot is empty
+};
+
+struct prison_hash {
+    struct prison_hash_slot *slots;
+    unsigned int mask;                  // slots - 1, a power of two
+    unsigned int nr;
+};
+#endif
+
+// Prison region structure, one per cache line so region locks do not false-share
 struct prison_region {
     pthread_spinlock_t lock;
+#ifdef BIO_PRISON_HASH_INDEX
+    struct prison_hash cells;
+#else
     struct rb_root cell;
-};
+#endif
+} __attribute__((aligned(CACHE_LINE_SIZE)));
 
 // Main prison structure
 struct dm_bio_prison {
-    struct dm_bio_prison_cell *cell_pool;
+    struct dm_bio_prison_cell *cell_pool;   // reserve allocated up front
     int cell_pool_size;
-    int cell_pool_used;
+    pthread_spinlock_t free_lock;
+    struct dm_bio_prison_cell *free_cells;
+    unsigned long nr_free;                  // cells on free_cells
+    unsigned long nr_cells;                 // reserve plus slabs
+    struct prison_cell_slab *slabs;
+    struct prison_cell_cache *caches;
+    pthread_key_t cache_key;
     unsigned int num_locks;
     struct prison_region *regions;
 };
@@ -85,6 +206,18 @@ void bio_list_add(struct bio_list *bl, struct bio *bio) {
     }
 }
 
+// Append bl2 to bl in O(1); bl2 is left untouched
+void bio_list_merge(struct bio_list *bl, struct bio_list *bl2) {
+    if (!bl2->head)
+        return;
+
+    if (bl->tail)
+        bl->tail->bi_next = bl2->head;
+    else
+        bl->head = bl2->head;
+    bl->tail = bl2->tail;
+}
+
 struct bio *bio_list_pop(struct bio_list *bl) {
     struct bio *bio = bl->head;
     if (bio) {
@@ -96,26 +229,243 @@ struct bio *bio_list_pop(struct bio_list *bl) {
     return bio;
 }
 
-// RB-tree functions (simplified)
+// RB-tree functions
 void rb_link_node(struct rb_node *node, struct rb_node *parent, struct rb_node **rb_link) {
     node->rb_parent = parent;
-    node->rb_color = 1;
+    node->rb_color = RB_RED;
     node->rb_left = node->rb_right = NULL;
     *rb_link = node;
 }
 
+static void rb_replace_child(struct rb_node *old, struct rb_node *new,
+                             struct rb_node *parent, struct rb_root *root) {
+    if (!parent)
+        root->rb_node = new;
+    else if (parent->rb_left == old)
+        parent->rb_left = new;
+    else
+        parent->rb_right = new;
+}
+
+static void rb_rotate_left(struct rb_node *node, struct rb_root *root) {
+    struct rb_node *right = node->rb_right;
+
+    node->rb_right = right->rb_left;
+    if (right->rb_left)
+        right->rb_left->rb_parent = node;
+    right->rb_parent = node->rb_parent;
+    rb_replace_child(node, right, node->rb_parent, root);
+    right->rb_left = node;
+    node->rb_parent = right;
+}
+
+static void rb_rotate_right(struct rb_node *node, struct rb_root *root) {
+    struct rb_node *left = node->rb_left;
+
+    node->rb_left = left->rb_right;
+    if (left->rb_right)
+        left->rb_right->rb_parent = node;
+    left->rb_parent = node->rb_parent;
+    rb_replace_child(node, left, node->rb_parent, root);
+    left->rb_right = node;
+    node->rb_parent = left;
+}
+
+static inline bool rb_is_black(struct rb_node *node) {
+    return !node || node->rb_color == RB_BLACK;
+}
+
+// Rebalance after rb_link_node() put a red node into the tree
+void rb_insert_color(struct rb_node *node, struct rb_root *root) {
+    struct rb_node *parent, *gparent, *uncle;
+
+    while ((parent = node->rb_parent) && parent->rb_color == RB_RED) {
+        gparent = parent->rb_parent;
+
+        if (parent == gparent->rb_left) {
+            uncle = gparent->rb_right;
+            if (!rb_is_black(uncle)) {
+                uncle->rb_color = RB_BLACK;
+                parent->rb_color = RB_BLACK;
+                gparent->rb_color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->rb_right) {
+                rb_rotate_left(parent, root);
+                node = parent;
+                parent = node->rb_parent;
+            }
+            parent->rb_color = RB_BLACK;
+            gparent->rb_color = RB_RED;
+            rb_rotate_right(gparent, root);
+        } else {
+            uncle = gparent->rb_left;
+            if (!rb_is_black(uncle)) {
+                uncle->rb_color = RB_BLACK;
+                parent->rb_color = RB_BLACK;
+                gparent->rb_color = RB_RED;
+                node = gparent;
+                continue;
+            }
+            if (node == parent->rb_left) {
+                rb_rotate_right(parent, root);
+                node = parent;
+                parent = node->rb_parent;
+            }
+            parent->rb_color = RB_BLACK;
+            gparent->rb_color = RB_RED;
+            rb_rotate_left(gparent, root);
+        }
+    }
+    root->rb_node->rb_color = RB_BLACK;
+}
+
+// Restore the black height after a black node was removed above node
+static void rb_erase_color(struct rb_node *node, struct rb_node *parent,
+                           struct rb_root *root) {
+    struct rb_node *sibling;
+
+    while (rb_is_black(node) && node != root->rb_node) {
+        if (parent->rb_left == node) {
+            sibling = parent->rb_right;
+            if (!rb_is_black(sibling)) {
+                sibling->rb_color = RB_BLACK;
+                parent->rb_color = RB_RED;
+                rb_rotate_left(parent, root);
+                sibling = parent->rb_right;
+            }
+            if (rb_is_black(sibling->rb_left) && rb_is_black(sibling->rb_right)) {
+                sibling->rb_color = RB_RED;
+                node = parent;
+                parent = node->rb_parent;
+                continue;
+            }
+            if (rb_is_black(sibling->rb_right)) {
+                sibling->rb_left->rb_color = RB_BLACK;
+                sibling->rb_color = RB_RED;
+                rb_rotate_right(sibling, root);
+                sibling = parent->rb_right;
+            }
+            sibling->rb_color = parent->rb_color;
+            parent->rb_color = RB_BLACK;
+            sibling->rb_right->rb_color = RB_BLACK;
+            rb_rotate_left(parent, root);
+        } else {
+            sibling = parent->rb_left;
+            if (!rb_is_black(sibling)) {
+                sibling->rb_color = RB_BLACK;
+                parent->rb_color = RB_RED;
+                rb_rotate_right(parent, root);
+                sibling = parent->rb_left;
+            }
+            if (rb_is_black(sibling->rb_left) && rb_is_black(sibling->rb_right)) {
+                sibling->rb_color = RB_RED;
+                node = parent;
+                parent = node->rb_parent;
+                continue;
+            }
+            if (rb_is_black(sibling->rb_left)) {
+                sibling->rb_right->rb_color = RB_BLACK;
+                sibling->rb_color = RB_RED;
+                rb_rotate_left(sibling, root);
+                sibling = parent->rb_left;
+            }
+            sibling->rb_color = parent->rb_color;
+            parent->rb_color = RB_BLACK;
+            sibling->rb_left->rb_color = RB_BLACK;
+            rb_rotate_right(parent, root);
+        }
+        node = root->rb_node;
+        break;
+    }
+    if (node)
+        node->rb_color = RB_BLACK;
+}
+
+void rb_erase(struct rb_node *node, struct rb_root *root) {
+    struct rb_node *child, *parent;
+    int color;
+
+    if (node->rb_left && node->rb_right) {
+        // Two children: move the in-order successor into node's place
+        struct rb_node *old = node;
+
+        node = node->rb_right;
+        while (node->rb_left)
+            node = node->rb_left;
+
+        rb_replace_child(old, node, old->rb_parent, root);
+        child = node->rb_right;
+        parent = node->rb_parent;
+        color = node->rb_color;
+
+        if (parent == old) {
+            parent = node;
+        } else {
+            if (child)
+                child->rb_parent = parent;
+            parent->rb_left = child;
+            node->rb_right = old->rb_right;
+            old->rb_right->rb_parent = node;
+        }
+        node->rb_parent = old->rb_parent;
+        node->rb_color = old->rb_color;
+        node->rb_left = old->rb_left;
+        old->rb_left->rb_parent = node;
+    } else {
+        child = node->rb_left ? node->rb_left : node->rb_right;
+        parent = node->rb_parent;
+        color = node->rb_color;
+        if (child)
+            child->rb_parent = parent;
+        rb_replace_child(node, child, parent, root);
+    }
+
+    if (color == RB_BLACK)
+        rb_erase_color(child, parent, root);
+}
+
+static void prison_cell_cache_release(void *data);
+
+static unsigned int roundup_pow_of_two(unsigned int n) {
+    unsigned int p = 1;
+
+    while (p < n)
+        p <<= 1;
+    return p;
+}
+
+static unsigned int dm_num_hash_locks(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int num_locks = roundup_pow_of_two(cpus > 0 ? cpus : 1) << 1;
+
+    return num_locks < DM_HASH_LOCKS_MAX ? num_locks : DM_HASH_LOCKS_MAX;
+}
+
 // Prison functions
-struct dm_bio_prison *dm_bio_prison_create(void) {
+
+/*
+ * Create a prison with num_locks regions, rounded up to a power of two
+ * and capped at DM_HASH_LOCKS_MAX, or sized from the CPU count if 0.
+ */
+struct dm_bio_prison *dm_bio_prison_create_with_locks(unsigned int num_locks) {
     struct dm_bio_prison *prison = calloc(1, sizeof(*prison));
+    void *regions;
+
     if (!prison)
         return NULL;
 
-    prison->num_locks = 16; // Simplified from kernel version
-    prison->regions = calloc(prison->num_locks, sizeof(struct prison_region));
-    if (!prison->regions) {
+    if (num_locks == 0)
+        num_locks = dm_num_hash_locks();
+    num_locks = roundup_pow_of_two(num_locks);
+    prison->num_locks = num_locks < DM_HASH_LOCKS_MAX ? num_locks : DM_HASH_LOCKS_MAX;
+    if (posix_memalign(&regions, CACHE_LINE_SIZE,
+                       prison->num_locks * sizeof(struct prison_region))) {
         free(prison);
         return NULL;
     }
+    prison->regions = memset(regions, 0, prison->num_locks * sizeof(struct prison_region));
 
     prison->cell_pool_size = MIN_CELLS;
     prison->cell_pool = calloc(prison->cell_pool_size, sizeof(struct dm_bio_prison_cell));
@@ -125,35 +475,191 @@ struct dm_bio_prison *dm_bio_prison_create(void) {
         return NULL;
     }
 
+    if (pthread_key_create(&prison->cache_key, prison_cell_cache_release)) {
+        free(prison->cell_pool);
+        free(prison->regions);
+        free(prison);
+        return NULL;
+    }
+
+    pthread_spin_init(&prison->free_lock, PTHREAD_PROCESS_PRIVATE);
+    for (int i = prison->cell_pool_size - 1; i >= 0; i--) {
+        prison->cell_pool[i].next_free = prison->free_cells;
+        prison->free_cells = &prison->cell_pool[i];
+    }
+    prison->nr_free = prison->nr_cells = prison->cell_pool_size;
+
     for (unsigned int i = 0; i < prison->num_locks; i++) {
         pthread_spin_init(&prison->regions[i].lock, PTHREAD_PROCESS_PRIVATE);
+#ifndef BIO_PRISON_HASH_INDEX
         prison->regions[i].cell.rb_node = NULL;
+#endif
     }
 
     return prison;
 }
 
+struct dm_bio_prison *dm_bio_prison_create(void) {
+    return dm_bio_prison_create_with_locks(0);
+}
+
+/*
+ * No thread may be using the prison. Threads that used it may still be
+ * running; their caches are freed here rather than at thread exit.
+ */
 void dm_bio_prison_destroy(struct dm_bio_prison *prison) {
     if (!prison)
         return;
 
-    for (unsigned int i = 0; i < prison->num_locks; i++)
+    pthread_key_delete(prison->cache_key);
+    while (prison->caches) {
+        struct prison_cell_cache *cc = prison->caches;
+
+        prison->caches = cc->next;
+        free(cc);
+    }
+    while (prison->slabs) {
+        struct prison_cell_slab *slab = prison->slabs;
+
+        prison->slabs = slab->next;
+        free(slab);
+    }
+
+    for (unsigned int i = 0; i < prison->num_locks; i++) {
         pthread_spin_destroy(&prison->regions[i].lock);
+#ifdef BIO_PRISON_HASH_INDEX
+        free(prison->regions[i].cells.slots);
+#endif
+    }
+    pthread_spin_destroy(&prison->free_lock);
 
     free(prison->regions);
     free(prison->cell_pool);
     free(prison);
 }
 
-struct dm_bio_prison_cell *dm_bio_prison_alloc_cell(struct dm_bio_prison *prison, gfp_t gfp) {
-    if (prison->cell_pool_used >= prison->cell_pool_size)
+/*
+ * Cell allocation, mempool style. The MIN_CELLS reserve is carved out at
+ * creation and cells are never handed back to malloc, so at least that
+ * many can always be allocated. Freed cells go on a shared free list, and
+ * only when it is empty is another slab of cells malloc'd.
+ *
+ * In front of the free list each thread keeps a small cache, so that
+ * steady detain/release traffic allocates and frees without any lock.
+ * Threads refill and drain their cache CELL_CACHE_BATCH cells at a time.
+ */
+
+// Called at thread exit: hand the thread's cached cells back
+static void prison_cell_cache_release(void *data) {
+    struct prison_cell_cache *cc = data;
+    struct dm_bio_prison *prison = cc->prison;
+    struct prison_cell_cache **pp;
+
+    pthread_spin_lock(&prison->free_lock);
+    for (pp = &prison->caches; *pp != cc; pp = &(*pp)->next)
+        ;
+    *pp = cc->next;
+    while (cc->nr) {
+        struct dm_bio_prison_cell *cell = cc->cells[--cc->nr];
+
+        cell->next_free = prison->free_cells;
+        prison->free_cells = cell;
+        prison->nr_free++;
+    }
+    pthread_spin_unlock(&prison->free_lock);
+    free(cc);
+}
+
+static struct prison_cell_cache *prison_cell_cache_get(struct dm_bio_prison *prison) {
+    struct prison_cell_cache *cc = pthread_getspecific(prison->cache_key);
+
+    if (cc)
+        return cc;
+
+    cc = calloc(1, sizeof(*cc));
+    if (!cc)
+        return NULL;
+    cc->prison = prison;
+    if (pthread_setspecific(prison->cache_key, cc)) {
+        free(cc);
         return NULL;
-    return &prison->cell_pool[prison->cell_pool_used++];
+    }
+
+    pthread_spin_lock(&prison->free_lock);
+    cc->next = prison->caches;
+    prison->caches = cc;
+    pthread_spin_unlock(&prison->free_lock);
+    return cc;
+}
+
+// Add a freshly malloc'd slab of cells to the free list
+static bool prison_cell_grow(struct dm_bio_prison *prison) {
+    struct prison_cell_slab *slab = calloc(1, sizeof(*slab));
+
+    if (!slab)
+        return false;
+
+    for (int i = 0; i < CELL_SLAB_SIZE - 1; i++)
+        slab->cells[i].next_free = &slab->cells[i + 1];
+
+    pthread_spin_lock(&prison->free_lock);
+    slab->next = prison->slabs;
+    prison->slabs = slab;
+    slab->cells[CELL_SLAB_SIZE - 1].next_free = prison->free_cells;
+    prison->free_cells = &slab->cells[0];
+    prison->nr_free += CELL_SLAB_SIZE;
+    prison->nr_cells += CELL_SLAB_SIZE;
+    pthread_spin_unlock(&prison->free_lock);
+    return true;
+}
+
+struct dm_bio_prison_cell *dm_bio_prison_alloc_cell(struct dm_bio_prison *prison, gfp_t gfp) {
+    struct prison_cell_cache *cc = prison_cell_cache_get(prison);
+    struct dm_bio_prison_cell *cell;
+    unsigned int want = cc ? CELL_CACHE_BATCH : 1;
+
+    if (cc && cc->nr)
+        return cc->cells[--cc->nr];
+
+    pthread_spin_lock(&prison->free_lock);
+    while (!prison->free_cells) {
+        pthread_spin_unlock(&prison->free_lock);
+        if (!prison_cell_grow(prison))
+            return NULL;
+        pthread_spin_lock(&prison->free_lock);
+    }
+
+    cell = prison->free_cells;
+    prison->free_cells = cell->next_free;
+    prison->nr_free--;
+    while (cc && cc->nr < want - 1 && prison->free_cells) {
+        cc->cells[cc->nr++] = prison->free_cells;
+        prison->free_cells = prison->free_cells->next_free;
+        prison->nr_free--;
+    }
+    pthread_spin_unlock(&prison->free_lock);
+    return cell;
 }
 
 void dm_bio_prison_free_cell(struct dm_bio_prison *prison, struct dm_bio_prison_cell *cell) {
-    // In this simplified version, we don't actually free cells
-    prison->cell_pool_used--;
+    struct prison_cell_cache *cc = prison_cell_cache_get(prison);
+
+    if (cc && cc->nr < CELL_CACHE_SIZE) {
+        cc->cells[cc->nr++] = cell;
+        return;
+    }
+
+    pthread_spin_lock(&prison->free_lock);
+    cell->next_free = prison->free_cells;
+    prison->free_cells = cell;
+    prison->nr_free++;
+    while (cc && cc->nr > CELL_CACHE_SIZE - CELL_CACHE_BATCH) {
+        cell = cc->cells[--cc->nr];
+        cell->next_free = prison->free_cells;
+        prison->free_cells = cell;
+        prison->nr_free++;
+    }
+    pthread_spin_unlock(&prison->free_lock);
 }
 
 static int cmp_keys(struct dm_cell_key *lhs, struct dm_cell_key *rhs) {
@@ -173,6 +679,10 @@ static void __setup_new_cell(struct dm_cell_key *key, struct bio *holder,
     memcpy(&cell->key, key, sizeof(cell->key));
     cell->holder = holder;
     bio_list_init(&cell->bios);
+    cell->exclusive_lock = false;
+    cell->exclusive_level = 0;
+    cell->shared_count = 0;
+    cell->quiesce_continuation = NULL;
 }
 
 bool dm_cell_key_has_valid_range(struct dm_cell_key *key) {
@@ -181,6 +691,1319 @@ bool dm_cell_key_has_valid_range(struct dm_cell_key *key) {
            !(key->block_begin & (BIO_PRISON_MAX_RANGE - 1));
 }
 
+/*
+ * Keys never span a BIO_PRISON_MAX_RANGE boundary, so every key for the
+ * same range of blocks hashes to the same region. num_locks must be a
+ * power of two.
+ */
+static inline unsigned int dm_hash_locks_index(dm_block_t block, unsigned int num_locks) {
+    dm_block_t h1 = (block * DM_HASH_LOCKS_MULT) >> DM_HASH_LOCKS_SHIFT;
+    dm_block_t h2 = h1 >> DM_HASH_LOCKS_SHIFT;
+
+    return (h1 ^ h2) & (num_locks - 1);
+}
+
+static unsigned int lock_nr(struct dm_cell_key *key, unsigned int num_locks) {
+    return dm_hash_locks_index(key->block_begin >> BIO_PRISON_MAX_RANGE_SHIFT, num_locks);
+}
+
+#ifdef BIO_PRISON_HASH_INDEX
+/*
+ * Linear probing with backward-shift deletion, so there are no tombstones
+ * and a probe stops at the first empty slot. The table doubles past 3/4
+ * full and halves below 1/8 full, and always keeps one slot empty.
+ *
+ * Nothing is allocated or freed under the region lock. An insert or erase
+ * only notes the size the table wants (__region_resize_wanted()), and the
+ * caller resizes with region_resize() once it has dropped the lock. Until
+ * then inserts go into the old table while it has room; a full table
+ * makes the insert return -EAGAIN so that the caller grows it and retries.
+ */
+static inline uint64_t hash_cell_key(struct dm_cell_key *key) {
+    uint64_t h = key->block_begin * GOLDEN_RATIO_64;
+
+    h ^= (key->block_end - key->block_begin) ^ ((uint64_t)key->dev << 32) ^ key->virtual;
+    h *= GOLDEN_RATIO_64;
+    return h ^ (h >> 32);
+}
+
+// Size the region's table should move to, or 0 to keep it; region lock held
+static unsigned int __region_resize_wanted(struct prison_region *region) {
+    struct prison_hash *t = &region->cells;
+    unsigned int size = t->slots ? t->mask + 1 : 0;
+
+    if ((t->nr + 1) * 4 > size * 3)
+        return size ? size * 2 : PRISON_HASH_MIN_SLOTS;
+    if (size > PRISON_HASH_MIN_SLOTS && t->nr * 8 < size)
+        return size / 2;
+    return 0;
+}
+
+// Rehash into slots, an empty table of nr_slots; returns the old table
+static struct prison_hash_slot *__prison_hash_swap(struct prison_hash *t,
+                                                   struct prison_hash_slot *slots,
+                                                   unsigned int nr_slots) {
+    struct prison_hash_slot *old = t->slots;
+    unsigned int i, j;
+
+    for (i = 0; old && i <= t->mask; i++) {
+        if (!old[i].cell)
+            continue;
+        for (j = old[i].hash & (nr_slots - 1); slots[j].cell; j = (j + 1) & (nr_slots - 1))
+            ;
+        slots[j] = old[i];
+    }
+
+    t->slots = slots;
+    t->mask = nr_slots - 1;
+    return old;
+}
+
+/*
+ * Move the region's table to nr_slots slots, as asked for by
+ * __region_resize_wanted(). Only the rehash runs under the region lock.
+ * If the table changed in the meantime and no longer wants that size,
+ * the new table is dropped. Returns false if the allocation failed; a
+ * failed shrink just keeps the larger table until the next erase asks
+ * again.
+ */
+static bool region_resize(struct prison_region *region, unsigned int nr_slots) {
+    struct prison_hash_slot *slots;
+
+    if (!nr_slots)
+        return true;
+    slots = calloc(nr_slots, sizeof(*slots));
+    if (!slots)
+        return false;
+
+    pthread_spin_lock(&region->lock);
+    if (__region_resize_wanted(region) == nr_slots)
+        slots = __prison_hash_swap(&region->cells, slots, nr_slots);
+    pthread_spin_unlock(&region->lock);
+
+    free(slots);
+    return true;
+}
+
+/*
+ * Find the cell for key and return 1, or set up cell_prealloc for key,
+ * insert it and return 0. Returns -EAGAIN if the table has no room.
+ */
+static int __find_or_insert(struct prison_region *region, struct dm_cell_key *key,
+                            struct dm_bio_prison_cell *cell_prealloc,
+                            struct dm_bio_prison_cell **cell_result) {
+    struct prison_hash *t = &region->cells;
+    uint64_t hash = hash_cell_key(key);
+    unsigned int i;
+
+    for (i = hash & t->mask; t->slots && t->slots[i].cell; i = (i + 1) & t->mask) {
+        struct dm_bio_prison_cell *cell = t->slots[i].cell;
+
+        if (t->slots[i].hash == hash && !cmp_keys(key, &cell->key)) {
+            *cell_result = cell;
+            return 1;
+        }
+    }
+
+    // The probe ended on an empty slot, but one must always stay empty
+    if (!t->slots || t->nr + 1 > t->mask)
+        return -EAGAIN;
+
+    __setup_new_cell(key, NULL, cell_prealloc);
+    t->slots[i].hash = hash;
+    t->slots[i].cell = cell_prealloc;
+    t->nr++;
+    *cell_result = cell_prealloc;
+    return 0;
+}
+
+static void __cell_erase(struct prison_region *region, struct dm_bio_prison_cell *cell) {
+    struct prison_hash *t = &region->cells;
+    unsigned int i, j, home;
+
+    for (i = hash_cell_key(&cell->key) & t->mask; t->slots[i].cell != cell; i = (i + 1) & t->mask)
+        ;
+
+    // Pull back any later entry in the cluster whose home is at or before i
+    for (j = (i + 1) & t->mask; t->slots[j].cell; j = (j + 1) & t->mask) {
+        home = t->slots[j].hash & t->mask;
+        if (((j - home) & t->mask) >= ((j - i) & t->mask)) {
+            t->slots[i] = t->slots[j];
+            i = j;
+        }
+    }
+    t->slots[i].cell = NULL;
+    t->nr--;
+}
+#else
+/*
+ * Find the cell for key and return 1, or set up cell_prealloc for key,
+ * insert it and return 0.
+ */
+static int __find_or_insert(struct prison_region *region, struct dm_cell_key *key,
+                            struct dm_bio_prison_cell *cell_prealloc,
+                            struct dm_bio_prison_cell **cell_result) {
+    struct rb_root *root = &region->cell;
+    struct rb_node **new = &root->rb_node, *parent = NULL;
+    int r;
+
+    while (*new) {
+        struct dm_bio_prison_cell *cell =
+            rb_entry(*new, struct dm_bio_prison_cell, node);
+
+        r = cmp_keys(key, &cell->key);
+        parent = *new;
+        if (r < 0) {
+            new = &(*new)->rb_left;
+        } else if (r > 0) {
+            new = &(*new)->rb_right;
+        } else {
+            *cell_result = cell;
+            return 1;
+        }
+    }
+
+    __setup_new_cell(key, NULL, cell_prealloc);
+    *cell_result = cell_prealloc;
+    rb_link_node(&cell_prealloc->node, parent, new);
+    rb_insert_color(&cell_prealloc->node, root);
+    return 0;
+}
+
+static void __cell_erase(struct prison_region *region, struct dm_bio_prison_cell *cell) {
+    rb_erase(&cell->node, &region->cell);
+}
+
+// The rb-tree allocates nothing, so there is never a table to resize
+static inline unsigned int __region_resize_wanted(struct prison_region *region) {
+    return 0;
+}
+
+static inline bool region_resize(struct prison_region *region, unsigned int nr_slots) {
+    return true;
+}
+#endif
+
+// Find the cell for key, or insert cell_prealloc with inmate as holder
+static int __bio_detain(struct prison_region *region, struct dm_cell_key *key,
+                        struct bio *inmate,
+                        struct dm_bio_prison_cell *cell_prealloc,
+                        struct dm_bio_prison_cell **cell_result) {
+    int r = __find_or_insert(region, key, cell_prealloc, cell_result);
+
+    if (r == 1 && inmate)
+        bio_list_add(&(*cell_result)->bios, inmate);
+    else if (r == 0)
+        (*cell_result)->holder = inmate;
+    return r;
+}
+
+static int bio_detain(struct dm_bio_prison *prison, struct dm_cell_key *key,
+                      struct bio *inmate,
+                      struct dm_bio_prison_cell *cell_prealloc,
+                      struct dm_bio_prison_cell **cell_result) {
+    struct prison_region *region = &prison->regions[lock_nr(key, prison->num_locks)];
+    unsigned int resize;
+    int r;
+
+retry:
+    pthread_spin_lock(&region->lock);
+    r = __bio_detain(region, key, inmate, cell_prealloc, cell_result);
+    resize = __region_resize_wanted(region);
+    pthread_spin_unlock(&region->lock);
+
+    if (!region_resize(region, resize) && r == -EAGAIN)
+        return -ENOMEM;
+    if (r == -EAGAIN)
+        goto retry;
+    return r;
+}
+
+/*
+ * Detain inmate in the cell for key. Returns 0 if cell_prealloc was used
+ * to create the cell, with inmate as its holder, or 1 if a cell already
+ * existed and inmate was queued on it. Either way *cell_result is the
+ * cell; the caller frees cell_prealloc when it was not used. The hash
+ * index can also fail with -ENOMEM if its table cannot grow.
+ */
+int dm_bio_detain(struct dm_bio_prison *prison, struct dm_cell_key *key,
+                  struct bio *inmate,
+                  struct dm_bio_prison_cell *cell_prealloc,
+                  struct dm_bio_prison_cell **cell_result) {
+    return bio_detain(prison, key, inmate, cell_prealloc, cell_result);
+}
+
+// As dm_bio_detain(), but only takes the cell without queueing a bio
+int dm_get_cell(struct dm_bio_prison *prison, struct dm_cell_key *key,
+                struct dm_bio_prison_cell *cell_prealloc,
+                struct dm_bio_prison_cell **cell_result) {
+    return bio_detain(prison, key, NULL, cell_prealloc, cell_result);
+}
+
+static void __cell_release(struct prison_region *region, struct dm_bio_prison_cell *cell,
+                           struct bio_list *bios) {
+    __cell_erase(region, cell);
+
+    if (bios) {
+        if (cell->holder)
+            bio_list_add(bios, cell->holder);
+        bio_list_merge(bios, &cell->bios);
+    }
+}
+
+// Remove the cell and move its holder, then the queued bios, onto bios
+void dm_cell_release(struct dm_bio_prison *prison, struct dm_bio_prison_cell *cell,
+                     struct bio_list *bios) {
+    struct prison_region *region = &prison->regions[lock_nr(&cell->key, prison->num_locks)];
+    unsigned int resize;
+
+    pthread_spin_lock(&region->lock);
+    __cell_release(region, cell, bios);
+    resize = __region_resize_wanted(region);
+    pthread_spin_unlock(&region->lock);
+    region_resize(region, resize);
+}
+
+static void __cell_release_no_holder(struct prison_region *region,
+                                     struct dm_bio_prison_cell *cell,
+                                     struct bio_list *inmates) {
+    __cell_erase(region, cell);
+    bio_list_merge(inmates, &cell->bios);
+}
+
+// Remove the cell and move only the queued bios onto inmates
+void dm_cell_release_no_holder(struct dm_bio_prison *prison,
+                               struct dm_bio_prison_cell *cell,
+                               struct bio_list *inmates) {
+    struct prison_region *region = &prison->regions[lock_nr(&cell->key, prison->num_locks)];
+    unsigned int resize;
+
+    pthread_spin_lock(&region->lock);
+    __cell_release_no_holder(region, cell, inmates);
+    resize = __region_resize_wanted(region);
+    pthread_spin_unlock(&region->lock);
+    region_resize(region, resize);
+}
+
+/*
+ * Prison v2. A cell is a lock on a range of blocks: any number of shared
+ * holders, plus at most one exclusive holder with a lock level. A shared
+ * request at a level no higher than the exclusive lock's is queued on the
+ * cell; one above it still goes through, so readers never serialize
+ * behind each other and only block behind writers that outrank them.
+ */
+static bool __get_v2(struct prison_region *region, struct dm_cell_key *key,
+                     unsigned int lock_level, struct bio *inmate,
+                     struct dm_bio_prison_cell *cell_prealloc,
+                     struct dm_bio_prison_cell **cell_result) {
+    struct dm_bio_prison_cell *cell;
+
+    if (__find_or_insert(region, key, cell_prealloc, cell_result) < 0) {
+        *cell_result = NULL;
+        return false;
+    }
+
+    cell = *cell_result;
+    if (cell->exclusive_lock && lock_level <= cell->exclusive_level) {
+        bio_list_add(&cell->bios, inmate);
+        return false;
+    }
+
+    cell->shared_count++;
+    return true;
+}
+
+/*
+ * Take a shared lock on the cell for key. Returns true if granted, or
+ * false if inmate was queued behind an exclusive holder at lock_level or
+ * above; unlocking that holder hands the bio back. With the hash index a
+ * false return with *cell_result NULL means the table could not grow and
+ * the bio was not queued. The caller frees cell_prealloc if unused.
+ */
+bool dm_cell_get_v2(struct dm_bio_prison *prison, struct dm_cell_key *key,
+                    unsigned int lock_level, struct bio *inmate,
+                    struct dm_bio_prison_cell *cell_prealloc,
+                    struct dm_bio_prison_cell **cell_result) {
+    struct prison_region *region = &prison->regions[lock_nr(key, prison->num_locks)];
+    unsigned int resize;
+    bool r;
+
+retry:
+    pthread_spin_lock(&region->lock);
+    r = __get_v2(region, key, lock_level, inmate, cell_prealloc, cell_result);
+    resize = __region_resize_wanted(region);
+    pthread_spin_unlock(&region->lock);
+
+    if (region_resize(region, resize) && !r && !*cell_result)
+        goto retry;
+    return r;
+}
+
+/*
+ * Drop a shared holder. When the last one goes and an exclusive holder
+ * is waiting, its continuation is handed back in *continuation for the
+ * caller to run once the region lock is dropped.
+ */
+static bool __put_v2(struct prison_region *region, struct dm_bio_prison_cell *cell,
+                     struct work_struct **continuation) {
+    if (!cell->shared_count) {
+        fprintf(stderr, "dm_cell_put_v2: cell has no shared holders\n");
+        abort();
+    }
+
+    cell->shared_count--;
+    if (cell->shared_count)
+        return false;
+
+    if (cell->exclusive_lock) {
+        // The exclusive holder was waiting for us to drain
+        *continuation = cell->quiesce_continuation;
+        cell->quiesce_continuation = NULL;
+        return false;
+    }
+
+    __cell_erase(region, cell);
+    return true;
+}
+
+/*
+ * Drop a shared lock. Returns true if the cell is now unused and was freed
+ * from the index. A pending quiesce continuation runs here, outside the
+ * region lock, so it may call back into the prison.
+ */
+bool dm_cell_put_v2(struct dm_bio_prison *prison, struct dm_bio_prison_cell *cell) {
+    struct prison_region *region = &prison->regions[lock_nr(&cell->key, prison->num_locks)];
+    struct work_struct *continuation = NULL;
+    unsigned int resize;
+    bool r;
+
+    pthread_spin_lock(&region->lock);
+    r = __put_v2(region, cell, &continuation);
+    resize = __region_resize_wanted(region);
+    pthread_spin_unlock(&region->lock);
+    region_resize(region, resize);
+
+    if (continuation)
+        continuation->func(continuation);
+    return r;
+}
+
+static int __lock_v2(struct prison_region *region, struct dm_cell_key *key,
+                     unsigned int lock_level,
+                     struct dm_bio_prison_cell *cell_prealloc,
+                     struct dm_bio_prison_cell **cell_result) {
+    int r = __find_or_insert(region, key, cell_prealloc, cell_result);
+    struct dm_bio_prison_cell *cell = *cell_result;
+
+    if (r < 0)
+        return r;
+    if (r == 1 && cell->exclusive_lock)
+        return -EBUSY;
+
+    cell->exclusive_lock = true;
+    cell->exclusive_level = lock_level;
+    return cell->shared_count > 0;
+}
+
+/*
+ * Take the exclusive lock on the cell for key at lock_level. Returns 0 if
+ * the cell is held exclusively, 1 if shared holders must drain first (see
+ * dm_cell_quiesce_v2()), or -EBUSY if another exclusive holder has it.
+ */
+int dm_cell_lock_v2(struct dm_bio_prison *prison, struct dm_cell_key *key,
+                    unsigned int lock_level,
+                    struct dm_bio_prison_cell *cell_prealloc,
+                    struct dm_bio_prison_cell **cell_result) {
+    struct prison_region *region = &prison->regions[lock_nr(key, prison->num_locks)];
+    unsigned int resize;
+    int r;
+
+retry:
+    pthread_spin_lock(&region->lock);
+    r = __lock_v2(region, key, lock_level, cell_prealloc, cell_result);
+    resize = __region_resize_wanted(region);
+    pthread_spin_unlock(&region->lock);
+
+    if (!region_resize(region, resize) && r == -EAGAIN)
+        return -ENOMEM;
+    if (r == -EAGAIN)
+        goto retry;
+    return r;
+}
+
+/*
+ * Run continuation once the last shared holder drops the cell, which may
+ * be immediately. Only the exclusive holder calls this.
+ */
+void dm_cell_quiesce_v2(struct dm_bio_prison *prison, struct dm_bio_prison_cell *cell,
+                        struct work_struct *continuation) {
+    unsigned int l = lock_nr(&cell->key, prison->num_locks);
+    bool quiesced;
+
+    pthread_spin_lock(&prison->regions[l].lock);
+    quiesced = !cell->shared_count;
+    if (!quiesced)
+        cell->quiesce_continuation = continuation;
+    pthread_spin_unlock(&prison->regions[l].lock);
+
+    if (quiesced)
+        continuation->func(continuation);
+}
+
+/*
+ * Change the level of a held exclusive lock. Raising it makes later
+ * shared requests at the new level queue too; bios already granted keep
+ * their shared locks. Returns -EINVAL if the cell is not locked.
+ */
+int dm_cell_lock_promote_v2(struct dm_bio_prison *prison, struct dm_bio_prison_cell *cell,
+                            unsigned int new_lock_level) {
+    unsigned int l = lock_nr(&cell->key, prison->num_locks);
+    int r = 0;
+
+    pthread_spin_lock(&prison->regions[l].lock);
+    if (!cell->exclusive_lock)
+        r = -EINVAL;
+    else
+        cell->exclusive_level = new_lock_level;
+    if (!r && cell->shared_count)
+        r = 1;
+    pthread_spin_unlock(&prison->regions[l].lock);
+    return r;
+}
+
+static bool __unlock_v2(struct prison_region *region, struct dm_bio_prison_cell *cell,
+                        struct bio_list *bios) {
+    if (!cell->exclusive_lock) {
+        fprintf(stderr, "dm_cell_unlock_v2: cell is not locked\n");
+        abort();
+    }
+
+    bio_list_merge(bios, &cell->bios);
+    bio_list_init(&cell->bios);
+
+    if (cell->shared_count) {
+        cell->exclusive_lock = false;
+        return false;
+    }
+
+    __cell_erase(region, cell);
+    return true;
+}
+
+/*
+ * Drop the exclusive lock and move the bios queued behind it onto bios
+ * for resubmission. Returns true if the cell is now unused and was freed
+ * from the index, in which case the caller frees it.
+ */
+bool dm_cell_unlock_v2(struct dm_bio_prison *prison, struct dm_bio_prison_cell *cell,
+                       struct bio_list *bios) {
+    struct prison_region *region = &prison->regions[lock_nr(&cell->key, prison->num_locks)];
+    unsigned int resize;
+    bool r;
+
+    pthread_spin_lock(&region->lock);
+    r = __unlock_v2(region, cell, bios);
+    resize = __region_resize_wanted(region);
+    pthread_spin_unlock(&region->lock);
+    region_resize(region, resize);
+    return r;
+}
+
+/*
+ * Deferred set. In-flight bios join the current generation entry with
+ * dm_deferred_entry_inc() and leave it with dm_deferred_entry_dec(). Work
+ * added with dm_deferred_set_add_work() is parked on the current entry,
+ * which then closes so later bios join the next one; the work comes back
+ * from dm_deferred_entry_dec() once every entry up to and including that
+ * one has drained. So quiescing a block only waits for the I/O that was
+ * already in flight, never for I/O issued afterwards.
+ *
+ * The entries form a ring. If the next entry is still busy the current
+ * one stays open, so generations merge rather than wrap.
+ */
+#define DEFERRED_SET_SIZE 64
+
+struct dm_deferred_set;
+
+struct dm_deferred_entry {
+    struct dm_deferred_set *ds;
+    unsigned int count;
+    struct list_head work_items;
+};
+
+struct dm_deferred_set {
+    pthread_spinlock_t lock;
+    unsigned int current_entry;
+    unsigned int sweeper;
+    struct dm_deferred_entry entries[DEFERRED_SET_SIZE];
+};
+
+struct dm_deferred_set *dm_deferred_set_create(void) {
+    struct dm_deferred_set *ds = calloc(1, sizeof(*ds));
+
+    if (!ds)
+        return NULL;
+
+    pthread_spin_init(&ds->lock, PTHREAD_PROCESS_PRIVATE);
+    for (int i = 0; i < DEFERRED_SET_SIZE; i++) {
+        ds->entries[i].ds = ds;
+        INIT_LIST_HEAD(&ds->entries[i].work_items);
+    }
+    return ds;
+}
+
+void dm_deferred_set_destroy(struct dm_deferred_set *ds) {
+    if (!ds)
+        return;
+
+    pthread_spin_destroy(&ds->lock);
+    free(ds);
+}
+
+struct dm_deferred_entry *dm_deferred_entry_inc(struct dm_deferred_set *ds) {
+    struct dm_deferred_entry *entry;
+
+    pthread_spin_lock(&ds->lock);
+    entry = &ds->entries[ds->current_entry];
+    entry->count++;
+    pthread_spin_unlock(&ds->lock);
+    return entry;
+}
+
+static unsigned int ds_next(unsigned int index) {
+    return (index + 1) % DEFERRED_SET_SIZE;
+}
+
+// Collect the work of every drained entry from the sweeper onwards
+static void __sweep(struct dm_deferred_set *ds, struct list_head *head) {
+    while (ds->sweeper != ds->current_entry && !ds->entries[ds->sweeper].count) {
+        list_splice_tail_init(&ds->entries[ds->sweeper].work_items, head);
+        ds->sweeper = ds_next(ds->sweeper);
+    }
+
+    if (ds->sweeper == ds->current_entry && !ds->entries[ds->sweeper].count)
+        list_splice_tail_init(&ds->entries[ds->sweeper].work_items, head);
+}
+
+// Leave entry, moving any work that is now runnable onto head
+void dm_deferred_entry_dec(struct dm_deferred_entry *entry, struct list_head *head) {
+    struct dm_deferred_set *ds = entry->ds;
+
+    pthread_spin_lock(&ds->lock);
+    if (!entry->count) {
+        fprintf(stderr, "dm_deferred_entry_dec: entry is not in use\n");
+        abort();
+    }
+    --entry->count;
+    __sweep(ds, head);
+    pthread_spin_unlock(&ds->lock);
+}
+
+/*
+ * Returns 1 if work was queued behind the bios now in flight, or 0 if
+ * nothing is in flight and the caller should run the work itself.
+ */
+int dm_deferred_set_add_work(struct dm_deferred_set *ds, struct list_head *work) {
+    unsigned int next_entry;
+    int r = 1;
+
+    pthread_spin_lock(&ds->lock);
+    if (ds->sweeper == ds->current_entry && !ds->entries[ds->current_entry].count) {
+        r = 0;
+    } else {
+        list_add_tail(work, &ds->entries[ds->current_entry].work_items);
+        next_entry = ds_next(ds->current_entry);
+        if (!ds->entries[next_entry].count)
+            ds->current_entry = next_entry;
+    }
+    pthread_spin_unlock(&ds->lock);
+    return r;
+}
+
+#ifdef BIO_PRISON_HASH_INDEX
+#define PRISON_INDEX_NAME "hash"
+
+// Every entry must be reachable from its home slot without an empty slot
+static bool region_is_valid(struct prison_region *region) {
+    struct prison_hash *t = &region->cells;
+    unsigned int i, j, nr = 0;
+
+    for (i = 0; t->slots && i <= t->mask; i++) {
+        if (!t->slots[i].cell)
+            continue;
+        if (t->slots[i].hash != hash_cell_key(&t->slots[i].cell->key))
+            return false;
+        for (j = t->slots[i].hash & t->mask; j != i; j = (j + 1) & t->mask)
+            if (!t->slots[j].cell)
+                return false;
+        nr++;
+    }
+    return nr == t->nr;
+}
+
+// Empty, and erasing the cells shrank the table back down
+static bool region_is_empty(struct prison_region *region) {
+    return region->cells.nr == 0 &&
+           (!region->cells.slots || region->cells.mask + 1 == PRISON_HASH_MIN_SLOTS);
+}
+#else
+#define PRISON_INDEX_NAME "rb-tree"
+
+// Check red-black invariants, returning the black height or -1
+static int rb_check(struct rb_node *node, struct rb_node *parent) {
+    int left, right;
+
+    if (!node)
+        return 1;
+    if (node->rb_parent != parent)
+        return -1;
+    if (node->rb_color == RB_RED &&
+        !(rb_is_black(node->rb_left) && rb_is_black(node->rb_right)))
+        return -1;
+    left = rb_check(node->rb_left, node);
+    right = rb_check(node->rb_right, node);
+    if (left < 0 || left != right)
+        return -1;
+    return left + (node->rb_color == RB_BLACK);
+}
+
+static bool region_is_valid(struct prison_region *region) {
+    struct rb_node *root = region->cell.rb_node;
+
+    return rb_check(root, NULL) >= 0 && (!root || root->rb_color == RB_BLACK);
+}
+
+static bool region_is_empty(struct prison_region *region) {
+    return region->cell.rb_node == NULL;
+}
+#endif
+
+static bool prison_is_valid(struct dm_bio_prison *prison) {
+    for (unsigned int i = 0; i < prison->num_locks; i++) {
+        if (!region_is_valid(&prison->regions[i]))
+            return false;
+    }
+    return true;
+}
+
+// Detain several bios on one key and release them in arrival order
+int test_detain_release(void) {
+    struct dm_bio_prison *prison = dm_bio_prison_create();
+    struct dm_cell_key key = { .virtual = 0, .dev = 1, .block_begin = 2048, .block_end = 2049 };
+    struct dm_bio_prison_cell *prealloc, *cell, *first = NULL;
+    struct bio bios[4] = { { 0 } };
+    struct bio_list out;
+    struct bio *bio;
+    int i, r, failures = 0;
+
+    printf("\nTesting dm_bio_detain/dm_cell_release...\n");
+    if (!prison)
+        return 1;
+
+    for (i = 0; i < 4; i++) {
+        prealloc = dm_bio_prison_alloc_cell(prison, GFP_KERNEL);
+        r = dm_bio_detain(prison, &key, &bios[i], prealloc, &cell);
+        if (r)
+            dm_bio_prison_free_cell(prison, prealloc);
+        else
+            first = cell;
+        if (r != (i > 0) || cell != first) {
+            printf("detain %d returned %d: FAIL\n", i, r);
+            failures++;
+        }
+    }
+
+    bio_list_init(&out);
+    dm_cell_release(prison, cell, &out);
+    for (i = 0; (bio = bio_list_pop(&out)); i++)
+        failures += bio != &bios[i];
+    failures += i != 4;
+    printf("holder then inmates in order: %s\n", i == 4 && !failures ? "PASS" : "FAIL");
+
+    // The key is free again, so the next detain creates a fresh cell
+    prealloc = dm_bio_prison_alloc_cell(prison, GFP_KERNEL);
+    r = dm_bio_detain(prison, &key, &bios[0], prealloc, &cell);
+    failures += r != 0;
+    dm_bio_detain(prison, &key, &bios[1], NULL, &cell);
+    bio_list_init(&out);
+    dm_cell_release_no_holder(prison, cell, &out);
+    bio = bio_list_pop(&out);
+    r = bio == &bios[1] && !bio_list_pop(&out);
+    printf("release without holder: %s\n", r ? "PASS" : "FAIL");
+    failures += !r;
+
+    dm_bio_prison_destroy(prison);
+    return failures;
+}
+
+// Detain many keys across regions, then release them in a scrambled order
+int test_many_cells(void) {
+    struct dm_bio_prison *prison = dm_bio_prison_create();
+    static struct dm_bio_prison_cell *cells[MIN_CELLS];
+    static struct bio bios[MIN_CELLS];
+    struct dm_bio_prison_cell *cell;
+    struct bio_list out;
+    int i, failures = 0;
+
+    printf("\nTesting %d cells across %u regions...\n", MIN_CELLS,
+           prison ? prison->num_locks : 0);
+    if (!prison)
+        return 1;
+
+    for (i = 0; i < MIN_CELLS; i++) {
+        struct dm_cell_key key = {
+            .virtual = 0, .dev = i % 3,
+            .block_begin = (dm_block_t)(i * 37 % MIN_CELLS) << BIO_PRISON_MAX_RANGE_SHIFT,
+        };
+
+        key.block_end = key.block_begin + BIO_PRISON_MAX_RANGE;
+        cells[i] = dm_bio_prison_alloc_cell(prison, GFP_KERNEL);
+        if (dm_bio_detain(prison, &key, &bios[i], cells[i], &cell) || cell != cells[i])
+            failures++;
+    }
+    failures += !prison_is_valid(prison);
+
+    for (i = 0; i < MIN_CELLS; i++) {
+        int n = i * 389 % MIN_CELLS;
+
+        bio_list_init(&out);
+        dm_cell_release(prison, cells[n], &out);
+        if (bio_list_pop(&out) != &bios[n] || out.head)
+            failures++;
+        if (i % 97 == 0 && !prison_is_valid(prison))
+            failures++;
+    }
+    for (i = 0; i < (int)prison->num_locks; i++)
+        failures += !region_is_empty(&prison->regions[i]);
+
+    printf("insert/erase keep the %s index consistent: %s\n", PRISON_INDEX_NAME,
+           failures ? "FAIL" : "PASS");
+    dm_bio_prison_destroy(prison);
+    return failures;
+}
+
+struct quiesce_work {
+    struct work_struct work;
+    int ran;
+};
+
+static void quiesce_done(struct work_struct *work) {
+    container_of(work, struct quiesce_work, work)->ran++;
+}
+
+// A continuation that finishes the exclusive holder's work by unlocking
+struct unlock_work {
+    struct work_struct work;
+    struct dm_bio_prison *prison;
+    struct dm_bio_prison_cell *cell;
+    struct bio_list bios;
+    int released;
+};
+
+static void unlock_on_quiesce(struct work_struct *work) {
+    struct unlock_work *uw = container_of(work, struct unlock_work, work);
+
+    bio_list_init(&uw->bios);
+    uw->released = dm_cell_unlock_v2(uw->prison, uw->cell, &uw->bios);
+}
+
+// Shared holders, an exclusive holder waiting for them, and queued readers
+int test_prison_v2(void) {
+    struct dm_bio_prison *prison = dm_bio_prison_create();
+    struct dm_cell_key key = { .virtual = 1, .dev = 2, .block_begin = 4096, .block_end = 4097 };
+    struct quiesce_work qw = { .work = { .func = quiesce_done } };
+    struct unlock_work uw = { .work = { .func = unlock_on_quiesce }, .prison = prison,
+                              .released = -1 };
+    struct dm_bio_prison_cell *prealloc, *cell, *shared = NULL, *other;
+    struct bio readers[3] = { { 0 } }, late = { 0 }, urgent = { 0 };
+    struct bio_list out;
+    int i, r, failures = 0;
+
+    printf("\nTesting prison v2 shared/exclusive cells...\n");
+    if (!prison)
+        return 1;
+
+    // Readers of the same block all get in
+    for (i = 0; i < 3; i++) {
+        prealloc = dm_bio_prison_alloc_cell(prison, GFP_KERNEL);
+        if (!dm_cell_get_v2(prison, &key, 0, &readers[i], prealloc, &cell))
+            failures++;
+        if (i == 0)
+            shared = cell;
+        else
+            dm_bio_prison_free_cell(prison, prealloc);
+        failures += cell != shared;
+    }
+    printf("three shared holders: %s\n", !failures && shared->shared_count == 3 ? "PASS" : "FAIL");
+    failures += shared->shared_count != 3;
+
+    // A writer at level 1 has to wait for them to drain
+    r = dm_cell_lock_v2(prison, &key, 1, NULL, &cell);
+    failures += r != 1 || cell != shared;
+    failures += dm_cell_lock_v2(prison, &key, 1, NULL, &other) != -EBUSY;
+    dm_cell_quiesce_v2(prison, cell, &qw.work);
+
+    // Level 0 readers now queue, level 2 readers still get a shared lock
+    failures += dm_cell_get_v2(prison, &key, 0, &late, NULL, &cell);
+    failures += !dm_cell_get_v2(prison, &key, 2, &urgent, NULL, &cell);
+    for (i = 0; i < 4; i++)
+        failures += dm_cell_put_v2(prison, cell);
+    printf("quiesce after the last shared put: %s\n", qw.ran == 1 ? "PASS" : "FAIL");
+    failures += qw.ran != 1;
+
+    bio_list_init(&out);
+    r = dm_cell_unlock_v2(prison, cell, &out);
+    failures += !r || bio_list_pop(&out) != &late || out.head;
+    dm_bio_prison_free_cell(prison, cell);
+
+    // The continuation runs outside the region lock, so it can unlock the cell
+    prealloc = dm_bio_prison_alloc_cell(prison, GFP_KERNEL);
+    failures += !dm_cell_get_v2(prison, &key, 0, &readers[0], prealloc, &cell);
+    failures += dm_cell_lock_v2(prison, &key, 1, NULL, &uw.cell) != 1 || uw.cell != cell;
+    dm_cell_quiesce_v2(prison, cell, &uw.work);
+    failures += dm_cell_put_v2(prison, cell);
+    printf("continuation unlocks the cell: %s\n", uw.released == 1 ? "PASS" : "FAIL");
+    failures += uw.released != 1 || uw.bios.head;
+    dm_bio_prison_free_cell(prison, cell);
+
+    // Locking a free key needs no quiesce, and unlocking releases it
+    prealloc = dm_bio_prison_alloc_cell(prison, GFP_KERNEL);
+    failures += dm_cell_lock_v2(prison, &key, 0, prealloc, &cell) != 0 || cell != prealloc;
+    bio_list_init(&out);
+    failures += !dm_cell_unlock_v2(prison, cell, &out);
+    dm_bio_prison_free_cell(prison, cell);
+    failures += !prison_is_valid(prison) || !region_is_empty(&prison->regions[lock_nr(&key, prison->num_locks)]);
+
+    printf("prison v2: %s\n", failures ? "FAIL" : "PASS");
+    dm_bio_prison_destroy(prison);
+    return failures;
+}
+
+static int cmp_ptrs(const void *a, const void *b) {
+    uintptr_t x = *(const uintptr_t *)a, y = *(const uintptr_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static bool cells_distinct(struct dm_bio_prison_cell **cells, int nr) {
+    struct dm_bio_prison_cell **sorted = malloc(nr * sizeof(*sorted));
+    bool ok = sorted != NULL;
+
+    if (ok) {
+        memcpy(sorted, cells, nr * sizeof(*sorted));
+        qsort(sorted, nr, sizeof(*sorted), cmp_ptrs);
+        for (int i = 1; i < nr; i++)
+            ok &= sorted[i] != sorted[i - 1];
+    }
+    free(sorted);
+    return ok;
+}
+
+// Free cells out of order and allocate past the reserve
+int test_cell_allocator(void) {
+    struct dm_bio_prison *prison = dm_bio_prison_create();
+    const int nr = 3 * MIN_CELLS;
+    struct dm_bio_prison_cell **cells = calloc(nr, sizeof(*cells));
+    struct dm_bio_prison_cell *a, *b, *c;
+    int i, failures = 0;
+
+    printf("\nTesting cell allocator...\n");
+    if (!prison || !cells)
+        return 1;
+
+    // Freeing a cell that is not the last one must not hand out a live one
+    a = dm_bio_prison_alloc_cell(prison, GFP_KERNEL);
+    b = dm_bio_prison_alloc_cell(prison, GFP_KERNEL);
+    dm_bio_prison_free_cell(prison, a);
+    c = dm_bio_prison_alloc_cell(prison, GFP_KERNEL);
+    printf("out-of-order free: %s\n", c != b ? "PASS" : "FAIL");
+    failures += c == b;
+    dm_bio_prison_free_cell(prison, b);
+    dm_bio_prison_free_cell(prison, c);
+
+    for (i = 0; i < nr; i++) {
+        cells[i] = dm_bio_prison_alloc_cell(prison, GFP_KERNEL);
+        failures += !cells[i];
+    }
+    failures += !cells_distinct(cells, nr);
+    for (i = 0; i < nr; i++)
+        dm_bio_prison_free_cell(prison, cells[i * 7 % nr]);
+    for (i = 0; i < nr; i++)
+        cells[i] = dm_bio_prison_alloc_cell(prison, GFP_KERNEL);
+    failures += !cells_distinct(cells, nr);
+    for (i = 0; i < nr; i++)
+        dm_bio_prison_free_cell(prison, cells[i]);
+
+    printf("%d cells beyond a %d-cell reserve: %s\n", nr, MIN_CELLS,
+           failures ? "FAIL" : "PASS");
+    free(cells);
+    dm_bio_prison_destroy(prison);
+    return failures;
+}
+
+#define BENCH_THREADS 8
+#define BENCH_OPS 1000000
+
+struct bench_arg {
+    struct dm_bio_prison *prison;
+    int id;
+    unsigned long failed;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Detain and release a rolling window of keys, allocating a cell each time
+static void *bench_worker(void *data) {
+    struct bench_arg *arg = data;
+    struct dm_bio_prison_cell *cell, *prealloc;
+    struct bio bio = { 0 };
+    struct bio_list out;
+
+    for (int i = 0; i < BENCH_OPS; i++) {
+        struct dm_cell_key key = {
+            .virtual = 0, .dev = arg->id,
+            .block_begin = (dm_block_t)(i & 4095) << BIO_PRISON_MAX_RANGE_SHIFT,
+        };
+
+        key.block_end = key.block_begin + 1;
+        prealloc = dm_bio_prison_alloc_cell(arg->prison, GFP_KERNEL);
+        if (!prealloc || dm_bio_detain(arg->prison, &key, &bio, prealloc, &cell)) {
+            arg->failed++;
+            continue;
+        }
+        bio_list_init(&out);
+        dm_cell_release(arg->prison, cell, &out);
+        dm_bio_prison_free_cell(arg->prison, cell);
+    }
+    return NULL;
+}
+
+/*
+ * Detain throughput from 1 to BENCH_THREADS threads, with a single region
+ * lock and with the default CPU-scaled region count.
+ */
+int bench_detain_release(void) {
+    static const unsigned int region_counts[] = { 1, 0 };
+    struct bench_arg args[BENCH_THREADS];
+    pthread_t threads[BENCH_THREADS];
+    int failures = 0;
+
+    printf("\nBenchmarking detain+release with cell allocation (%ld CPUs online)...\n",
+           sysconf(_SC_NPROCESSORS_ONLN));
+    for (int r = 0; r < 2; r++) {
+        for (int nthreads = 1; nthreads <= BENCH_THREADS; nthreads *= 2) {
+            struct dm_bio_prison *prison = dm_bio_prison_create_with_locks(region_counts[r]);
+            unsigned long failed = 0;
+            uint64_t t0, t1;
+
+            if (!prison)
+                return 1;
+
+            t0 = now_ns();
+            for (int i = 0; i < nthreads; i++) {
+                args[i] = (struct bench_arg) { .prison = prison, .id = i };
+                pthread_create(&threads[i], NULL, bench_worker, &args[i]);
+            }
+            for (int i = 0; i < nthreads; i++) {
+                pthread_join(threads[i], NULL);
+                failed += args[i].failed;
+            }
+            t1 = now_ns();
+
+            // Exited threads gave their cached cells back
+            printf("%2u region(s), %d thread(s): %.0f ops/s, %lu failed, %lu/%lu cells free\n",
+                   prison->num_locks, nthreads, (double)nthreads * BENCH_OPS * 1e9 / (t1 - t0),
+                   failed, prison->nr_free, prison->nr_cells);
+            if (failed || prison->nr_free != prison->nr_cells)
+                failures++;
+            dm_bio_prison_destroy(prison);
+        }
+    }
+    return failures;
+}
+
+struct deferred_work {
+    struct list_head list;
+    int id;
+    int ran;
+};
+
+// Run and count the work handed back by dm_deferred_entry_dec()
+static int run_deferred(struct list_head *head) {
+    int n = 0;
+
+    while (!list_empty(head)) {
+        struct deferred_work *w = list_entry(head->next, struct deferred_work, list);
+
+        list_del(&w->list);
+        __atomic_fetch_add(&w->ran, 1, __ATOMIC_RELAXED);
+        n++;
+    }
+    return n;
+}
+
+// Work waits only for the bios that were in flight when it was added
+int test_deferred_set(void) {
+    struct dm_deferred_set *ds = dm_deferred_set_create();
+    struct dm_deferred_entry *a, *b, *c;
+    struct deferred_work w1 = { .id = 1 }, w2 = { .id = 2 }, w0 = { .id = 0 };
+    struct list_head done = LIST_HEAD_INIT(done);
+    int failures = 0;
+
+    printf("\nTesting deferred set...\n");
+    if (!ds)
+        return 1;
+
+    // Nothing in flight: the caller runs the work straight away
+    failures += dm_deferred_set_add_work(ds, &w0.list) != 0;
+
+    a = dm_deferred_entry_inc(ds);
+    b = dm_deferred_entry_inc(ds);
+    failures += dm_deferred_set_add_work(ds, &w1.list) != 1;
+    c = dm_deferred_entry_inc(ds);          // joins the next generation
+
+    dm_deferred_entry_dec(a, &done);
+    failures += run_deferred(&done) != 0;
+    dm_deferred_entry_dec(b, &done);
+    failures += run_deferred(&done) != 1 || w1.ran != 1;
+    printf("work runs once earlier bios finish, despite later ones: %s\n",
+           failures ? "FAIL" : "PASS");
+
+    failures += dm_deferred_set_add_work(ds, &w2.list) != 1;
+    dm_deferred_entry_dec(c, &done);
+    failures += run_deferred(&done) != 1 || w2.ran != 1;
+
+    // Go round the ring a few times, with a long-lived bio pinning one entry
+    a = dm_deferred_entry_inc(ds);
+    for (int i = 0; i < 4 * DEFERRED_SET_SIZE; i++) {
+        struct deferred_work w = { .id = i };
+
+        b = dm_deferred_entry_inc(ds);
+        if (dm_deferred_set_add_work(ds, &w.list) != 1)
+            failures++;
+        dm_deferred_entry_dec(b, &done);
+        if (i < DEFERRED_SET_SIZE && !list_empty(&done))
+            failures++;
+        dm_deferred_entry_dec(a, &done);
+        failures += run_deferred(&done) != 1;
+        a = dm_deferred_entry_inc(ds);
+    }
+    dm_deferred_entry_dec(a, &done);
+    failures += run_deferred(&done) != 0;
+
+    printf("deferred set: %s\n", failures ? "FAIL" : "PASS");
+    dm_deferred_set_destroy(ds);
+    return failures;
+}
+
+#define DS_THREADS 4
+#define DS_OPS 200000
+#define DS_WORK_EVERY 64
+
+struct ds_arg {
+    struct dm_deferred_set *ds;
+    struct deferred_work *work;
+    unsigned long ran;
+};
+
+// Bios come and go while every 64th operation queues a quiesce
+static void *ds_worker(void *data) {
+    struct ds_arg *arg = data;
+    struct list_head done = LIST_HEAD_INIT(done);
+    struct dm_deferred_entry *inflight[4] = { NULL };
+
+    for (int i = 0; i < DS_OPS; i++) {
+        int slot = i & 3;
+
+        if (inflight[slot]) {
+            dm_deferred_entry_dec(inflight[slot], &done);
+            arg->ran += run_deferred(&done);
+        }
+        inflight[slot] = dm_deferred_entry_inc(arg->ds);
+
+        if (i % DS_WORK_EVERY == 0) {
+            struct deferred_work *w = &arg->work[i / DS_WORK_EVERY];
+
+            if (!dm_deferred_set_add_work(arg->ds, &w->list)) {
+                __atomic_fetch_add(&w->ran, 1, __ATOMIC_RELAXED);
+                arg->ran++;
+            }
+        }
+    }
+    for (int slot = 0; slot < 4; slot++) {
+        dm_deferred_entry_dec(inflight[slot], &done);
+        arg->ran += run_deferred(&done);
+    }
+    return NULL;
+}
+
+int test_deferred_set_threads(void) {
+    struct dm_deferred_set *ds = dm_deferred_set_create();
+    const int per_thread = (DS_OPS + DS_WORK_EVERY - 1) / DS_WORK_EVERY;
+    struct ds_arg args[DS_THREADS];
+    pthread_t threads[DS_THREADS];
+    unsigned long ran = 0;
+    int failures = 0;
+
+    if (!ds)
+        return 1;
+
+    for (int i = 0; i < DS_THREADS; i++) {
+        args[i] = (struct ds_arg) { .ds = ds, .work = calloc(per_thread, sizeof(struct deferred_work)) };
+        if (!args[i].work)
+            return 1;
+        pthread_create(&threads[i], NULL, ds_worker, &args[i]);
+    }
+    for (int i = 0; i < DS_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        ran += args[i].ran;
+    }
+    for (int i = 0; i < DS_THREADS; i++) {
+        for (int j = 0; j < per_thread; j++)
+            failures += args[i].work[j].ran != 1;
+        free(args[i].work);
+    }
+
+    printf("%d threads: %lu quiesce items, each run exactly once: %s\n", DS_THREADS,
+           ran, failures || ran != (unsigned long)DS_THREADS * per_thread ? "FAIL" : "PASS");
+    dm_deferred_set_destroy(ds);
+    return failures || ran != (unsigned long)DS_THREADS * per_thread;
+}
+
+#define HOT_KEYS 4
+#define HOT_OPS 500000
+
+struct hot_arg {
+    struct dm_bio_prison *prison;
+    bool v2;
+    unsigned long queued;
+};
+
+// Every thread reads the same few blocks
+static void *hot_reader(void *data) {
+    struct hot_arg *arg = data;
+    struct dm_bio_prison_cell *prealloc, *cell;
+    struct bio bio = { 0 };
+    struct bio_list out;
+
+    for (int i = 0; i < HOT_OPS; i++) {
+        struct dm_cell_key key = {
+            .virtual = 0, .dev = 0,
+            .block_begin = (dm_block_t)(i % HOT_KEYS) << BIO_PRISON_MAX_RANGE_SHIFT,
+        };
+
+        key.block_end = key.block_begin + 1;
+        prealloc = dm_bio_prison_alloc_cell(arg->prison, GFP_KERNEL);
+        if (arg->v2) {
+            if (!dm_cell_get_v2(arg->prison, &key, 0, &bio, prealloc, &cell)) {
+                arg->queued++;
+                continue;
+            }
+            if (cell != prealloc)
+                dm_bio_prison_free_cell(arg->prison, prealloc);
+            if (dm_cell_put_v2(arg->prison, cell))
+                dm_bio_prison_free_cell(arg->prison, cell);
+        } else {
+            // A v1 cell has one holder; everyone else is queued on it
+            if (dm_bio_detain(arg->prison, &key, NULL, prealloc, &cell)) {
+                dm_bio_prison_free_cell(arg->prison, prealloc);
+                arg->queued++;
+                continue;
+            }
+            bio_list_init(&out);
+            dm_cell_release(arg->prison, cell, &out);
+            dm_bio_prison_free_cell(arg->prison, cell);
+        }
+    }
+    return NULL;
+}
+
+int bench_hot_readers(void) {
+    struct hot_arg args[BENCH_THREADS];
+    pthread_t threads[BENCH_THREADS];
+    int failures = 0;
+
+    printf("\nBenchmarking %d threads reading %d hot blocks...\n", BENCH_THREADS, HOT_KEYS);
+    for (int v2 = 0; v2 <= 1; v2++) {
+        struct dm_bio_prison *prison = dm_bio_prison_create();
+        unsigned long queued = 0;
+        uint64_t t0, t1;
+
+        if (!prison)
+            return 1;
+
+        t0 = now_ns();
+        for (int i = 0; i < BENCH_THREADS; i++) {
+            args[i] = (struct hot_arg) { .prison = prison, .v2 = v2 };
+            pthread_create(&threads[i], NULL, hot_reader, &args[i]);
+        }
+        for (int i = 0; i < BENCH_THREADS; i++) {
+            pthread_join(threads[i], NULL);
+            queued += args[i].queued;
+        }
+        t1 = now_ns();
+
+        printf("%s: %.0f ops/s, %lu of %d reads would have waited\n",
+               v2 ? "v2 shared" : "v1 detain",
+               (double)BENCH_THREADS * HOT_OPS * 1e9 / (t1 - t0),
+               queued, BENCH_THREADS * HOT_OPS);
+        if (v2 && queued)
+            failures++;
+        dm_bio_prison_destroy(prison);
+    }
+    return failures;
+}
+
+#define LOOKUP_CELLS 65536
+#define LOOKUP_OPS 2000000
+
+// Latency of looking up existing cells in a well populated prison
+int bench_lookup(void) {
+    struct dm_bio_prison *prison = dm_bio_prison_create();
+    struct dm_bio_prison_cell *cell, *prealloc;
+    unsigned long missed = 0;
+    uint64_t t0, t1;
+    int i;
+
+    if (!prison)
+        return 1;
+
+    for (i = 0; i < LOOKUP_CELLS; i++) {
+        struct dm_cell_key key = {
+            .virtual = 0, .dev = i & 7,
+            .block_begin = (dm_block_t)(i >> 3) << BIO_PRISON_MAX_RANGE_SHIFT,
+        };
+
+        key.block_end = key.block_begin + 1;
+        prealloc = dm_bio_prison_alloc_cell(prison, GFP_KERNEL);
+        if (!prealloc || dm_get_cell(prison, &key, prealloc, &cell))
+            return 1;
+    }
+
+    t0 = now_ns();
+    for (i = 0; i < LOOKUP_OPS; i++) {
+        unsigned int n = (unsigned int)i * 40503u % LOOKUP_CELLS;
+        struct dm_cell_key key = {
+            .virtual = 0, .dev = n & 7,
+            .block_begin = (dm_block_t)(n >> 3) << BIO_PRISON_MAX_RANGE_SHIFT,
+        };
+
+        key.block_end = key.block_begin + 1;
+        missed += dm_get_cell(prison, &key, NULL, &cell) != 1;
+    }
+    t1 = now_ns();
+
+    printf("\nLookup among %d cells (%s index): %.1f ns per lookup\n", LOOKUP_CELLS,
+           PRISON_INDEX_NAME, (double)(t1 - t0) / LOOKUP_OPS);
+    dm_bio_prison_destroy(prison);
+    return missed != 0;
+}
+
 // Test program
 int main() {
     printf("Creating bio prison...\n");
@@ -237,6 +2060,12 @@ int main() {
     printf("Destroying bio prison...\n");
     dm_bio_prison_destroy(prison);
 
+    if (test_detain_release() || test_many_cells() || test_cell_allocator() ||
+        test_prison_v2() || test_deferred_set() || test_deferred_set_threads() ||
+        bench_detain_release() || bench_hot_readers() ||
+        bench_lookup())
+        return 1;
+
     printf("Test completed successfully\n");
     return 0;
 }
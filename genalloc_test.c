@@ -12,6 +12,7 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
 
 /* Basic definitions to simulate Linux kernel environment */
 #define BITS_PER_LONG 64
@@ -24,25 +25,79 @@ typedef uint64_t phys_addr_t;
 typedef int spinlock_t;
 #define CONFIG_OF
 
+/*
+ * Fake NUMA topology. It defaults to a single node; tests can describe a
+ * multi-node machine with numa_fake_topology() and numa_set_distance().
+ */
+#define MAX_NUMNODES 8
+#define LOCAL_DISTANCE 10
+#define REMOTE_DISTANCE 20
+
+static int nr_node_ids = 1;
+static unsigned char numa_distance[MAX_NUMNODES][MAX_NUMNODES] = {
+    [0][0] = LOCAL_DISTANCE,
+};
+
+// Reset to nr_nodes nodes, all REMOTE_DISTANCE apart
+void numa_fake_topology(int nr_nodes)
+{
+    int a, b;
+
+    if (nr_nodes < 1 || nr_nodes > MAX_NUMNODES)
+        nr_nodes = 1;
+    nr_node_ids = nr_nodes;
+    for (a = 0; a < MAX_NUMNODES; a++)
+        for (b = 0; b < MAX_NUMNODES; b++)
+            numa_distance[a][b] = a == b ? LOCAL_DISTANCE : REMOTE_DISTANCE;
+}
+
+void numa_set_distance(int from, int to, int distance)
+{
+    if (from < 0 || from >= nr_node_ids || to < 0 || to >= nr_node_ids ||
+        from == to)
+        return;
+    numa_distance[from][to] = distance;
+    numa_distance[to][from] = distance;
+}
+
+static inline int node_distance(int from, int to)
+{
+    return numa_distance[from][to];
+}
+
 /* Bitmap operations */
 #define BITS_TO_LONGS(nr) (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
 #define BIT_WORD(nr) ((nr) / BITS_PER_LONG)
 #define BITMAP_FIRST_WORD_MASK(start) (~0UL << ((start) & (BITS_PER_LONG - 1)))
 #define BITMAP_LAST_WORD_MASK(nbits) (~0UL >> (-(nbits) & (BITS_PER_LONG - 1)))
+#define __ALIGN_MASK(x, mask) (((x) + (mask)) & ~(mask))
+#define min(a, b) ((a) < (b) ? (a) : (b))
 
-/* Atomic operations simulation */
-#define READ_ONCE(x) (x)
+/* Atomic operations, mapped onto the GCC __atomic builtins */
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define atomic_long_read(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define atomic_long_add(v, p) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#define atomic_long_sub(v, p) __atomic_fetch_sub((p), (v), __ATOMIC_RELAXED)
+
+/*
+ * RCU-style publication. Chunks are never unlinked while the pool is in
+ * use, so readers only need to see a fully initialised chunk once it is
+ * reachable from the list.
+ */
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
 #define cpu_relax() do {} while (0)
+#endif
 
 static inline bool try_cmpxchg(unsigned long *ptr, unsigned long *oldp, unsigned long new)
 {
-    unsigned long old = *oldp;
-    if (*ptr == old) {
-        *ptr = new;
-        return true;
-    }
-    *oldp = *ptr;
-    return false;
+    return __atomic_compare_exchange_n(ptr, oldp, new, false,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
 }
 
 /* Forward declarations */
@@ -55,6 +110,21 @@ typedef unsigned long (*genpool_algo_t)(unsigned long *map,
 unsigned long gen_pool_first_fit(unsigned long *map, unsigned long size,
                                unsigned long start, unsigned int nr, void *data,
                                struct gen_pool *pool, unsigned long start_addr);
+unsigned long gen_pool_first_fit_order_align(unsigned long *map,
+                               unsigned long size, unsigned long start,
+                               unsigned int nr, void *data,
+                               struct gen_pool *pool, unsigned long start_addr);
+unsigned long gen_pool_fixed_alloc(unsigned long *map, unsigned long size,
+                               unsigned long start, unsigned int nr, void *data,
+                               struct gen_pool *pool, unsigned long start_addr);
+unsigned long gen_pool_best_fit(unsigned long *map, unsigned long size,
+                               unsigned long start, unsigned int nr, void *data,
+                               struct gen_pool *pool, unsigned long start_addr);
+
+/* Data for gen_pool_fixed_alloc: byte offset of the wanted block in a chunk */
+struct genpool_data_fixed {
+    unsigned long offset;
+};
 
 /* Main structures */
 struct gen_pool_chunk {
@@ -66,21 +136,53 @@ struct gen_pool_chunk {
     unsigned long *bits;
     void *owner;
     long avail;
+    int nid;
+    unsigned long max_free;     // free sequence << 32 | largest free run bound
+};
+
+/*
+ * Chunks sorted by start address for binary search. The index is never
+ * modified once published: adding a chunk builds a new copy, and the old
+ * one is freed once no lookup can still be walking it.
+ *
+ * Lookups announce themselves in index_readers[index_epoch & 1], in the
+ * style of SRCU. To retire a copy, the writer flips the epoch and waits
+ * for the old counter to drain, twice, so that a lookup which sampled
+ * the epoch just before a flip is covered by the other wait.
+ */
+struct gen_pool_index {
+    unsigned int nr;
+    struct gen_pool_chunk *chunks[];
 };
 
 struct gen_pool {
     struct gen_pool_chunk *chunks;
+    struct gen_pool_index *index;
+    unsigned long index_readers[2];
+    unsigned int index_epoch;
     int min_alloc_order;
+    int nid;
     genpool_algo_t algo;
     void *data;
     const char *name;
     spinlock_t lock;
 };
 
-/* Spinlock simulation */
-#define spin_lock_init(lock) (*(lock) = 0)
-#define spin_lock(lock) do {} while (0)
-#define spin_unlock(lock) do {} while (0)
+/* Test-and-test-and-set spinlock, only taken by writers of the chunk list */
+#define spin_lock_init(lock) __atomic_store_n((lock), 0, __ATOMIC_RELAXED)
+
+static inline void spin_lock(spinlock_t *lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+            cpu_relax();
+    }
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
 
 /* Helper functions */
 static inline size_t chunk_size(const struct gen_pool_chunk *chunk)
@@ -163,6 +265,226 @@ static unsigned long bitmap_clear_ll(unsigned long *map, unsigned long start, un
     return 0;
 }
 
+/*
+ * Bitmap search. These walk the map a word at a time and use ctz to find
+ * the first interesting bit in a word, like the kernel's find_next_bit().
+ */
+static unsigned long _find_next_bit(const unsigned long *map, unsigned long nbits,
+                                    unsigned long start, unsigned long invert)
+{
+    unsigned long tmp;
+
+    if (start >= nbits)
+        return nbits;
+
+    tmp = READ_ONCE(map[BIT_WORD(start)]) ^ invert;
+    tmp &= BITMAP_FIRST_WORD_MASK(start);
+    start &= ~(BITS_PER_LONG - 1);
+
+    while (!tmp) {
+        start += BITS_PER_LONG;
+        if (start >= nbits)
+            return nbits;
+        tmp = READ_ONCE(map[BIT_WORD(start)]) ^ invert;
+    }
+
+    return min(start + __builtin_ctzl(tmp), nbits);
+}
+
+static inline unsigned long find_next_bit(const unsigned long *map,
+                                          unsigned long nbits, unsigned long start)
+{
+    return _find_next_bit(map, nbits, start, 0UL);
+}
+
+static inline unsigned long find_next_zero_bit(const unsigned long *map,
+                                               unsigned long nbits,
+                                               unsigned long start)
+{
+    return _find_next_bit(map, nbits, start, ~0UL);
+}
+
+/*
+ * Find nr zero bits in map[0..size) starting at or after start, with the
+ * first bit index (plus align_offset) aligned to align_mask + 1. Returns
+ * a value past size when no such area exists.
+ */
+static unsigned long bitmap_find_next_zero_area_off(unsigned long *map,
+                                                    unsigned long size,
+                                                    unsigned long start,
+                                                    unsigned int nr,
+                                                    unsigned long align_mask,
+                                                    unsigned long align_offset)
+{
+    unsigned long index, end, i;
+
+again:
+    index = find_next_zero_bit(map, size, start);
+
+    /* Align allocation */
+    index = __ALIGN_MASK(index + align_offset, align_mask) - align_offset;
+
+    end = index + nr;
+    if (end > size)
+        return end;
+    i = find_next_bit(map, end, index);
+    if (i < end) {
+        start = i + 1;
+        goto again;
+    }
+    return index;
+}
+
+static inline unsigned long bitmap_find_next_zero_area(unsigned long *map,
+                                                       unsigned long size,
+                                                       unsigned long start,
+                                                       unsigned int nr,
+                                                       unsigned long align_mask)
+{
+    return bitmap_find_next_zero_area_off(map, size, start, nr, align_mask, 0);
+}
+
+/*
+ * chunk->max_free holds an upper bound, in blocks, on the longest free run
+ * in the chunk, so allocations that cannot fit skip the bitmap scan.
+ *
+ * Allocation only splits runs and leaves the bound alone. A free, or an
+ * allocation backing out of a lost race, can at most join the runs on
+ * either side of it, so it raises the bound to
+ * 2 * bound + nbits, capped by the free space in the chunk. A failed scan
+ * tightens the bound lazily by measuring the real longest run, but it
+ * must not undo a free that raced with the scan: every free bumps the
+ * sequence number in the upper half of the word, and the tightening
+ * cmpxchg fails if one did.
+ */
+#define MAX_FREE_BOUND_MASK 0xffffffffUL
+#define MAX_FREE_SEQ_INC (1UL << 32)
+#define MAX_FREE_BOUND(v) ((v) & MAX_FREE_BOUND_MASK)
+
+/* Longest run of clear bits in map[0..size) */
+static unsigned long bitmap_longest_zero_run(const unsigned long *map,
+                                             unsigned long size)
+{
+    unsigned long start = 0, end, longest = 0;
+
+    while ((start = find_next_zero_bit(map, size, start)) < size) {
+        end = find_next_bit(map, size, start);
+        if (end - start > longest)
+            longest = end - start;
+        start = end;
+    }
+    return longest;
+}
+
+/* Measure the chunk's longest free run and tighten the bound seen before */
+static unsigned long chunk_refresh_max_free(struct gen_pool_chunk *chunk,
+                                            int order, unsigned long seen)
+{
+    unsigned long longest;
+
+    longest = bitmap_longest_zero_run(chunk->bits, chunk_size(chunk) >> order);
+    longest = min(longest, MAX_FREE_BOUND_MASK);
+    if (longest < MAX_FREE_BOUND(seen))
+        try_cmpxchg(&chunk->max_free, &seen, (seen & ~MAX_FREE_BOUND_MASK) | longest);
+    return longest;
+}
+
+/* Raise the bound after nbits were freed, leaving avail_bits free in total */
+static void chunk_raise_max_free(struct gen_pool_chunk *chunk, unsigned long nbits,
+                                 unsigned long avail_bits)
+{
+    unsigned long old = __atomic_load_n(&chunk->max_free, __ATOMIC_RELAXED);
+    unsigned long bound;
+
+    do {
+        bound = min(2 * MAX_FREE_BOUND(old) + nbits, avail_bits);
+        bound = min(bound, MAX_FREE_BOUND_MASK);
+    } while (!try_cmpxchg(&chunk->max_free, &old,
+                          ((old & ~MAX_FREE_BOUND_MASK) + MAX_FREE_SEQ_INC) | bound));
+}
+
+/* Enter an index lookup, returns the epoch to pass to the unlock */
+static inline unsigned int gen_pool_index_read_lock(struct gen_pool *pool)
+{
+    unsigned int idx = __atomic_load_n(&pool->index_epoch, __ATOMIC_RELAXED) & 1;
+
+    __atomic_fetch_add(&pool->index_readers[idx], 1, __ATOMIC_SEQ_CST);
+    return idx;
+}
+
+static inline void gen_pool_index_read_unlock(struct gen_pool *pool, unsigned int idx)
+{
+    __atomic_fetch_sub(&pool->index_readers[idx], 1, __ATOMIC_RELEASE);
+}
+
+/* Wait until no lookup can see an index replaced before the call, pool->lock held */
+static void gen_pool_index_synchronize(struct gen_pool *pool)
+{
+    unsigned int i, idx;
+
+    for (i = 0; i < 2; i++) {
+        idx = __atomic_fetch_add(&pool->index_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        while (__atomic_load_n(&pool->index_readers[idx], __ATOMIC_ACQUIRE))
+            cpu_relax();
+    }
+}
+
+/* Publish a copy of the chunk index with chunk added, pool->lock held */
+static int gen_pool_index_insert(struct gen_pool *pool, struct gen_pool_chunk *chunk)
+{
+    struct gen_pool_index *old = pool->index, *new;
+    unsigned int nr = old ? old->nr : 0;
+    unsigned int i, j;
+
+    new = malloc(sizeof(*new) + (nr + 1) * sizeof(new->chunks[0]));
+    if (new == NULL)
+        return -ENOMEM;
+
+    for (i = 0, j = 0; i < nr; i++) {
+        if (j == i && old->chunks[i]->start_addr > chunk->start_addr)
+            new->chunks[j++] = chunk;
+        new->chunks[j++] = old->chunks[i];
+    }
+    if (j == nr)
+        new->chunks[j] = chunk;
+    new->nr = nr + 1;
+
+    __atomic_store_n(&pool->index, new, __ATOMIC_SEQ_CST);
+    if (old != NULL) {
+        gen_pool_index_synchronize(pool);
+        free(old);
+    }
+    return 0;
+}
+
+/* Binary search for the chunk containing addr */
+static struct gen_pool_chunk *gen_pool_find_chunk(struct gen_pool *pool,
+                                                  unsigned long addr)
+{
+    unsigned int idx = gen_pool_index_read_lock(pool);
+    struct gen_pool_index *index = __atomic_load_n(&pool->index, __ATOMIC_SEQ_CST);
+    struct gen_pool_chunk *chunk = NULL;
+    unsigned int lo = 0, hi;
+
+    if (index == NULL)
+        goto out;
+
+    hi = index->nr;
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if (index->chunks[mid]->start_addr <= addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo > 0 && addr <= index->chunks[lo - 1]->end_addr)
+        chunk = index->chunks[lo - 1];
+out:
+    gen_pool_index_read_unlock(pool, idx);
+    return chunk;
+}
+
 /* Core functions */
 struct gen_pool *gen_pool_create(int min_alloc_order, int nid)
 {
@@ -172,7 +494,11 @@ struct gen_pool *gen_pool_create(int min_alloc_order, int nid)
     if (pool != NULL) {
         spin_lock_init(&pool->lock);
         pool->chunks = NULL;
+        pool->index = NULL;
+        pool->index_readers[0] = pool->index_readers[1] = 0;
+        pool->index_epoch = 0;
         pool->min_alloc_order = min_alloc_order;
+        pool->nid = nid;
         pool->algo = gen_pool_first_fit;
         pool->data = NULL;
         pool->name = NULL;
@@ -197,93 +523,265 @@ int gen_pool_add_virt(struct gen_pool *pool, unsigned long virt, phys_addr_t phy
     chunk->end_addr = virt + size - 1;
     chunk->owner = NULL;
     chunk->avail = size;
+    chunk->nid = nid != NUMA_NO_NODE ? nid : pool->nid;
+    chunk->max_free = min(nbits, MAX_FREE_BOUND_MASK);
     chunk->bits = (unsigned long *)(chunk + 1);
     memset(chunk->bits, 0, BITS_TO_LONGS(nbits) * sizeof(long));
 
     spin_lock(&pool->lock);
+    if (gen_pool_index_insert(pool, chunk)) {
+        spin_unlock(&pool->lock);
+        free(chunk);
+        return -ENOMEM;
+    }
     chunk->next_chunk = pool->chunks;
-    pool->chunks = chunk;
+    rcu_assign_pointer(pool->chunks, chunk);
     spin_unlock(&pool->lock);
 
     return 0;
 }
 
+/*
+ * Allocation algorithms. Each returns the first bit of a free area of nr
+ * bits in map[0..size), or a value >= size if there is none.
+ */
+
 /* First-fit allocation algorithm */
 unsigned long gen_pool_first_fit(unsigned long *map, unsigned long size,
                                unsigned long start, unsigned int nr, void *data,
                                struct gen_pool *pool, unsigned long start_addr)
 {
-    unsigned long start_bit = 0;
-    unsigned long len = size;
+    return bitmap_find_next_zero_area(map, size, start, nr, 0);
+}
+
+/* First-fit, aligned to the allocation size rounded up to a power of two */
+unsigned long gen_pool_first_fit_order_align(unsigned long *map,
+                               unsigned long size, unsigned long start,
+                               unsigned int nr, void *data,
+                               struct gen_pool *pool, unsigned long start_addr)
+{
+    unsigned long align_mask = 1;
+
+    while (align_mask < nr)
+        align_mask <<= 1;
+
+    return bitmap_find_next_zero_area(map, size, start, nr, align_mask - 1);
+}
+
+/* Allocate at the fixed offset given by struct genpool_data_fixed */
+unsigned long gen_pool_fixed_alloc(unsigned long *map, unsigned long size,
+                               unsigned long start, unsigned int nr, void *data,
+                               struct gen_pool *pool, unsigned long start_addr)
+{
+    struct genpool_data_fixed *fixed_data = data;
+    int order = pool->min_alloc_order;
+    unsigned long offset_bit, start_bit;
+
+    offset_bit = fixed_data->offset >> order;
+    if (fixed_data->offset & ((1UL << order) - 1))
+        return size;
+
+    start_bit = bitmap_find_next_zero_area(map, size, start + offset_bit, nr, 0);
+    if (start_bit != offset_bit)
+        start_bit = size;
+    return start_bit;
+}
+
+/* Smallest free area that fits, stopping early on an exact fit */
+unsigned long gen_pool_best_fit(unsigned long *map, unsigned long size,
+                               unsigned long start, unsigned int nr, void *data,
+                               struct gen_pool *pool, unsigned long start_addr)
+{
+    unsigned long start_bit = size;
+    unsigned long len = size + 1;
     unsigned long index;
-    unsigned long i;
 
-    for (i = start; i < len; i++) {
-        index = i;
-        start_bit = i;
+    index = bitmap_find_next_zero_area(map, size, start, nr, 0);
 
-        while (index < len && !(map[index / BITS_PER_LONG] &
-               (1UL << (index % BITS_PER_LONG)))) {
-            index++;
-            if (index - start_bit == nr)
+    while (index < size) {
+        unsigned long next_bit = find_next_bit(map, size, index + nr);
+        if ((next_bit - index) < len) {
+            len = next_bit - index;
+            start_bit = index;
+            if (len == nr)
                 return start_bit;
         }
-        i = index;
+        index = bitmap_find_next_zero_area(map, size, next_bit + 1, nr, 0);
     }
-    return -ENOMEM;
+
+    return start_bit;
 }
 
-/* Memory allocation */
-unsigned long gen_pool_alloc(struct gen_pool *pool, size_t size)
+void gen_pool_set_algo(struct gen_pool *pool, genpool_algo_t algo, void *data)
+{
+    spin_lock(&pool->lock);
+    WRITE_ONCE(pool->algo, algo ? algo : gen_pool_first_fit);
+    WRITE_ONCE(pool->data, algo ? data : NULL);
+    spin_unlock(&pool->lock);
+}
+
+/*
+ * Claim nbits blocks from one chunk, returning the address or 0. No lock
+ * is taken: blocks are claimed with cmpxchg on the bitmap words, and a
+ * thread that loses a race for part of an area backs out and searches
+ * again from there.
+ */
+static unsigned long gen_pool_chunk_alloc(struct gen_pool *pool,
+                                          struct gen_pool_chunk *chunk,
+                                          unsigned long nbits,
+                                          genpool_algo_t algo, void *data)
+{
+    int order = pool->min_alloc_order;
+    unsigned long start_bit, end_bit, remain, max_free;
+
+    if ((nbits << order) > atomic_long_read(&chunk->avail))
+        return 0;
+    max_free = __atomic_load_n(&chunk->max_free, __ATOMIC_ACQUIRE);
+    if (nbits > MAX_FREE_BOUND(max_free))
+        return 0;
+
+    start_bit = 0;
+    end_bit = chunk_size(chunk) >> order;
+retry:
+    start_bit = algo(chunk->bits, end_bit, start_bit, nbits, data, pool,
+                     chunk->start_addr);
+    if (start_bit >= end_bit) {
+        chunk_refresh_max_free(chunk, order, max_free);
+        return 0;
+    }
+    remain = bitmap_set_ll(chunk->bits, start_bit, nbits);
+    if (remain) {
+        /*
+         * Lost a race for part of the area, undo and look further on.
+         * The undo frees blocks that a concurrent refresh may have seen
+         * as taken, so it raises the bound just like gen_pool_free().
+         */
+        bitmap_clear_ll(chunk->bits, start_bit, nbits - remain);
+        chunk_raise_max_free(chunk, nbits - remain,
+                             atomic_long_read(&chunk->avail) >> order);
+        goto retry;
+    }
+
+    atomic_long_sub(nbits << order, &chunk->avail);
+    return chunk->start_addr + (start_bit << order);
+}
+
+/* Memory allocation with an explicit algorithm */
+unsigned long gen_pool_alloc_algo(struct gen_pool *pool, size_t size,
+                                  genpool_algo_t algo, void *data)
 {
     struct gen_pool_chunk *chunk;
     unsigned long addr = 0;
-    unsigned long flags;
-    int order = pool->min_alloc_order;
-    int nbits = size >> order;
-    int start_bit = 0, remain;
+    unsigned long nbits;
 
-    if (size < (1UL << order))
+    if (size == 0)
         return 0;
 
-    spin_lock(&pool->lock);
-    chunk = pool->chunks;
+    nbits = (size + (1UL << pool->min_alloc_order) - 1) >> pool->min_alloc_order;
+
+    chunk = rcu_dereference(pool->chunks);
     while (chunk != NULL) {
-        if (chunk->avail >= size) {
-            remain = bitmap_set_ll(chunk->bits, start_bit, nbits);
-            if (remain == 0) {
-                addr = chunk->start_addr + ((unsigned long)start_bit << order);
-                chunk->avail -= size;
-                break;
-            }
-        }
-        chunk = chunk->next_chunk;
+        addr = gen_pool_chunk_alloc(pool, chunk, nbits, algo, data);
+        if (addr)
+            break;
+        chunk = rcu_dereference(chunk->next_chunk);
     }
-    spin_unlock(&pool->lock);
 
     return addr;
 }
 
+/* Memory allocation with the pool's algorithm */
+unsigned long gen_pool_alloc(struct gen_pool *pool, size_t size)
+{
+    return gen_pool_alloc_algo(pool, size, READ_ONCE(pool->algo),
+                               READ_ONCE(pool->data));
+}
+
+/*
+ * Memory allocation preferring chunks on node nid. Nodes are tried in
+ * order of distance from nid, nearest first with ties going to the lower
+ * node id, and chunks with no node come last. Any nid outside the
+ * topology, NUMA_NO_NODE included, allocates from the whole pool.
+ */
+unsigned long gen_pool_alloc_node(struct gen_pool *pool, size_t size, int nid)
+{
+    genpool_algo_t algo = READ_ONCE(pool->algo);
+    void *data = READ_ONCE(pool->data);
+    int order[MAX_NUMNODES + 1];
+    int nr_nodes = nr_node_ids;
+    struct gen_pool_chunk *chunk;
+    unsigned long nbits, addr;
+    int i, j, node;
+
+    if (nid < 0 || nid >= nr_nodes)
+        return gen_pool_alloc_algo(pool, size, algo, data);
+    if (size == 0)
+        return 0;
+
+    // Insertion sort of the nodes by distance; the sort is stable
+    for (i = 0; i < nr_nodes; i++) {
+        for (j = i; j > 0 && node_distance(nid, order[j - 1]) > node_distance(nid, i); j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+    }
+    order[nr_nodes] = NUMA_NO_NODE;
+
+    nbits = (size + (1UL << pool->min_alloc_order) - 1) >> pool->min_alloc_order;
+    for (i = 0; i <= nr_nodes; i++) {
+        node = order[i];
+        chunk = rcu_dereference(pool->chunks);
+        while (chunk != NULL) {
+            if (chunk->nid == node ||
+                (node == NUMA_NO_NODE && (chunk->nid < 0 || chunk->nid >= nr_nodes))) {
+                addr = gen_pool_chunk_alloc(pool, chunk, nbits, algo, data);
+                if (addr)
+                    return addr;
+            }
+            chunk = rcu_dereference(chunk->next_chunk);
+        }
+    }
+    return 0;
+}
+
 /* Memory deallocation */
 void gen_pool_free(struct gen_pool *pool, unsigned long addr, size_t size)
 {
     struct gen_pool_chunk *chunk;
     int order = pool->min_alloc_order;
     int start_bit, nbits;
+    long avail;
 
-    nbits = size >> order;
-    spin_lock(&pool->lock);
-    chunk = pool->chunks;
-    while (chunk != NULL) {
-        if (addr >= chunk->start_addr && addr <= chunk->end_addr) {
-            start_bit = (addr - chunk->start_addr) >> order;
-            bitmap_clear_ll(chunk->bits, start_bit, nbits);
-            chunk->avail += size;
-            break;
-        }
-        chunk = chunk->next_chunk;
+    nbits = (size + (1UL << order) - 1) >> order;
+    size = (size_t)nbits << order;
+    chunk = gen_pool_find_chunk(pool, addr);
+    if (chunk != NULL) {
+        start_bit = (addr - chunk->start_addr) >> order;
+        bitmap_clear_ll(chunk->bits, start_bit, nbits);
+        avail = atomic_long_add(size, &chunk->avail) + size;
+        chunk_raise_max_free(chunk, nbits, avail >> order);
     }
-    spin_unlock(&pool->lock);
+}
+
+/* Translate a pool virtual address to its physical address, -1 if unknown */
+phys_addr_t gen_pool_virt_to_phys(struct gen_pool *pool, unsigned long addr)
+{
+    struct gen_pool_chunk *chunk = gen_pool_find_chunk(pool, addr);
+
+    if (chunk == NULL)
+        return (phys_addr_t)-1;
+    return chunk->phys_addr + (addr - chunk->start_addr);
+}
+
+/* Check whether [start, start + size) lies entirely within one chunk */
+bool gen_pool_has_addr(struct gen_pool *pool, unsigned long start, size_t size)
+{
+    struct gen_pool_chunk *chunk;
+
+    if (size == 0)
+        return false;
+
+    chunk = gen_pool_find_chunk(pool, start);
+    return chunk != NULL && start + size - 1 <= chunk->end_addr;
 }
 
 /* Pool destruction */
@@ -297,6 +795,7 @@ void gen_pool_destroy(struct gen_pool *pool)
         free(chunk);
         chunk = next_chunk;
     }
+    free(pool->index);
     free(pool);
 }
 
@@ -306,13 +805,11 @@ size_t gen_pool_avail(struct gen_pool *pool)
     struct gen_pool_chunk *chunk;
     size_t avail = 0;
 
-    spin_lock(&pool->lock);
-    chunk = pool->chunks;
+    chunk = rcu_dereference(pool->chunks);
     while (chunk != NULL) {
-        avail += chunk->avail;
-        chunk = chunk->next_chunk;
+        avail += atomic_long_read(&chunk->avail);
+        chunk = rcu_dereference(chunk->next_chunk);
     }
-    spin_unlock(&pool->lock);
     return avail;
 }
 
@@ -321,16 +818,309 @@ size_t gen_pool_size(struct gen_pool *pool)
     struct gen_pool_chunk *chunk;
     size_t size = 0;
 
-    spin_lock(&pool->lock);
-    chunk = pool->chunks;
+    chunk = rcu_dereference(pool->chunks);
     while (chunk != NULL) {
         size += chunk_size(chunk);
-        chunk = chunk->next_chunk;
+        chunk = rcu_dereference(chunk->next_chunk);
     }
-    spin_unlock(&pool->lock);
     return size;
 }
 
+/*
+ * Fragmentation of the free space, from 0 when it is all one run to
+ * nearly 1 when it is scattered in single blocks: 1 - largest run / free.
+ * Measuring the runs also tightens every chunk's max_free bound.
+ */
+double gen_pool_fragmentation(struct gen_pool *pool)
+{
+    struct gen_pool_chunk *chunk;
+    int order = pool->min_alloc_order;
+    unsigned long longest = 0, run, seen;
+    size_t avail = 0;
+
+    chunk = rcu_dereference(pool->chunks);
+    while (chunk != NULL) {
+        seen = __atomic_load_n(&chunk->max_free, __ATOMIC_ACQUIRE);
+        avail += atomic_long_read(&chunk->avail);
+        run = chunk_refresh_max_free(chunk, order, seen);
+        if (run > longest)
+            longest = run;
+        chunk = rcu_dereference(chunk->next_chunk);
+    }
+
+    if (avail == 0)
+        return 0.0;
+    return 1.0 - (double)(longest << order) / avail;
+}
+
+/*
+ * Object cache for a single object size, layered on the pool in the style
+ * of Bonwick's magazines. Every thread holds a loaded and a previous
+ * magazine of reserved objects, so alloc and free normally pop or push a
+ * private array without touching the pool bitmaps. Only when both are
+ * empty (alloc) or full (free) does the thread trade a magazine with the
+ * depot, under depot_lock; alloc falls back to the pool when the depot
+ * has no full magazine.
+ *
+ * Objects sitting in magazines count as allocated in gen_pool_avail();
+ * gen_pool_cache_shrink() hands the depot's full magazines back.
+ */
+#define GEN_POOL_MAG_SIZE 32
+
+struct gen_pool_magazine {
+    struct gen_pool_magazine *next;
+    unsigned int nr;
+    unsigned long objs[GEN_POOL_MAG_SIZE];
+};
+
+struct gen_pool_cache;
+
+struct gen_pool_cache_cpu {
+    struct gen_pool_cache_cpu *next;
+    struct gen_pool_cache *cache;
+    struct gen_pool_magazine *loaded;
+    struct gen_pool_magazine *previous;
+};
+
+struct gen_pool_cache {
+    struct gen_pool *pool;
+    size_t obj_size;
+    pthread_key_t key;
+    spinlock_t depot_lock;
+    struct gen_pool_magazine *full;
+    struct gen_pool_magazine *empty;
+    unsigned long nr_full;
+    struct gen_pool_cache_cpu *cpus;
+};
+
+static void gen_pool_mag_flush(struct gen_pool_cache *cache,
+                               struct gen_pool_magazine *mag)
+{
+    while (mag->nr)
+        gen_pool_free(cache->pool, mag->objs[--mag->nr], cache->obj_size);
+}
+
+/* Called at thread exit: return the thread's magazines to the depot */
+static void gen_pool_cache_cpu_release(void *data)
+{
+    struct gen_pool_cache_cpu *cc = data;
+    struct gen_pool_cache *cache = cc->cache;
+    struct gen_pool_cache_cpu **pp;
+    struct gen_pool_magazine *mags[2] = { cc->loaded, cc->previous };
+    int i;
+
+    spin_lock(&cache->depot_lock);
+    for (pp = &cache->cpus; *pp != cc; pp = &(*pp)->next)
+        ;
+    *pp = cc->next;
+    for (i = 0; i < 2; i++) {
+        if (mags[i]->nr == GEN_POOL_MAG_SIZE) {
+            mags[i]->next = cache->full;
+            cache->full = mags[i];
+            cache->nr_full++;
+            mags[i] = NULL;
+        }
+    }
+    spin_unlock(&cache->depot_lock);
+
+    // Partially filled magazines go back to the pool object by object
+    for (i = 0; i < 2; i++) {
+        if (mags[i]) {
+            gen_pool_mag_flush(cache, mags[i]);
+            free(mags[i]);
+        }
+    }
+    free(cc);
+}
+
+static struct gen_pool_cache_cpu *gen_pool_cache_this_cpu(struct gen_pool_cache *cache)
+{
+    struct gen_pool_cache_cpu *cc = pthread_getspecific(cache->key);
+
+    if (cc != NULL)
+        return cc;
+
+    cc = calloc(1, sizeof(*cc));
+    if (cc == NULL)
+        return NULL;
+    cc->cache = cache;
+    cc->loaded = calloc(1, sizeof(*cc->loaded));
+    cc->previous = calloc(1, sizeof(*cc->previous));
+    if (cc->loaded == NULL || cc->previous == NULL ||
+        pthread_setspecific(cache->key, cc)) {
+        free(cc->loaded);
+        free(cc->previous);
+        free(cc);
+        return NULL;
+    }
+
+    spin_lock(&cache->depot_lock);
+    cc->next = cache->cpus;
+    cache->cpus = cc;
+    spin_unlock(&cache->depot_lock);
+    return cc;
+}
+
+struct gen_pool_cache *gen_pool_cache_create(struct gen_pool *pool, size_t obj_size)
+{
+    struct gen_pool_cache *cache;
+
+    if (obj_size == 0)
+        return NULL;
+
+    cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+        return NULL;
+    if (pthread_key_create(&cache->key, gen_pool_cache_cpu_release)) {
+        free(cache);
+        return NULL;
+    }
+    cache->pool = pool;
+    cache->obj_size = obj_size;
+    spin_lock_init(&cache->depot_lock);
+    return cache;
+}
+
+unsigned long gen_pool_cache_alloc(struct gen_pool_cache *cache)
+{
+    struct gen_pool_cache_cpu *cc = gen_pool_cache_this_cpu(cache);
+    struct gen_pool_magazine *mag;
+
+    if (cc == NULL)
+        return gen_pool_alloc(cache->pool, cache->obj_size);
+
+    if (cc->loaded->nr)
+        return cc->loaded->objs[--cc->loaded->nr];
+
+    if (cc->previous->nr) {
+        mag = cc->loaded;
+        cc->loaded = cc->previous;
+        cc->previous = mag;
+        return cc->loaded->objs[--cc->loaded->nr];
+    }
+
+    // Both magazines are empty: trade one for a full one from the depot
+    spin_lock(&cache->depot_lock);
+    mag = cache->full;
+    if (mag != NULL) {
+        cache->full = mag->next;
+        cache->nr_full--;
+        cc->previous->next = cache->empty;
+        cache->empty = cc->previous;
+        cc->previous = cc->loaded;
+        cc->loaded = mag;
+    }
+    spin_unlock(&cache->depot_lock);
+
+    if (mag != NULL)
+        return cc->loaded->objs[--cc->loaded->nr];
+    return gen_pool_alloc(cache->pool, cache->obj_size);
+}
+
+void gen_pool_cache_free(struct gen_pool_cache *cache, unsigned long addr)
+{
+    struct gen_pool_cache_cpu *cc = gen_pool_cache_this_cpu(cache);
+    struct gen_pool_magazine *mag;
+
+    if (cc == NULL) {
+        gen_pool_free(cache->pool, addr, cache->obj_size);
+        return;
+    }
+
+    if (cc->loaded->nr < GEN_POOL_MAG_SIZE) {
+        cc->loaded->objs[cc->loaded->nr++] = addr;
+        return;
+    }
+
+    if (cc->previous->nr == 0) {
+        mag = cc->loaded;
+        cc->loaded = cc->previous;
+        cc->previous = mag;
+        cc->loaded->objs[cc->loaded->nr++] = addr;
+        return;
+    }
+
+    // Both magazines are full: hand one to the depot for an empty one
+    spin_lock(&cache->depot_lock);
+    mag = cache->empty;
+    if (mag != NULL)
+        cache->empty = mag->next;
+    spin_unlock(&cache->depot_lock);
+
+    if (mag == NULL) {
+        mag = malloc(sizeof(*mag));
+        if (mag == NULL) {
+            gen_pool_free(cache->pool, addr, cache->obj_size);
+            return;
+        }
+    }
+    mag->nr = 0;
+
+    spin_lock(&cache->depot_lock);
+    cc->previous->next = cache->full;
+    cache->full = cc->previous;
+    cache->nr_full++;
+    spin_unlock(&cache->depot_lock);
+
+    cc->previous = cc->loaded;
+    cc->loaded = mag;
+    cc->loaded->objs[cc->loaded->nr++] = addr;
+}
+
+/* Return the objects in the depot's full magazines to the pool */
+void gen_pool_cache_shrink(struct gen_pool_cache *cache)
+{
+    struct gen_pool_magazine *full, *mag;
+
+    spin_lock(&cache->depot_lock);
+    full = cache->full;
+    cache->full = NULL;
+    cache->nr_full = 0;
+    spin_unlock(&cache->depot_lock);
+
+    while (full != NULL) {
+        mag = full;
+        full = mag->next;
+        gen_pool_mag_flush(cache, mag);
+        spin_lock(&cache->depot_lock);
+        mag->next = cache->empty;
+        cache->empty = mag;
+        spin_unlock(&cache->depot_lock);
+    }
+}
+
+/*
+ * Tear down the cache and return every cached object to the pool. No
+ * thread may be using the cache, but threads that used it may still be
+ * running; their magazines are drained here instead of at thread exit.
+ */
+void gen_pool_cache_destroy(struct gen_pool_cache *cache)
+{
+    struct gen_pool_cache_cpu *cc, *next_cc;
+    struct gen_pool_magazine *mag, *next_mag;
+
+    pthread_key_delete(cache->key);
+
+    for (cc = cache->cpus; cc != NULL; cc = next_cc) {
+        next_cc = cc->next;
+        gen_pool_mag_flush(cache, cc->loaded);
+        gen_pool_mag_flush(cache, cc->previous);
+        free(cc->loaded);
+        free(cc->previous);
+        free(cc);
+    }
+    for (mag = cache->full; mag != NULL; mag = next_mag) {
+        next_mag = mag->next;
+        gen_pool_mag_flush(cache, mag);
+        free(mag);
+    }
+    for (mag = cache->empty; mag != NULL; mag = next_mag) {
+        next_mag = mag->next;
+        free(mag);
+    }
+    free(cache);
+}
+
 /* Test scenario */
 void print_memory_status(struct gen_pool *pool, const char *message)
 {
@@ -344,6 +1134,614 @@ void print_memory_status(struct gen_pool *pool, const char *message)
 #define MIN_ALLOC_ORDER 12            // 4KB minimum allocation
 #define NUM_ALLOCATIONS 10
 #define MAX_ALLOC_SIZE (64 * 1024)    // 64KB maximum allocation
+#define POOL_BASE 0x100000000UL
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Check the placement each algorithm picks on a known fragmented chunk
+int test_algorithms(void)
+{
+    struct genpool_data_fixed fixed = { .offset = 12 << MIN_ALLOC_ORDER };
+    struct gen_pool *pool;
+    unsigned long a, b, c, addr;
+    int failures = 0;
+
+    printf("\n=== Allocation algorithms ===\n");
+    pool = gen_pool_create(MIN_ALLOC_ORDER, NUMA_NO_NODE);
+    if (!pool || gen_pool_add_virt(pool, POOL_BASE, 0, TEST_POOL_SIZE, NUMA_NO_NODE))
+        return 1;
+
+    // Layout in 4KB blocks: [0-3 free][4 used][5 free][6 used][7.. free]
+    a = gen_pool_alloc(pool, 4 << MIN_ALLOC_ORDER);
+    b = gen_pool_alloc(pool, 1 << MIN_ALLOC_ORDER);
+    c = gen_pool_alloc(pool, 1 << MIN_ALLOC_ORDER);
+    addr = gen_pool_alloc(pool, 1 << MIN_ALLOC_ORDER);
+    gen_pool_free(pool, a, 4 << MIN_ALLOC_ORDER);
+    gen_pool_free(pool, c, 1 << MIN_ALLOC_ORDER);
+
+    // Allocations past the first used block now succeed
+    a = gen_pool_alloc(pool, 2 << MIN_ALLOC_ORDER);
+    printf("first-fit 8KB at block %lu: %s\n", (a - POOL_BASE) >> MIN_ALLOC_ORDER,
+           a == POOL_BASE ? "PASS" : "FAIL");
+    failures += a != POOL_BASE;
+    gen_pool_free(pool, a, 2 << MIN_ALLOC_ORDER);
+
+    // Best fit takes the one-block hole instead of the four-block one
+    a = gen_pool_alloc_algo(pool, 1 << MIN_ALLOC_ORDER, gen_pool_best_fit, NULL);
+    printf("best-fit 4KB at block %lu: %s\n", (a - POOL_BASE) >> MIN_ALLOC_ORDER,
+           a == c ? "PASS" : "FAIL");
+    failures += a != c;
+    gen_pool_free(pool, a, 1 << MIN_ALLOC_ORDER);
+
+    // Order-aligned 16KB must skip to block 8
+    a = gen_pool_alloc_algo(pool, 3 << MIN_ALLOC_ORDER,
+                            gen_pool_first_fit_order_align, NULL);
+    printf("order-aligned 12KB at block %lu: %s\n", (a - POOL_BASE) >> MIN_ALLOC_ORDER,
+           a == POOL_BASE ? "PASS" : "FAIL");
+    failures += a != POOL_BASE;
+    gen_pool_free(pool, a, 3 << MIN_ALLOC_ORDER);
+    a = gen_pool_alloc_algo(pool, 1 << MIN_ALLOC_ORDER, gen_pool_first_fit, NULL);
+    c = gen_pool_alloc_algo(pool, 4 << MIN_ALLOC_ORDER,
+                            gen_pool_first_fit_order_align, NULL);
+    printf("order-aligned 16KB at block %lu: %s\n", (c - POOL_BASE) >> MIN_ALLOC_ORDER,
+           c == POOL_BASE + (8 << MIN_ALLOC_ORDER) ? "PASS" : "FAIL");
+    failures += c != POOL_BASE + (8 << MIN_ALLOC_ORDER);
+    gen_pool_free(pool, a, 1 << MIN_ALLOC_ORDER);
+    gen_pool_free(pool, c, 4 << MIN_ALLOC_ORDER);
+
+    // Fixed offset gets exactly block 12, and fails once it is taken
+    gen_pool_set_algo(pool, gen_pool_fixed_alloc, &fixed);
+    a = gen_pool_alloc(pool, 2 << MIN_ALLOC_ORDER);
+    c = gen_pool_alloc(pool, 2 << MIN_ALLOC_ORDER);
+    printf("fixed offset block 12: %s\n",
+           a == POOL_BASE + fixed.offset && !c ? "PASS" : "FAIL");
+    failures += a != POOL_BASE + fixed.offset || c;
+    gen_pool_set_algo(pool, NULL, NULL);
+    gen_pool_free(pool, a, 2 << MIN_ALLOC_ORDER);
+
+    gen_pool_free(pool, b, 1 << MIN_ALLOC_ORDER);
+    gen_pool_free(pool, addr, 1 << MIN_ALLOC_ORDER);
+    printf("pool empty again: %s\n",
+           gen_pool_avail(pool) == TEST_POOL_SIZE ? "PASS" : "FAIL");
+    failures += gen_pool_avail(pool) != TEST_POOL_SIZE;
+
+    gen_pool_destroy(pool);
+    return failures;
+}
+
+#define BENCH_ORDER 6                 // 64-byte blocks
+#define BENCH_ITERS 20000
+
+/*
+ * Latency of one alloc/free pair against chunk size and fragmentation.
+ * Fragmentation is produced by filling the first 3/4 of the chunk and
+ * then freeing every Nth block, so the free space there is scattered in
+ * one-block holes and the requested size only fits in the tail.
+ */
+void benchmark_algorithms(void)
+{
+    static const size_t chunk_sizes[] = { 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+    static const int hole_every[] = { 0, 8, 2 };
+    static const struct {
+        const char *name;
+        genpool_algo_t algo;
+    } algos[] = {
+        { "first-fit", gen_pool_first_fit },
+        { "best-fit", gen_pool_best_fit },
+        { "order-align", gen_pool_first_fit_order_align },
+    };
+    const size_t alloc_size = 4 << BENCH_ORDER;
+
+    printf("\n=== Allocation latency (ns per alloc+free of %zu bytes) ===\n",
+           alloc_size);
+    printf("%-12s %10s %6s %12s\n", "algorithm", "chunk", "holes", "ns");
+
+    for (size_t c = 0; c < sizeof(chunk_sizes) / sizeof(chunk_sizes[0]); c++) {
+        for (size_t f = 0; f < sizeof(hole_every) / sizeof(hole_every[0]); f++) {
+            for (size_t a = 0; a < sizeof(algos) / sizeof(algos[0]); a++) {
+                struct gen_pool *pool = gen_pool_create(BENCH_ORDER, NUMA_NO_NODE);
+                unsigned long nblocks = chunk_sizes[c] >> BENCH_ORDER;
+                unsigned long iters = BENCH_ITERS / (nblocks / 1024);
+                unsigned long i, addr;
+                uint64_t t0, t1;
+
+                if (!pool || gen_pool_add_virt(pool, POOL_BASE, 0, chunk_sizes[c],
+                                               NUMA_NO_NODE))
+                    return;
+
+                // Fill the first 3/4, then punch one-block holes into it
+                if (hole_every[f]) {
+                    unsigned long filled = nblocks / 4 * 3;
+
+                    for (i = 0; i < filled; i++)
+                        gen_pool_alloc(pool, 1 << BENCH_ORDER);
+                    for (i = 0; i < filled; i += hole_every[f])
+                        gen_pool_free(pool, POOL_BASE + (i << BENCH_ORDER),
+                                      1 << BENCH_ORDER);
+                }
+
+                t0 = now_ns();
+                for (i = 0; i < iters; i++) {
+                    addr = gen_pool_alloc_algo(pool, alloc_size, algos[a].algo, NULL);
+                    if (addr)
+                        gen_pool_free(pool, addr, alloc_size);
+                }
+                t1 = now_ns();
+
+                printf("%-12s %9zuK %4s%-2d %12.1f\n", algos[a].name,
+                       chunk_sizes[c] / 1024, hole_every[f] ? "1/" : "", hole_every[f],
+                       (double)(t1 - t0) / iters);
+                gen_pool_destroy(pool);
+            }
+        }
+    }
+}
+
+#define LOOKUP_CHUNKS 512
+#define LOOKUP_CHUNK_SIZE (64 * 1024)
+
+struct lookup_arg {
+    struct gen_pool *pool;
+    bool stop;
+    unsigned long lookups;
+    unsigned long misses;
+};
+
+// Look up the first chunk over and over while others are being added
+static void *lookup_worker(void *data)
+{
+    struct lookup_arg *arg = data;
+
+    while (!__atomic_load_n(&arg->stop, __ATOMIC_RELAXED)) {
+        arg->misses += gen_pool_virt_to_phys(arg->pool, POOL_BASE + 8) != 0x80000008UL;
+        arg->lookups++;
+    }
+    return NULL;
+}
+
+/* Address lookups over a pool with hundreds of chunks */
+int test_chunk_lookup(void)
+{
+    struct gen_pool *pool = gen_pool_create(BENCH_ORDER, NUMA_NO_NODE);
+    struct lookup_arg arg = { .pool = pool };
+    unsigned long addrs[LOOKUP_CHUNKS];
+    unsigned long base, i;
+    pthread_t reader;
+    int failures = 0;
+    uint64_t t0, t1;
+
+    printf("\n=== Chunk lookup (%d chunks) ===\n", LOOKUP_CHUNKS);
+    if (!pool)
+        return 1;
+
+    // Add chunks in shuffled order with a gap after each one, while a
+    // lookup runs against every index copy as it is replaced and freed
+    for (i = 0; i < LOOKUP_CHUNKS; i++) {
+        unsigned long n = (i * 149) % LOOKUP_CHUNKS;
+
+        base = POOL_BASE + n * 2 * LOOKUP_CHUNK_SIZE;
+        if (gen_pool_add_virt(pool, base, 0x80000000UL + n * LOOKUP_CHUNK_SIZE,
+                              LOOKUP_CHUNK_SIZE, NUMA_NO_NODE))
+            return 1;
+        if (i == 0)
+            pthread_create(&reader, NULL, lookup_worker, &arg);
+    }
+    __atomic_store_n(&arg.stop, true, __ATOMIC_RELAXED);
+    pthread_join(reader, NULL);
+    printf("lookups during chunk adds: %lu, misses: %lu\n", arg.lookups, arg.misses);
+    failures += arg.misses != 0;
+
+    base = POOL_BASE + 37 * 2 * LOOKUP_CHUNK_SIZE;
+    failures += gen_pool_virt_to_phys(pool, base + 100) !=
+                0x80000000UL + 37 * LOOKUP_CHUNK_SIZE + 100;
+    failures += gen_pool_virt_to_phys(pool, base + LOOKUP_CHUNK_SIZE) !=
+                (phys_addr_t)-1;
+    failures += !gen_pool_has_addr(pool, base, LOOKUP_CHUNK_SIZE);
+    failures += gen_pool_has_addr(pool, base + 1, LOOKUP_CHUNK_SIZE);
+    failures += gen_pool_has_addr(pool, POOL_BASE - 1, 1);
+    printf("virt_to_phys/has_addr: %s\n", failures ? "FAIL" : "PASS");
+
+    // Fill every chunk, then time freeing in an order unrelated to the list
+    for (i = 0; i < LOOKUP_CHUNKS; i++)
+        addrs[i] = gen_pool_alloc(pool, 1 << BENCH_ORDER);
+    t0 = now_ns();
+    for (i = 0; i < LOOKUP_CHUNKS; i++) {
+        unsigned long n = (i * 211) % LOOKUP_CHUNKS;
+
+        gen_pool_free(pool, addrs[n], 1 << BENCH_ORDER);
+    }
+    t1 = now_ns();
+    printf("gen_pool_free: %.1f ns per call\n", (double)(t1 - t0) / LOOKUP_CHUNKS);
+    if (gen_pool_avail(pool) != (size_t)LOOKUP_CHUNKS * LOOKUP_CHUNK_SIZE) {
+        printf("frees landed in the wrong chunk: FAIL\n");
+        failures++;
+    }
+
+    gen_pool_destroy(pool);
+    return failures;
+}
+
+#define FRAG_CHUNKS 64
+#define FRAG_CHUNK_SIZE (64 * 1024)
+
+// True if no chunk has a free run longer than its max_free bound
+static bool max_free_bounds_hold(struct gen_pool *pool)
+{
+    struct gen_pool_chunk *chunk;
+    unsigned long nbits;
+
+    for (chunk = pool->chunks; chunk != NULL; chunk = chunk->next_chunk) {
+        nbits = chunk_size(chunk) >> pool->min_alloc_order;
+        if (bitmap_longest_zero_run(chunk->bits, nbits) > MAX_FREE_BOUND(chunk->max_free))
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Many chunks with half their blocks free, but only in single-block holes,
+ * in front of one empty chunk. Without the max_free bound every 4-block
+ * allocation scans all the fragmented chunks before reaching the last one.
+ */
+int test_max_free(void)
+{
+    struct gen_pool *pool = gen_pool_create(BENCH_ORDER, NUMA_NO_NODE);
+    const size_t alloc_size = 4 << BENCH_ORDER;
+    unsigned long nblocks = FRAG_CHUNK_SIZE >> BENCH_ORDER;
+    unsigned long i, addr;
+    int failures = 0;
+    uint64_t t0, t1, t2, t3;
+    double frag;
+
+    printf("\n=== Largest free extent (%d fragmented chunks) ===\n", FRAG_CHUNKS);
+    if (!pool)
+        return 1;
+
+    // The clean chunk goes in first so it ends up last in the chunk list
+    for (i = 0; i <= FRAG_CHUNKS; i++) {
+        if (gen_pool_add_virt(pool, POOL_BASE + i * FRAG_CHUNK_SIZE, 0,
+                              FRAG_CHUNK_SIZE, NUMA_NO_NODE))
+            return 1;
+        if (i == 0) {
+            frag = gen_pool_fragmentation(pool);
+            printf("fragmentation of one empty chunk: %.3f\n", frag);
+            failures += frag != 0.0;
+        }
+    }
+
+    while (gen_pool_alloc(pool, 1 << BENCH_ORDER))
+        ;
+    for (i = 0; i < nblocks; i++)
+        gen_pool_free(pool, POOL_BASE + (i << BENCH_ORDER), 1 << BENCH_ORDER);
+    for (i = nblocks; i < (FRAG_CHUNKS + 1) * nblocks; i += 2)
+        gen_pool_free(pool, POOL_BASE + (i << BENCH_ORDER), 1 << BENCH_ORDER);
+    failures += !max_free_bounds_hold(pool);
+
+    // The first allocation pays for measuring each fragmented chunk once
+    t0 = now_ns();
+    addr = gen_pool_alloc(pool, alloc_size);
+    t1 = now_ns();
+    failures += addr != POOL_BASE;
+    gen_pool_free(pool, addr, alloc_size);
+
+    t2 = now_ns();
+    for (i = 0; i < BENCH_ITERS; i++) {
+        addr = gen_pool_alloc(pool, alloc_size);
+        if (addr >= POOL_BASE + FRAG_CHUNK_SIZE)
+            failures++;
+        gen_pool_free(pool, addr, alloc_size);
+    }
+    t3 = now_ns();
+    printf("first alloc (refreshes bounds): %.1f ns\n", (double)(t1 - t0));
+    printf("alloc+free after refresh: %.1f ns\n", (double)(t3 - t2) / BENCH_ITERS);
+    failures += !max_free_bounds_hold(pool);
+
+    frag = gen_pool_fragmentation(pool);
+    printf("fragmentation: %.3f\n", frag);
+    failures += frag < 0.9 || frag >= 1.0;
+
+    printf("max_free bound: %s\n", failures ? "FAIL" : "PASS");
+    gen_pool_destroy(pool);
+    return failures;
+}
+
+#define NUMA_TEST_NODES 4
+#define NUMA_CHUNK_BLOCKS 16
+
+/*
+ * Two fake sockets with two nodes each: nodes on the same socket are 12
+ * apart, nodes on different sockets 24. Every node gets one chunk and
+ * one more chunk has no node. Filling the pool from node 2 must use node
+ * 2, then its socket sibling 3, then 0 and 1, then the untagged chunk.
+ */
+int test_alloc_node(void)
+{
+    static const int expect[] = { 2, 3, 0, 1, NUMA_NO_NODE };
+    struct gen_pool *pool = gen_pool_create(MIN_ALLOC_ORDER, NUMA_NO_NODE);
+    const size_t chunk_bytes = NUMA_CHUNK_BLOCKS << MIN_ALLOC_ORDER;
+    struct gen_pool_chunk *chunk;
+    unsigned long addr;
+    int i, n, failures = 0;
+
+    printf("\n=== Node-affine allocation (%d fake nodes) ===\n", NUMA_TEST_NODES);
+    if (!pool)
+        return 1;
+
+    numa_fake_topology(NUMA_TEST_NODES);
+    numa_set_distance(0, 1, 12);
+    numa_set_distance(2, 3, 12);
+    numa_set_distance(0, 2, 24);
+    numa_set_distance(0, 3, 24);
+    numa_set_distance(1, 2, 24);
+    numa_set_distance(1, 3, 24);
+
+    for (i = 0; i <= NUMA_TEST_NODES; i++) {
+        if (gen_pool_add_virt(pool, POOL_BASE + i * 2 * chunk_bytes, 0, chunk_bytes,
+                              i < NUMA_TEST_NODES ? i : NUMA_NO_NODE))
+            return 1;
+    }
+
+    for (n = 0; n < (int)(sizeof(expect) / sizeof(expect[0])); n++) {
+        int misplaced = 0;
+
+        for (i = 0; i < NUMA_CHUNK_BLOCKS; i++) {
+            addr = gen_pool_alloc_node(pool, 1 << MIN_ALLOC_ORDER, 2);
+            chunk = addr ? gen_pool_find_chunk(pool, addr) : NULL;
+            if (!chunk || chunk->nid != expect[n])
+                misplaced++;
+        }
+        printf("node %2d filled next: %s\n", expect[n], misplaced ? "FAIL" : "PASS");
+        failures += misplaced != 0;
+    }
+    if (gen_pool_alloc_node(pool, 1 << MIN_ALLOC_ORDER, 2) != 0) {
+        printf("allocation from a full pool: FAIL\n");
+        failures++;
+    }
+
+    // A nid outside the topology falls back to the whole pool
+    gen_pool_free(pool, POOL_BASE, 1 << MIN_ALLOC_ORDER);
+    addr = gen_pool_alloc_node(pool, 1 << MIN_ALLOC_ORDER, NUMA_NO_NODE);
+    printf("NUMA_NO_NODE: %s\n", addr == POOL_BASE ? "PASS" : "FAIL");
+    failures += addr != POOL_BASE;
+
+    numa_fake_topology(1);
+    gen_pool_destroy(pool);
+    return failures;
+}
+
+#define STRESS_MAX_THREADS 8
+#define STRESS_ITERS 200000
+#define STRESS_LIVE 16
+#define STRESS_POOL_SIZE (4 * 1024 * 1024)
+
+struct stress_arg {
+    struct gen_pool *pool;
+    unsigned char *owner;     // one byte per block, who holds it
+    int id;
+    unsigned int seed;
+    unsigned long ops;
+    unsigned long failed;
+    unsigned long overlaps;
+};
+
+// Claim or release the shadow owner bytes for an allocation
+static unsigned long stress_mark(struct stress_arg *arg, unsigned long addr,
+                                 size_t size, unsigned char from, unsigned char to)
+{
+    unsigned long first = (addr - POOL_BASE) >> BENCH_ORDER;
+    unsigned long i, bad = 0;
+
+    for (i = first; i < first + (size >> BENCH_ORDER); i++) {
+        unsigned char expected = from;
+
+        if (!__atomic_compare_exchange_n(&arg->owner[i], &expected, to, false,
+                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            bad++;
+    }
+    return bad;
+}
+
+static void *stress_worker(void *data)
+{
+    struct stress_arg *arg = data;
+    unsigned long addrs[STRESS_LIVE] = { 0 };
+    size_t sizes[STRESS_LIVE];
+    int i, slot;
+
+    for (i = 0; i < STRESS_ITERS; i++) {
+        slot = rand_r(&arg->seed) % STRESS_LIVE;
+        if (addrs[slot]) {
+            arg->overlaps += stress_mark(arg, addrs[slot], sizes[slot], arg->id, 0);
+            gen_pool_free(arg->pool, addrs[slot], sizes[slot]);
+            addrs[slot] = 0;
+        } else {
+            sizes[slot] = (rand_r(&arg->seed) % 16 + 1) << BENCH_ORDER;
+            addrs[slot] = gen_pool_alloc(arg->pool, sizes[slot]);
+            if (addrs[slot])
+                arg->overlaps += stress_mark(arg, addrs[slot], sizes[slot], 0, arg->id);
+            else
+                arg->failed++;
+        }
+        arg->ops++;
+    }
+
+    for (slot = 0; slot < STRESS_LIVE; slot++) {
+        if (addrs[slot]) {
+            arg->overlaps += stress_mark(arg, addrs[slot], sizes[slot], arg->id, 0);
+            gen_pool_free(arg->pool, addrs[slot], sizes[slot]);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Many threads allocating and freeing from one pool with no lock. A
+ * shadow owner map catches any block handed to two threads at once.
+ */
+int stress_concurrent(void)
+{
+    struct stress_arg args[STRESS_MAX_THREADS];
+    pthread_t threads[STRESS_MAX_THREADS];
+    unsigned long overlaps = 0;
+    int nthreads, i, failures = 0;
+
+    printf("\n=== Concurrent allocation stress ===\n");
+    printf("%-8s %14s %10s %9s\n", "threads", "ops/s", "failed", "overlaps");
+
+    for (nthreads = 1; nthreads <= STRESS_MAX_THREADS; nthreads *= 2) {
+        struct gen_pool *pool = gen_pool_create(BENCH_ORDER, NUMA_NO_NODE);
+        unsigned char *owner = calloc(STRESS_POOL_SIZE >> BENCH_ORDER, 1);
+        unsigned long ops = 0, failed = 0;
+        uint64_t t0, t1;
+
+        if (!pool || !owner ||
+            gen_pool_add_virt(pool, POOL_BASE, 0, STRESS_POOL_SIZE, NUMA_NO_NODE))
+            return 1;
+
+        t0 = now_ns();
+        for (i = 0; i < nthreads; i++) {
+            args[i] = (struct stress_arg) {
+                .pool = pool, .owner = owner, .id = i + 1, .seed = i + 1,
+            };
+            pthread_create(&threads[i], NULL, stress_worker, &args[i]);
+        }
+        overlaps = 0;
+        for (i = 0; i < nthreads; i++) {
+            pthread_join(threads[i], NULL);
+            ops += args[i].ops;
+            failed += args[i].failed;
+            overlaps += args[i].overlaps;
+        }
+        t1 = now_ns();
+
+        printf("%-8d %14.0f %10lu %9lu\n", nthreads, ops * 1e9 / (t1 - t0),
+               failed, overlaps);
+        if (overlaps || gen_pool_avail(pool) != STRESS_POOL_SIZE ||
+            !max_free_bounds_hold(pool))
+            failures++;
+
+        gen_pool_destroy(pool);
+        free(owner);
+    }
+
+    printf("lock-free allocation: %s\n", failures ? "FAIL" : "PASS");
+    return failures;
+}
+
+#define CACHE_OBJ_SIZE (2 << BENCH_ORDER)
+#define CACHE_ITERS 200000
+#define CACHE_BATCH 48              // more than one magazine per thread
+
+struct cache_arg {
+    struct gen_pool_cache *cache;
+    struct stress_arg stress;
+    bool use_cache;
+};
+
+static void *cache_worker(void *data)
+{
+    struct cache_arg *arg = data;
+    struct stress_arg *s = &arg->stress;
+    unsigned long addrs[CACHE_BATCH];
+    int i, j, n;
+
+    for (i = 0; i < CACHE_ITERS; i += n) {
+        // Alternate between short and long runs so magazines cross the depot
+        n = (rand_r(&s->seed) % 2) ? 4 : CACHE_BATCH;
+        for (j = 0; j < n; j++) {
+            if (arg->use_cache)
+                addrs[j] = gen_pool_cache_alloc(arg->cache);
+            else
+                addrs[j] = gen_pool_alloc(s->pool, CACHE_OBJ_SIZE);
+            if (addrs[j])
+                s->overlaps += stress_mark(s, addrs[j], CACHE_OBJ_SIZE, 0, s->id);
+            else
+                s->failed++;
+        }
+        for (j = 0; j < n; j++) {
+            if (!addrs[j])
+                continue;
+            s->overlaps += stress_mark(s, addrs[j], CACHE_OBJ_SIZE, s->id, 0);
+            if (arg->use_cache)
+                gen_pool_cache_free(arg->cache, addrs[j]);
+            else
+                gen_pool_free(s->pool, addrs[j], CACHE_OBJ_SIZE);
+        }
+        s->ops += n;
+    }
+    return NULL;
+}
+
+/*
+ * Fixed-size alloc/free through the magazine cache against going straight
+ * to the pool, with the shadow owner map checking for double handouts.
+ */
+int test_cache(void)
+{
+    struct cache_arg args[STRESS_MAX_THREADS];
+    pthread_t threads[STRESS_MAX_THREADS];
+    int nthreads, i, failures = 0;
+
+    printf("\n=== Magazine cache (%d-byte objects) ===\n", CACHE_OBJ_SIZE);
+    printf("%-8s %14s %14s %9s\n", "threads", "pool ops/s", "cache ops/s", "overlaps");
+
+    for (nthreads = 1; nthreads <= STRESS_MAX_THREADS; nthreads *= 2) {
+        double rate[2];
+        unsigned long overlaps = 0;
+
+        for (int use_cache = 0; use_cache <= 1; use_cache++) {
+            struct gen_pool *pool = gen_pool_create(BENCH_ORDER, NUMA_NO_NODE);
+            unsigned char *owner = calloc(STRESS_POOL_SIZE >> BENCH_ORDER, 1);
+            struct gen_pool_cache *cache;
+            unsigned long ops = 0;
+            uint64_t t0, t1;
+
+            if (!pool || !owner ||
+                gen_pool_add_virt(pool, POOL_BASE, 0, STRESS_POOL_SIZE, NUMA_NO_NODE))
+                return 1;
+            cache = gen_pool_cache_create(pool, CACHE_OBJ_SIZE);
+            if (!cache)
+                return 1;
+
+            t0 = now_ns();
+            for (i = 0; i < nthreads; i++) {
+                args[i] = (struct cache_arg) {
+                    .cache = cache, .use_cache = use_cache,
+                    .stress = { .pool = pool, .owner = owner, .id = i + 1, .seed = i + 1 },
+                };
+                pthread_create(&threads[i], NULL, cache_worker, &args[i]);
+            }
+            for (i = 0; i < nthreads; i++) {
+                pthread_join(threads[i], NULL);
+                ops += args[i].stress.ops;
+                overlaps += args[i].stress.overlaps + args[i].stress.failed;
+            }
+            t1 = now_ns();
+            rate[use_cache] = ops * 1e9 / (t1 - t0);
+
+            // Exited threads parked their full magazines in the depot
+            gen_pool_cache_shrink(cache);
+            if (gen_pool_avail(pool) != STRESS_POOL_SIZE)
+                failures++;
+            gen_pool_cache_destroy(cache);
+            gen_pool_destroy(pool);
+            free(owner);
+        }
+
+        printf("%-8d %14.0f %14.0f %9lu\n", nthreads, rate[0], rate[1], overlaps);
+        if (overlaps)
+            failures++;
+    }
+
+    printf("magazine cache: %s\n", failures ? "FAIL" : "PASS");
+    return failures;
+}
 
 int main()
 {
@@ -426,5 +1824,19 @@ int main()
     gen_pool_destroy(pool);
     printf("\nMemory pool destroyed\n");
 
+    if (test_algorithms())
+        return 1;
+    benchmark_algorithms();
+    if (stress_concurrent())
+        return 1;
+    if (test_chunk_lookup())
+        return 1;
+    if (test_cache())
+        return 1;
+    if (test_max_free())
+        return 1;
+    if (test_alloc_node())
+        return 1;
+
     return 0;
 }
@@ -5,6 +5,7 @@
  * Date: 2024-12-27
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,6 +14,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
 
 /* Constants */
 #define PAGE_SIZE           4096
@@ -21,6 +24,20 @@
 #define SWIOTLB_SIZE       (4 * 1024 * 1024)  /* 4MB default size */
 #define SLOT_SIZE          128
 #define MAX_SLOTS          (SWIOTLB_SIZE / SLOT_SIZE)
+#define SWIOTLB_SEGSIZE    128  /* max contiguous slots per mapping */
+#define MAX_AREAS          64
+#define BITS_PER_LONG      (sizeof(unsigned long) * 8)
+#define BITS_TO_LONGS(nr)  (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define ALIGN(x, a)        (((x) + (a) - 1) / (a) * (a))
+#define DMA_BIT_MASK(n)    (((n) == 64) ? ~0ULL : ((1ULL << (n)) - 1))
+#define CACHE_LINE_SIZE    64
+#define SWIOTLB_MAX_POOLS  32   /* default cap on default plus grown pools */
+#define SWIOTLB_GROW_PCT   75   /* grow once this much of the pools is used */
+#define SWIOTLB_RECLAIM_NS 1000000000ULL  /* idle time before reclaim */
+#define SWIOTLB_MAX_SG     128  /* max entries in one scatter-gather list */
+#define SWIOTLB_STAT_SLOTS 64   /* per-thread counter slots */
+#define SWIOTLB_HIST_BUCKETS 8  /* mapping sizes of 1, 2, 4 ... 128 slots */
 #define DMA_BIDIRECTIONAL  0
 #define DMA_TO_DEVICE      1
 #define DMA_FROM_DEVICE    2
@@ -36,6 +53,7 @@
 #define SWIOTLB_VERBOSE   0x1
 #define SWIOTLB_FORCE     0x2
 #define SWIOTLB_COHERENT  0x4
+#define SWIOTLB_DYNAMIC   0x8
 
 /* Statistics counters */
 struct swiotlb_stats {
@@ -47,225 +65,1373 @@ struct swiotlb_stats {
     uint64_t sync_for_cpu;
     uint64_t sync_for_device;
     uint64_t errors;
+    uint64_t direct_maps;
+    uint64_t pools_grown;
+    uint64_t transient_pools;
+    uint64_t pools_reclaimed;
+    uint64_t alloc_hist[SWIOTLB_HIST_BUCKETS];  /* bounced sizes, log2 slots */
 };
 
-/* Slot structure */
+/*
+ * Counters are spread over cache-line aligned slots, one per thread
+ * (modulo SWIOTLB_STAT_SLOTS), so updates do not bounce a shared line
+ * between CPUs. Readers sum the slots with swiotlb_read_stats().
+ */
+struct swiotlb_stats_slot {
+    struct swiotlb_stats stats;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* Occupancy summary computed by swiotlb_read_usage() */
+struct swiotlb_usage {
+    unsigned int total_slots;
+    unsigned int used_slots;
+    unsigned int used_hiwater;      /* most slots ever in use at once */
+    unsigned int largest_free_run;  /* longest run of free slots */
+    double       utilization;       /* time-weighted, 0.0 to 1.0 */
+};
+
+#define swiotlb_stat_add(ctx, field, n) \
+    __atomic_fetch_add(&swiotlb_this_stats(ctx)->field, (n), __ATOMIC_RELAXED)
+#define swiotlb_stat_inc(ctx, field) swiotlb_stat_add(ctx, field, 1)
+
+/*
+ * Per-device DMA constraints. A buffer that the device can reach directly
+ * is mapped without bouncing unless SWIOTLB_FORCE is set. Devices without
+ * SWIOTLB_COHERENT need cache maintenance on sync, so they only take
+ * buffers that start and end on a cache line boundary.
+ */
+struct swiotlb_device {
+    uint64_t  dma_mask;     /* highest address the device can reach */
+    size_t    min_align;    /* required alignment in bytes, 0 for none */
+    uint32_t  flags;        /* SWIOTLB_COHERENT, SWIOTLB_FORCE */
+};
+
+/* Scatter-gather entry, dma_address/dma_length are filled in by map_sg */
+struct scatterlist {
+    void     *addr;
+    size_t    length;
+    void     *dma_address;
+    size_t    dma_length;
+};
+
+/* Slot structure, only the first slot of a mapping carries metadata */
 struct swiotlb_slot {
     void     *orig_addr;
     void     *buffer;
     size_t    size;
+    unsigned int nslots;
     int       direction;
     bool      used;
     uint32_t  flags;
 };
 
-/* SWIOTLB context */
-struct swiotlb_context {
-    void               *pool;
+/*
+ * Area structure. Each pool is split into nr_areas equal ranges of slots,
+ * each protected by its own lock so that mappings submitted from different
+ * CPUs do not serialize on a single pool lock.
+ */
+struct swiotlb_area {
+    pthread_mutex_t    lock;
+    unsigned long      *bitmap;     /* one bit per slot, set when in use */
+    unsigned int       index;       /* search hint for the next allocation */
+    unsigned int       used;
+    uint64_t           last_update_ns;
+    uint64_t           used_slot_ns; /* integral of used over time */
+};
+
+/*
+ * Bounce buffer pool. The default pool lives as long as the context; extra
+ * pools are added when utilization runs high and reclaimed once they have
+ * been idle for the grace period. Transient pools hold a single mapping
+ * and are freed on unmap.
+ */
+struct swiotlb_pool {
+    void               *vaddr;
+    size_t             size;
     struct swiotlb_slot *slots;
-    size_t             pool_size;
     unsigned int       nr_slots;
-    unsigned int       used_slots;
+    struct swiotlb_area *areas;
+    unsigned int       nr_areas;    /* always a power of two */
+    unsigned int       area_nslots;
+    bool               transient;
+    uint64_t           created_ns;
+    uint64_t           last_used_ns;
+};
+
+/* SWIOTLB context */
+struct swiotlb_context {
+    struct swiotlb_pool *default_pool;
+    struct swiotlb_pool **pools;    /* sorted by vaddr */
+    unsigned int       nr_pools;
+    unsigned int       pools_cap;
+    unsigned int       max_pools;   /* cap on default plus grown pools */
+    pthread_rwlock_t   pools_lock;  /* protects pools[] and extra pools */
+    int                growing;
+    uint64_t           reclaim_grace_ns;
+    uint64_t           last_reclaim_ns;
+    unsigned int       used_slots;  /* bounced slots in use, all pools */
+    unsigned int       used_hiwater;
     uint32_t          flags;
-    struct swiotlb_stats stats;
+    struct swiotlb_stats_slot stats[SWIOTLB_STAT_SLOTS];
     bool              initialized;
 };
 
+/* Counter slot of the calling thread */
+static inline struct swiotlb_stats *
+swiotlb_this_stats(struct swiotlb_context *ctx) {
+    static __thread int stat_slot = -1;
+    static unsigned int next_slot;
+    
+    if (stat_slot < 0)
+        stat_slot = __atomic_fetch_add(&next_slot, 1, __ATOMIC_RELAXED) %
+                    SWIOTLB_STAT_SLOTS;
+    return &ctx->stats[stat_slot].stats;
+}
+
 /* Function declarations */
 static struct swiotlb_context *swiotlb_init(size_t size);
+static struct swiotlb_context *swiotlb_init_areas(size_t size, unsigned int nr_areas);
 static void swiotlb_cleanup(struct swiotlb_context *ctx);
-static void *swiotlb_map(struct swiotlb_context *ctx, void *addr, size_t size, int direction);
+static unsigned int swiotlb_used_slots(struct swiotlb_context *ctx);
+static unsigned int swiotlb_nr_pools(struct swiotlb_context *ctx);
+static unsigned int swiotlb_reclaim_pools(struct swiotlb_context *ctx);
+static void *swiotlb_map(struct swiotlb_context *ctx,
+                         const struct swiotlb_device *dev, void *addr,
+                         size_t size, int direction);
 static int swiotlb_unmap(struct swiotlb_context *ctx, void *dev_addr);
+static int swiotlb_map_sg(struct swiotlb_context *ctx,
+                          const struct swiotlb_device *dev,
+                          struct scatterlist *sgl, int nents, int direction);
+static void swiotlb_unmap_sg(struct swiotlb_context *ctx,
+                             struct scatterlist *sgl, int nents);
 static int swiotlb_sync_for_cpu(struct swiotlb_context *ctx, void *dev_addr);
 static int swiotlb_sync_for_device(struct swiotlb_context *ctx, void *dev_addr);
-static struct swiotlb_slot *find_slot(struct swiotlb_context *ctx, void *addr);
-static void dump_stats(const struct swiotlb_context *ctx);
+static int swiotlb_sync_single_range_for_cpu(struct swiotlb_context *ctx,
+                                             void *dev_addr, size_t offset,
+                                             size_t len);
+static int swiotlb_sync_single_range_for_device(struct swiotlb_context *ctx,
+                                                void *dev_addr, size_t offset,
+                                                size_t len);
+static struct swiotlb_slot *find_slot(struct swiotlb_pool *pool, void *addr);
+static void swiotlb_read_stats(struct swiotlb_context *ctx,
+                               struct swiotlb_stats *out);
+static void swiotlb_read_usage(struct swiotlb_context *ctx,
+                               struct swiotlb_usage *out);
+static void dump_stats(struct swiotlb_context *ctx);
+static void dump_stats_json(struct swiotlb_context *ctx, FILE *out);
 static void hexdump(const void *data, size_t size);
 
+/* Pick the default number of areas: one per online CPU */
+static unsigned int swiotlb_default_nareas(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return cpus > 0 ? (unsigned int)cpus : 1;
+}
+
+/* Round the area count to a power of two that still fits a full segment */
+static unsigned int swiotlb_adjust_nareas(unsigned int nr_areas,
+                                          unsigned int nr_slots) {
+    unsigned int n = 1;
+
+    while (n < nr_areas && n < MAX_AREAS)
+        n <<= 1;
+    while (n > 1 && nr_slots / n < SWIOTLB_SEGSIZE)
+        n >>= 1;
+
+    return n;
+}
+
+static uint64_t swiotlb_now_ns(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Allocate a pool of size bytes split into nr_areas areas */
+static struct swiotlb_pool *swiotlb_pool_create(size_t size,
+                                                unsigned int nr_areas,
+                                                bool transient) {
+    struct swiotlb_pool *pool;
+    unsigned long *bitmaps;
+    unsigned int i, longs;
+    
+    pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+    
+    /* Align size to page boundary */
+    size = (size + PAGE_SIZE - 1) & PAGE_MASK;
+    
+    /* Allocate bounce buffer memory */
+    pool->vaddr = aligned_alloc(PAGE_SIZE, size);
+    if (!pool->vaddr) {
+        free(pool);
+        return NULL;
+    }
+    
+    pool->size = size;
+    pool->transient = transient;
+    pool->nr_slots = size / SLOT_SIZE;
+    
+    /* Split the slots evenly between the areas */
+    pool->nr_areas = swiotlb_adjust_nareas(nr_areas, pool->nr_slots);
+    pool->area_nslots = pool->nr_slots / pool->nr_areas;
+    pool->nr_slots = pool->area_nslots * pool->nr_areas;
+    
+    /* Allocate slot tracking array */
+    pool->slots = calloc(pool->nr_slots, sizeof(struct swiotlb_slot));
+    pool->areas = calloc(pool->nr_areas, sizeof(struct swiotlb_area));
+    longs = BITS_TO_LONGS(pool->area_nslots);
+    bitmaps = calloc((size_t)longs * pool->nr_areas, sizeof(unsigned long));
+    if (!pool->slots || !pool->areas || !bitmaps) {
+        free(bitmaps);
+        free(pool->areas);
+        free(pool->slots);
+        free(pool->vaddr);
+        free(pool);
+        return NULL;
+    }
+    
+    for (i = 0; i < pool->nr_areas; i++) {
+        pthread_mutex_init(&pool->areas[i].lock, NULL);
+        pool->areas[i].bitmap = bitmaps + (size_t)i * longs;
+    }
+    
+    pool->created_ns = pool->last_used_ns = swiotlb_now_ns();
+    for (i = 0; i < pool->nr_areas; i++)
+        pool->areas[i].last_update_ns = pool->created_ns;
+    return pool;
+}
+
+static void swiotlb_pool_destroy(struct swiotlb_pool *pool) {
+    unsigned int i;
+    
+    for (i = 0; i < pool->nr_areas; i++)
+        pthread_mutex_destroy(&pool->areas[i].lock);
+    
+    /* All area bitmaps share the allocation hung off the first area */
+    free(pool->areas[0].bitmap);
+    free(pool->areas);
+    free(pool->slots);
+    free(pool->vaddr);
+    free(pool);
+}
+
+/* Count used slots in one pool */
+static unsigned int swiotlb_pool_used(const struct swiotlb_pool *pool) {
+    unsigned int i, used = 0;
+    
+    for (i = 0; i < pool->nr_areas; i++)
+        used += __atomic_load_n(&pool->areas[i].used, __ATOMIC_RELAXED);
+    
+    return used;
+}
+
+/* Insert a pool keeping pools[] sorted, called with pools_lock held for write */
+static bool swiotlb_insert_pool(struct swiotlb_context *ctx,
+                                struct swiotlb_pool *pool) {
+    unsigned int i = ctx->nr_pools;
+    
+    if (ctx->nr_pools == ctx->pools_cap) {
+        unsigned int cap = ctx->pools_cap ? ctx->pools_cap * 2 : 8;
+        struct swiotlb_pool **pools;
+        
+        pools = realloc(ctx->pools, cap * sizeof(*pools));
+        if (!pools)
+            return false;
+        ctx->pools = pools;
+        ctx->pools_cap = cap;
+    }
+    
+    while (i > 0 && (char *)ctx->pools[i - 1]->vaddr > (char *)pool->vaddr) {
+        ctx->pools[i] = ctx->pools[i - 1];
+        i--;
+    }
+    ctx->pools[i] = pool;
+    __atomic_store_n(&ctx->nr_pools, ctx->nr_pools + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* Remove a pool from pools[], called with pools_lock held for write */
+static void swiotlb_remove_pool(struct swiotlb_context *ctx,
+                                struct swiotlb_pool *pool) {
+    unsigned int i;
+    
+    for (i = 0; i < ctx->nr_pools && ctx->pools[i] != pool; i++)
+        ;
+    for (; i + 1 < ctx->nr_pools; i++)
+        ctx->pools[i] = ctx->pools[i + 1];
+    __atomic_store_n(&ctx->nr_pools, ctx->nr_pools - 1, __ATOMIC_RELEASE);
+}
+
+/* Binary search for the pool containing addr, called with pools_lock held */
+static struct swiotlb_pool *swiotlb_find_pool(struct swiotlb_context *ctx,
+                                              const void *addr) {
+    const char *p = addr;
+    unsigned int lo = 0, hi = ctx->nr_pools;
+    struct swiotlb_pool *pool;
+    
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+        
+        if ((char *)ctx->pools[mid]->vaddr <= p)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (!lo)
+        return NULL;
+    
+    pool = ctx->pools[lo - 1];
+    if (p >= (char *)pool->vaddr + (size_t)pool->nr_slots * SLOT_SIZE)
+        return NULL;
+    
+    return pool;
+}
+
+/* Check whether a pool owns a device address */
+static bool is_swiotlb_buffer(const struct swiotlb_pool *pool,
+                              const void *addr) {
+    const char *p = addr, *start = pool->vaddr;
+    
+    return p >= start && p < start + (size_t)pool->nr_slots * SLOT_SIZE;
+}
+
+/*
+ * Look up the pool that owns a device address. Extra pools are returned
+ * with pools_lock held for read, which keeps them from being reclaimed
+ * until swiotlb_put_pool(). NULL means the address is a direct mapping.
+ */
+static struct swiotlb_pool *swiotlb_get_pool(struct swiotlb_context *ctx,
+                                             const void *addr) {
+    struct swiotlb_pool *pool;
+    
+    if (is_swiotlb_buffer(ctx->default_pool, addr))
+        return ctx->default_pool;
+    
+    if (__atomic_load_n(&ctx->nr_pools, __ATOMIC_ACQUIRE) == 1)
+        return NULL;
+    
+    pthread_rwlock_rdlock(&ctx->pools_lock);
+    pool = swiotlb_find_pool(ctx, addr);
+    if (!pool)
+        pthread_rwlock_unlock(&ctx->pools_lock);
+    
+    return pool;
+}
+
+static void swiotlb_put_pool(struct swiotlb_context *ctx,
+                             struct swiotlb_pool *pool) {
+    if (pool != ctx->default_pool)
+        pthread_rwlock_unlock(&ctx->pools_lock);
+}
+
 /* Initialize SWIOTLB */
 static struct swiotlb_context *swiotlb_init(size_t size) {
+    return swiotlb_init_areas(size, 0);
+}
+
+/* Initialize SWIOTLB with nr_areas areas, 0 selects one per online CPU */
+static struct swiotlb_context *swiotlb_init_areas(size_t size,
+                                                  unsigned int nr_areas) {
     struct swiotlb_context *ctx;
     
     ctx = calloc(1, sizeof(*ctx));
     if (!ctx)
         return NULL;
     
-    /* Align size to page boundary */
-    size = (size + PAGE_SIZE - 1) & PAGE_MASK;
+    if (!nr_areas)
+        nr_areas = swiotlb_default_nareas();
     
-    /* Allocate bounce buffer pool */
-    ctx->pool = aligned_alloc(PAGE_SIZE, size);
-    if (!ctx->pool) {
+    ctx->default_pool = swiotlb_pool_create(size, nr_areas, false);
+    if (!ctx->default_pool) {
         free(ctx);
         return NULL;
     }
     
-    /* Allocate slot tracking array */
-    ctx->slots = calloc(MAX_SLOTS, sizeof(struct swiotlb_slot));
-    if (!ctx->slots) {
-        free(ctx->pool);
+    pthread_rwlock_init(&ctx->pools_lock, NULL);
+    if (!swiotlb_insert_pool(ctx, ctx->default_pool)) {
+        pthread_rwlock_destroy(&ctx->pools_lock);
+        swiotlb_pool_destroy(ctx->default_pool);
         free(ctx);
         return NULL;
     }
-    
-    ctx->pool_size = size;
-    ctx->nr_slots = size / SLOT_SIZE;
-    ctx->used_slots = 0;
+    ctx->max_pools = SWIOTLB_MAX_POOLS;
+    ctx->reclaim_grace_ns = SWIOTLB_RECLAIM_NS;
+    ctx->last_reclaim_ns = swiotlb_now_ns();
+    ctx->flags = SWIOTLB_DYNAMIC;
     ctx->initialized = true;
     
-    printf("SWIOTLB initialized with %zu bytes (%u slots)\n",
-           size, ctx->nr_slots);
+    printf("SWIOTLB initialized with %zu bytes (%u slots, %u areas)\n",
+           ctx->default_pool->size, ctx->default_pool->nr_slots,
+           ctx->default_pool->nr_areas);
     
     return ctx;
 }
 
 /* Clean up SWIOTLB */
 static void swiotlb_cleanup(struct swiotlb_context *ctx) {
+    unsigned int i, used;
+    
     if (!ctx)
         return;
     
-    if (ctx->used_slots > 0)
-        printf("Warning: %u slots still in use during cleanup\n",
-               ctx->used_slots);
+    used = swiotlb_used_slots(ctx);
+    if (used > 0)
+        printf("Warning: %u slots still in use during cleanup\n", used);
     
-    free(ctx->pool);
-    free(ctx->slots);
+    for (i = 0; i < ctx->nr_pools; i++)
+        swiotlb_pool_destroy(ctx->pools[i]);
+    
+    pthread_rwlock_destroy(&ctx->pools_lock);
+    free(ctx->pools);
     free(ctx);
 }
 
+/* Count used slots across all pools */
+static unsigned int swiotlb_used_slots(struct swiotlb_context *ctx) {
+    unsigned int i, used = 0;
+    
+    pthread_rwlock_rdlock(&ctx->pools_lock);
+    for (i = 0; i < ctx->nr_pools; i++)
+        used += swiotlb_pool_used(ctx->pools[i]);
+    pthread_rwlock_unlock(&ctx->pools_lock);
+    
+    return used;
+}
+
+/* Number of pools, including the default and any transient pools */
+static unsigned int swiotlb_nr_pools(struct swiotlb_context *ctx) {
+    return __atomic_load_n(&ctx->nr_pools, __ATOMIC_ACQUIRE);
+}
+
+static inline bool slot_test_bit(const unsigned long *map, unsigned int nr) {
+    return map[nr / BITS_PER_LONG] & (1UL << (nr % BITS_PER_LONG));
+}
+
+static inline void slot_set_bits(unsigned long *map, unsigned int start,
+                                 unsigned int nr) {
+    for (unsigned int i = start; i < start + nr; i++)
+        map[i / BITS_PER_LONG] |= 1UL << (i % BITS_PER_LONG);
+}
+
+static inline void slot_clear_bits(unsigned long *map, unsigned int start,
+                                   unsigned int nr) {
+    for (unsigned int i = start; i < start + nr; i++)
+        map[i / BITS_PER_LONG] &= ~(1UL << (i % BITS_PER_LONG));
+}
+
+/*
+ * Find nslots free slots in [start, end) of an area bitmap. The run must
+ * begin on a multiple of stride, counted from the pool start (base is the
+ * global index of the first slot in the area).
+ */
+static int slot_find_run(const unsigned long *map, unsigned int base,
+                         unsigned int start, unsigned int end,
+                         unsigned int nslots, unsigned int stride) {
+    unsigned int i, j;
+    
+    i = ALIGN(base + start, stride) - base;
+    while (i + nslots <= end) {
+        for (j = i; j < i + nslots; j++) {
+            if (slot_test_bit(map, j))
+                break;
+        }
+        if (j == i + nslots)
+            return i;
+        i = ALIGN(base + j + 1, stride) - base;
+    }
+    
+    return -1;
+}
+
+/* Area of the calling CPU, used as the first place to allocate from */
+static unsigned int swiotlb_area_hint(const struct swiotlb_pool *pool) {
+    static __thread int thread_area = -1;
+    static unsigned int next_area;
+    int cpu = sched_getcpu();
+    
+    if (cpu >= 0)
+        return (unsigned int)cpu & (pool->nr_areas - 1);
+    
+    /* No CPU number available, spread threads round-robin instead */
+    if (thread_area < 0)
+        thread_area = __atomic_fetch_add(&next_area, 1, __ATOMIC_RELAXED);
+    return (unsigned int)thread_area & (pool->nr_areas - 1);
+}
+
+/*
+ * Fold the time since the last change into the area's occupancy integral.
+ * Callers sample now before taking the area lock, so it may trail the
+ * last update made by another thread; the clock then just stays put.
+ */
+static void swiotlb_area_account(struct swiotlb_area *area, uint64_t now) {
+    if (now <= area->last_update_ns)
+        return;
+    area->used_slot_ns += (uint64_t)area->used * (now - area->last_update_ns);
+    area->last_update_ns = now;
+}
+
+/* Track the slots in use across all pools and their high watermark */
+static void swiotlb_account_used(struct swiotlb_context *ctx, int nslots) {
+    unsigned int used, peak;
+    
+    used = __atomic_add_fetch(&ctx->used_slots, nslots, __ATOMIC_RELAXED);
+    peak = __atomic_load_n(&ctx->used_hiwater, __ATOMIC_RELAXED);
+    while (used > peak &&
+           !__atomic_compare_exchange_n(&ctx->used_hiwater, &peak, used, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * Allocate nslots contiguous slots from one area with its lock held,
+ * returns the slot index within the pool.
+ */
+static int __swiotlb_area_alloc(struct swiotlb_pool *pool,
+                                unsigned int area_index, unsigned int nslots,
+                                unsigned int stride, uint64_t now) {
+    struct swiotlb_area *area = &pool->areas[area_index];
+    unsigned int base = area_index * pool->area_nslots;
+    unsigned int end = pool->area_nslots;
+    int index;
+    
+    if (area->used + nslots > end)
+        return -1;
+    
+    /* Search from the hint to the end, then wrap around */
+    index = slot_find_run(area->bitmap, base, area->index, end, nslots,
+                          stride);
+    if (index < 0 && area->index > 0) {
+        unsigned int wrap_end = area->index + nslots - 1;
+        
+        index = slot_find_run(area->bitmap, base, 0,
+                              wrap_end < end ? wrap_end : end, nslots,
+                              stride);
+    }
+    if (index < 0)
+        return -1;
+    
+    swiotlb_area_account(area, now);
+    slot_set_bits(area->bitmap, index, nslots);
+    __atomic_store_n(&area->used, area->used + nslots, __ATOMIC_RELAXED);
+    area->index = (index + nslots) % end;
+    return index + base;
+}
+
+/* Release slots with the area lock held */
+static void __swiotlb_area_free(struct swiotlb_pool *pool, unsigned int index,
+                                unsigned int nslots, uint64_t now) {
+    struct swiotlb_area *area = &pool->areas[index / pool->area_nslots];
+    
+    swiotlb_area_account(area, now);
+    slot_clear_bits(area->bitmap, index % pool->area_nslots, nslots);
+    __atomic_store_n(&area->used, area->used - nslots, __ATOMIC_RELAXED);
+}
+
+/* Whether an area went from below to at or above the growth threshold */
+static bool swiotlb_crossed(const struct swiotlb_pool *pool,
+                            unsigned int before, unsigned int after) {
+    unsigned int threshold = pool->area_nslots * SWIOTLB_GROW_PCT / 100;
+    
+    return before < threshold && after >= threshold;
+}
+
+/*
+ * Allocate nslots contiguous slots from one area, returns the slot index
+ * within the pool. *crossed is set when this allocation pushed the area
+ * past the growth threshold.
+ */
+static int swiotlb_area_find_slots(struct swiotlb_pool *pool,
+                                   unsigned int area_index,
+                                   unsigned int nslots, unsigned int stride,
+                                   bool *crossed) {
+    struct swiotlb_area *area = &pool->areas[area_index];
+    uint64_t now = swiotlb_now_ns();
+    unsigned int before;
+    int index;
+    
+    pthread_mutex_lock(&area->lock);
+    before = area->used;
+    index = __swiotlb_area_alloc(pool, area_index, nslots, stride, now);
+    if (index >= 0)
+        *crossed = swiotlb_crossed(pool, before, area->used);
+    pthread_mutex_unlock(&area->lock);
+    
+    return index;
+}
+
+/*
+ * Allocate n runs of nslots[i] slots from a single area under one lock
+ * acquisition. Either every run is allocated or none is.
+ */
+static bool swiotlb_area_find_slots_batch(struct swiotlb_pool *pool,
+                                          unsigned int area_index,
+                                          const unsigned int *nslots,
+                                          unsigned int n, unsigned int stride,
+                                          int *index, bool *crossed) {
+    struct swiotlb_area *area = &pool->areas[area_index];
+    uint64_t now = swiotlb_now_ns();
+    unsigned int i, before;
+    
+    pthread_mutex_lock(&area->lock);
+    before = area->used;
+    for (i = 0; i < n; i++) {
+        index[i] = __swiotlb_area_alloc(pool, area_index, nslots[i], stride,
+                                        now);
+        if (index[i] < 0)
+            break;
+    }
+    if (i < n) {
+        while (i--)
+            __swiotlb_area_free(pool, index[i], nslots[i], now);
+    } else {
+        *crossed = swiotlb_crossed(pool, before, area->used);
+    }
+    pthread_mutex_unlock(&area->lock);
+    
+    return i == n;
+}
+
+/* Allocate from the local area of a pool first, then steal from the others */
+static int swiotlb_pool_find_slots(struct swiotlb_pool *pool,
+                                   unsigned int nslots, unsigned int stride,
+                                   bool *crossed) {
+    unsigned int i, start = swiotlb_area_hint(pool);
+    int index = -1;
+    
+    for (i = 0; i < pool->nr_areas && index < 0; i++)
+        index = swiotlb_area_find_slots(pool,
+                                        (start + i) & (pool->nr_areas - 1),
+                                        nslots, stride, crossed);
+    
+    return index;
+}
+
+/* Batch version of swiotlb_pool_find_slots(), all runs share one area */
+static bool swiotlb_pool_find_slots_batch(struct swiotlb_pool *pool,
+                                          const unsigned int *nslots,
+                                          unsigned int n, unsigned int stride,
+                                          int *index, bool *crossed) {
+    unsigned int i, start = swiotlb_area_hint(pool);
+    
+    for (i = 0; i < pool->nr_areas; i++) {
+        if (swiotlb_area_find_slots_batch(pool,
+                                          (start + i) & (pool->nr_areas - 1),
+                                          nslots, n, stride, index, crossed))
+            return true;
+    }
+    
+    return false;
+}
+
+/* Return nslots slots starting at index to their area */
+static void swiotlb_release_slots(struct swiotlb_pool *pool,
+                                  unsigned int index, unsigned int nslots) {
+    struct swiotlb_area *area = &pool->areas[index / pool->area_nslots];
+    uint64_t now = swiotlb_now_ns();
+    
+    pthread_mutex_lock(&area->lock);
+    __swiotlb_area_free(pool, index, nslots, now);
+    pthread_mutex_unlock(&area->lock);
+}
+
+/*
+ * Add another pool of the default size once overall utilization of the
+ * non-transient pools reaches SWIOTLB_GROW_PCT. Only one thread grows at
+ * a time; the others keep allocating from what is already there.
+ */
+static void swiotlb_maybe_grow(struct swiotlb_context *ctx) {
+    struct swiotlb_pool *pool;
+    unsigned long used = 0, total = 0;
+    unsigned int i, nr_pools = 0;
+    
+    if (!(ctx->flags & SWIOTLB_DYNAMIC))
+        return;
+    if (__atomic_exchange_n(&ctx->growing, 1, __ATOMIC_ACQUIRE))
+        return;
+    
+    pthread_rwlock_rdlock(&ctx->pools_lock);
+    for (i = 0; i < ctx->nr_pools; i++) {
+        if (ctx->pools[i]->transient)
+            continue;
+        used += swiotlb_pool_used(ctx->pools[i]);
+        total += ctx->pools[i]->nr_slots;
+        nr_pools++;
+    }
+    pthread_rwlock_unlock(&ctx->pools_lock);
+    
+    /* Transient pools do not count towards max_pools */
+    if (used * 100 < total * SWIOTLB_GROW_PCT || nr_pools >= ctx->max_pools)
+        goto out;
+    
+    pool = swiotlb_pool_create(ctx->default_pool->size,
+                               ctx->default_pool->nr_areas, false);
+    if (!pool)
+        goto out;
+    
+    pthread_rwlock_wrlock(&ctx->pools_lock);
+    if (swiotlb_insert_pool(ctx, pool))
+        pool = NULL;
+    pthread_rwlock_unlock(&ctx->pools_lock);
+    
+    if (pool)
+        swiotlb_pool_destroy(pool);
+    else
+        swiotlb_stat_inc(ctx, pools_grown);
+out:
+    __atomic_store_n(&ctx->growing, 0, __ATOMIC_RELEASE);
+}
+
+/* Create a pool holding exactly one mapping of nslots slots */
+static struct swiotlb_pool *swiotlb_alloc_transient(struct swiotlb_context *ctx,
+                                                    unsigned int nslots) {
+    struct swiotlb_pool *pool;
+    
+    if (!(ctx->flags & SWIOTLB_DYNAMIC))
+        return NULL;
+    
+    pool = swiotlb_pool_create((size_t)nslots * SLOT_SIZE, 1, true);
+    if (!pool)
+        return NULL;
+    
+    /* Nobody else can see the pool until it is inserted */
+    slot_set_bits(pool->areas[0].bitmap, 0, nslots);
+    pool->areas[0].used = nslots;
+    
+    pthread_rwlock_wrlock(&ctx->pools_lock);
+    if (!swiotlb_insert_pool(ctx, pool)) {
+        pthread_rwlock_unlock(&ctx->pools_lock);
+        swiotlb_pool_destroy(pool);
+        return NULL;
+    }
+    pthread_rwlock_unlock(&ctx->pools_lock);
+    
+    swiotlb_stat_inc(ctx, transient_pools);
+    return pool;
+}
+
+/*
+ * Free grown pools that have had no mappings for the grace period.
+ * Returns the number of pools released.
+ */
+static unsigned int swiotlb_reclaim_pools(struct swiotlb_context *ctx) {
+    unsigned int i, kept = 0, nr_reclaimed;
+    uint64_t now;
+    
+    pthread_rwlock_wrlock(&ctx->pools_lock);
+    /*
+     * Sample the clock only once no mapping can touch an extra pool, so
+     * last_used_ns is never ahead of now.
+     */
+    now = swiotlb_now_ns();
+    for (i = 0; i < ctx->nr_pools; i++) {
+        struct swiotlb_pool *pool = ctx->pools[i];
+        
+        if (pool == ctx->default_pool || pool->transient ||
+            swiotlb_pool_used(pool) ||
+            now - pool->last_used_ns < ctx->reclaim_grace_ns) {
+            ctx->pools[kept++] = pool;
+            continue;
+        }
+        swiotlb_pool_destroy(pool);
+        swiotlb_stat_inc(ctx, pools_reclaimed);
+    }
+    nr_reclaimed = ctx->nr_pools - kept;
+    __atomic_store_n(&ctx->nr_pools, kept, __ATOMIC_RELEASE);
+    __atomic_store_n(&ctx->last_reclaim_ns, now, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&ctx->pools_lock);
+    
+    return nr_reclaimed;
+}
+
+/* Run reclaim at most once per grace period from the unmap path */
+static void swiotlb_maybe_reclaim(struct swiotlb_context *ctx) {
+    uint64_t last = __atomic_load_n(&ctx->last_reclaim_ns, __ATOMIC_RELAXED);
+    uint64_t now;
+    
+    if (swiotlb_nr_pools(ctx) == 1)
+        return;
+    
+    now = swiotlb_now_ns();
+    if (now - last < ctx->reclaim_grace_ns)
+        return;
+    
+    /* Whoever moves the timestamp forward does the work */
+    if (__atomic_compare_exchange_n(&ctx->last_reclaim_ns, &last, now, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        swiotlb_reclaim_pools(ctx);
+}
+
+/* Check whether the device can access a buffer without bouncing */
+static bool swiotlb_dma_capable(const struct swiotlb_context *ctx,
+                                const struct swiotlb_device *dev,
+                                const void *addr, size_t size) {
+    uintptr_t start = (uintptr_t)addr;
+    
+    if ((ctx->flags | dev->flags) & SWIOTLB_FORCE)
+        return false;
+    
+    if (start + size - 1 < start || start + size - 1 > dev->dma_mask)
+        return false;
+    
+    if (dev->min_align && (start & (dev->min_align - 1)))
+        return false;
+    
+    /* Cache maintenance must not touch memory outside the buffer */
+    if (!(dev->flags & SWIOTLB_COHERENT) &&
+        ((start | size) & (CACHE_LINE_SIZE - 1)))
+        return false;
+    
+    return true;
+}
+
+/* Count a bounced mapping of nslots slots in the size histogram */
+static void swiotlb_record_alloc(struct swiotlb_context *ctx,
+                                 unsigned int nslots) {
+    unsigned int bucket = 0;
+    
+    while (bucket < SWIOTLB_HIST_BUCKETS - 1 && (1U << bucket) < nslots)
+        bucket++;
+    swiotlb_stat_inc(ctx, alloc_hist[bucket]);
+}
+
+/* Point a slot at the bounce memory for a new mapping */
+static void swiotlb_init_slot(struct swiotlb_pool *pool, unsigned int index,
+                              void *addr, size_t size, int direction) {
+    struct swiotlb_slot *slot = &pool->slots[index];
+    
+    slot->orig_addr = addr;
+    slot->buffer = (char *)pool->vaddr + ((size_t)index * SLOT_SIZE);
+    slot->size = size;
+    slot->nslots = DIV_ROUND_UP(size, SLOT_SIZE);
+    slot->direction = direction;
+    slot->used = true;
+}
+
 /* Map address for DMA */
-static void *swiotlb_map(struct swiotlb_context *ctx, void *addr,
-                        size_t size, int direction) {
-    unsigned int i;
-    struct swiotlb_slot *slot = NULL;
+static void *swiotlb_map(struct swiotlb_context *ctx,
+                         const struct swiotlb_device *dev, void *addr,
+                         size_t size, int direction) {
+    unsigned int i, nslots, stride = 1;
+    struct swiotlb_pool *pool = NULL;
+    struct swiotlb_slot *slot;
+    bool crossed = false;
+    int index;
     
-    if (!ctx || !ctx->initialized)
+    if (!ctx || !ctx->initialized || !dev)
         return NULL;
     
-    if (size > SLOT_SIZE)
+    nslots = DIV_ROUND_UP(size, SLOT_SIZE);
+    if (!nslots)
         return NULL;
     
-    /* Find free slot */
-    for (i = 0; i < ctx->nr_slots; i++) {
-        if (!ctx->slots[i].used) {
-            slot = &ctx->slots[i];
-            break;
+    /* Buffers the device can reach are handed out as is */
+    if (swiotlb_dma_capable(ctx, dev, addr, size)) {
+        swiotlb_stat_inc(ctx, direct_maps);
+        swiotlb_stat_inc(ctx, maps);
+        return addr;
+    }
+    
+    /* Only a bounced mapping is limited to one segment of slots */
+    if (nslots > SWIOTLB_SEGSIZE)
+        return NULL;
+    
+    if (dev->min_align > SLOT_SIZE)
+        stride = dev->min_align / SLOT_SIZE;
+    
+    /* The default pool first, then any grown pools */
+    index = swiotlb_pool_find_slots(ctx->default_pool, nslots, stride,
+                                    &crossed);
+    if (index >= 0) {
+        pool = ctx->default_pool;
+    } else if (swiotlb_nr_pools(ctx) > 1) {
+        pthread_rwlock_rdlock(&ctx->pools_lock);
+        for (i = 0; i < ctx->nr_pools && index < 0; i++) {
+            pool = ctx->pools[i];
+            if (pool == ctx->default_pool || pool->transient)
+                continue;
+            index = swiotlb_pool_find_slots(pool, nslots, stride, &crossed);
+            if (index >= 0)
+                __atomic_store_n(&pool->last_used_ns, swiotlb_now_ns(),
+                                 __ATOMIC_RELAXED);
         }
+        pthread_rwlock_unlock(&ctx->pools_lock);
     }
     
+    if (crossed)
+        swiotlb_maybe_grow(ctx);
+    
+    /* Everything is full: fall back to a pool for just this mapping */
+    if (index < 0) {
+        pool = swiotlb_alloc_transient(ctx, nslots);
+        if (!pool) {
+            swiotlb_stat_inc(ctx, errors);
+            return NULL;
+        }
+        index = 0;
+        swiotlb_maybe_grow(ctx);
+    }
+    
+    /* Initialize slot */
+    swiotlb_init_slot(pool, index, addr, size, direction);
+    slot = &pool->slots[index];
+    swiotlb_record_alloc(ctx, nslots);
+    swiotlb_account_used(ctx, nslots);
+    
+    /* Copy data to bounce buffer if needed */
+    if (direction != DMA_TO_DEVICE) {
+        memcpy(slot->buffer, addr, size);
+        swiotlb_stat_inc(ctx, bounces);
+    }
+    
+    swiotlb_stat_inc(ctx, maps);
+    
+    return slot->buffer;
+}
+
+/* Unmap DMA address */
+static int swiotlb_unmap(struct swiotlb_context *ctx, void *dev_addr) {
+    struct swiotlb_pool *pool;
+    struct swiotlb_slot *slot;
+    
+    if (!ctx || !ctx->initialized)
+        return SWIOTLB_EINVAL;
+    
+    /* Direct mappings have nothing to copy back or release */
+    pool = swiotlb_get_pool(ctx, dev_addr);
+    if (!pool) {
+        swiotlb_stat_inc(ctx, unmaps);
+        return SWIOTLB_OK;
+    }
+    
+    slot = find_slot(pool, dev_addr);
     if (!slot) {
-        ctx->stats.errors++;
-        return NULL;
+        swiotlb_put_pool(ctx, pool);
+        return SWIOTLB_EINVAL;
+    }
+    
+    /* Copy data back if needed */
+    if (slot->direction != DMA_TO_DEVICE) {
+        memcpy(slot->orig_addr, slot->buffer, slot->size);
+        swiotlb_stat_inc(ctx, bounces);
+    }
+    
+    /* Free slot, it may be reused as soon as the area lock is dropped */
+    slot->used = false;
+    swiotlb_account_used(ctx, -(int)slot->nslots);
+    swiotlb_release_slots(pool, slot - pool->slots, slot->nslots);
+    if (pool != ctx->default_pool)
+        __atomic_store_n(&pool->last_used_ns, swiotlb_now_ns(),
+                         __ATOMIC_RELAXED);
+    swiotlb_put_pool(ctx, pool);
+    swiotlb_stat_inc(ctx, unmaps);
+    
+    /* Transient pools go away with their only mapping */
+    if (pool->transient) {
+        pthread_rwlock_wrlock(&ctx->pools_lock);
+        swiotlb_remove_pool(ctx, pool);
+        pthread_rwlock_unlock(&ctx->pools_lock);
+        swiotlb_pool_destroy(pool);
+    } else {
+        swiotlb_maybe_reclaim(ctx);
+    }
+    
+    return SWIOTLB_OK;
+}
+
+/*
+ * Map a scatter-gather list. Entries that are adjacent in memory are
+ * merged into one DMA segment of up to SWIOTLB_SEGSIZE slots, and the
+ * slots for every bounced segment are taken from a single area under one
+ * lock acquisition. The segments are written to the dma_address and
+ * dma_length fields of the first entries of the list; the remaining
+ * entries get a dma_length of 0. Returns the number of DMA segments, or
+ * 0 if the list could not be mapped.
+ */
+static int swiotlb_map_sg(struct swiotlb_context *ctx,
+                          const struct swiotlb_device *dev,
+                          struct scatterlist *sgl, int nents, int direction) {
+    void *seg_addr[SWIOTLB_MAX_SG];
+    size_t seg_len[SWIOTLB_MAX_SG];
+    bool seg_direct[SWIOTLB_MAX_SG];
+    unsigned int nslots[SWIOTLB_MAX_SG];
+    int index[SWIOTLB_MAX_SG];
+    unsigned int i, n = 0, nr_bounce = 0, nr_direct, stride = 1;
+    unsigned int bounce_slots = 0;
+    struct swiotlb_pool *pool;
+    bool crossed = false;
+    int k;
+    
+    if (!ctx || !ctx->initialized || !dev || nents <= 0 ||
+        nents > SWIOTLB_MAX_SG)
+        return 0;
+    pool = ctx->default_pool;
+    
+    /* Merge entries that continue where the previous one ended */
+    for (k = 0; k < nents; k++) {
+        if (!sgl[k].length)
+            return 0;
+        if (n && (char *)seg_addr[n - 1] + seg_len[n - 1] ==
+                 (char *)sgl[k].addr &&
+            seg_len[n - 1] + sgl[k].length <= SWIOTLB_SEGSIZE * SLOT_SIZE) {
+            seg_len[n - 1] += sgl[k].length;
+            continue;
+        }
+        seg_addr[n] = sgl[k].addr;
+        seg_len[n++] = sgl[k].length;
+    }
+    
+    for (i = 0; i < n; i++) {
+        seg_direct[i] = swiotlb_dma_capable(ctx, dev, seg_addr[i], seg_len[i]);
+        if (seg_direct[i])
+            continue;
+        /* A bounced segment must fit in SWIOTLB_SEGSIZE slots */
+        if (seg_len[i] > SWIOTLB_SEGSIZE * SLOT_SIZE)
+            return 0;
+        nslots[nr_bounce++] = DIV_ROUND_UP(seg_len[i], SLOT_SIZE);
+    }
+    nr_direct = n - nr_bounce;
+    
+    if (dev->min_align > SLOT_SIZE)
+        stride = dev->min_align / SLOT_SIZE;
+    
+    /* Fall back to one mapping per segment if no area fits the whole list */
+    if (nr_bounce && !swiotlb_pool_find_slots_batch(pool, nslots, nr_bounce,
+                                                    stride, index, &crossed)) {
+        for (i = 0; i < n; i++) {
+            sgl[i].dma_address = swiotlb_map(ctx, dev, seg_addr[i],
+                                             seg_len[i], direction);
+            if (!sgl[i].dma_address) {
+                while (i--)
+                    swiotlb_unmap(ctx, sgl[i].dma_address);
+                return 0;
+            }
+            sgl[i].dma_length = seg_len[i];
+        }
+        goto out;
+    }
+    
+    if (crossed)
+        swiotlb_maybe_grow(ctx);
+    
+    for (i = 0; i < nr_bounce; i++)
+        bounce_slots += nslots[i];
+    swiotlb_account_used(ctx, bounce_slots);
+    
+    for (i = 0, k = 0; i < n; i++) {
+        sgl[i].dma_length = seg_len[i];
+        if (seg_direct[i]) {
+            sgl[i].dma_address = seg_addr[i];
+            continue;
+        }
+        
+        swiotlb_init_slot(pool, index[k], seg_addr[i], seg_len[i], direction);
+        swiotlb_record_alloc(ctx, nslots[k]);
+        sgl[i].dma_address = pool->slots[index[k++]].buffer;
+        if (direction != DMA_TO_DEVICE)
+            memcpy(sgl[i].dma_address, seg_addr[i], seg_len[i]);
+    }
+    
+    if (direction != DMA_TO_DEVICE)
+        swiotlb_stat_add(ctx, bounces, nr_bounce);
+    swiotlb_stat_add(ctx, direct_maps, nr_direct);
+    swiotlb_stat_add(ctx, maps, n);
+out:
+    for (k = n; k < nents; k++) {
+        sgl[k].dma_address = NULL;
+        sgl[k].dma_length = 0;
     }
     
-    /* Initialize slot */
-    slot->orig_addr = addr;
-    slot->buffer = ctx->pool + (i * SLOT_SIZE);
-    slot->size = size;
-    slot->direction = direction;
-    slot->used = true;
+    return n;
+}
+
+/*
+ * Unmap a list mapped by swiotlb_map_sg(). Segments bounced through the
+ * default pool are released under one lock acquisition per area; those
+ * that live elsewhere go through swiotlb_unmap(), which may take
+ * pools_lock for write and so must not be called with an area locked.
+ */
+static void swiotlb_unmap_sg(struct swiotlb_context *ctx,
+                             struct scatterlist *sgl, int nents) {
+    struct swiotlb_pool *pool = ctx->default_pool;
+    struct swiotlb_area *locked = NULL;
+    unsigned int nr_bounce = 0, nr_unmapped = 0, nr_slots = 0;
+    uint64_t now = swiotlb_now_ns();
+    int k;
     
-    /* Copy data to bounce buffer if needed */
-    if (direction != DMA_TO_DEVICE) {
-        memcpy(slot->buffer, addr, size);
-        ctx->stats.bounces++;
+    for (k = 0; k < nents && sgl[k].dma_length; k++) {
+        struct swiotlb_slot *slot;
+        struct swiotlb_area *area;
+        unsigned int index;
+        
+        if (!is_swiotlb_buffer(pool, sgl[k].dma_address)) {
+            /* swiotlb_read_usage() takes area locks under pools_lock */
+            if (locked) {
+                pthread_mutex_unlock(&locked->lock);
+                locked = NULL;
+            }
+            swiotlb_unmap(ctx, sgl[k].dma_address);
+            continue;
+        }
+        
+        slot = find_slot(pool, sgl[k].dma_address);
+        if (!slot)
+            continue;
+        
+        if (slot->direction != DMA_TO_DEVICE) {
+            memcpy(slot->orig_addr, slot->buffer, slot->size);
+            nr_bounce++;
+        }
+        slot->used = false;
+        
+        /* Keep the area locked across consecutive segments */
+        index = slot - pool->slots;
+        area = &pool->areas[index / pool->area_nslots];
+        if (area != locked) {
+            if (locked)
+                pthread_mutex_unlock(&locked->lock);
+            pthread_mutex_lock(&area->lock);
+            locked = area;
+        }
+        __swiotlb_area_free(pool, index, slot->nslots, now);
+        nr_slots += slot->nslots;
+        nr_unmapped++;
     }
+    if (locked)
+        pthread_mutex_unlock(&locked->lock);
     
-    ctx->used_slots++;
-    ctx->stats.maps++;
-    
-    return slot->buffer;
+    swiotlb_account_used(ctx, -(int)nr_slots);
+    swiotlb_stat_add(ctx, bounces, nr_bounce);
+    swiotlb_stat_add(ctx, unmaps, nr_unmapped);
 }
 
-/* Unmap DMA address */
-static int swiotlb_unmap(struct swiotlb_context *ctx, void *dev_addr) {
+/*
+ * Bounce [offset, offset + len) of a mapping towards the CPU or the
+ * device. whole selects the full mapped size regardless of offset/len.
+ */
+static int swiotlb_bounce_range(struct swiotlb_context *ctx, void *dev_addr,
+                                size_t offset, size_t len, bool whole,
+                                bool for_cpu) {
+    struct swiotlb_pool *pool;
     struct swiotlb_slot *slot;
     
     if (!ctx || !ctx->initialized)
         return SWIOTLB_EINVAL;
     
-    slot = find_slot(ctx, dev_addr);
-    if (!slot)
-        return SWIOTLB_EINVAL;
+    /* Direct mappings need no copy */
+    pool = swiotlb_get_pool(ctx, dev_addr);
+    if (!pool)
+        goto out;
     
-    /* Copy data back if needed */
-    if (slot->direction != DMA_TO_DEVICE) {
-        memcpy(slot->orig_addr, slot->buffer, slot->size);
-        ctx->stats.bounces++;
+    slot = find_slot(pool, dev_addr);
+    if (slot && whole) {
+        offset = 0;
+        len = slot->size;
+    }
+    if (!slot || offset > slot->size || len > slot->size - offset) {
+        swiotlb_put_pool(ctx, pool);
+        return SWIOTLB_EINVAL;
     }
     
-    /* Free slot */
-    slot->used = false;
-    ctx->used_slots--;
-    ctx->stats.unmaps++;
+    if (for_cpu && slot->direction == DMA_FROM_DEVICE && len) {
+        memcpy((char *)slot->orig_addr + offset,
+               (char *)slot->buffer + offset, len);
+        swiotlb_stat_inc(ctx, bounces);
+    } else if (!for_cpu && slot->direction == DMA_TO_DEVICE && len) {
+        memcpy((char *)slot->buffer + offset,
+               (char *)slot->orig_addr + offset, len);
+        swiotlb_stat_inc(ctx, bounces);
+    }
+    swiotlb_put_pool(ctx, pool);
     
+out:
+    if (for_cpu)
+        swiotlb_stat_inc(ctx, sync_for_cpu);
+    else
+        swiotlb_stat_inc(ctx, sync_for_device);
     return SWIOTLB_OK;
 }
 
 /* Sync buffer for CPU access */
 static int swiotlb_sync_for_cpu(struct swiotlb_context *ctx, void *dev_addr) {
+    return swiotlb_bounce_range(ctx, dev_addr, 0, 0, true, true);
+}
+
+/* Sync buffer for device access */
+static int swiotlb_sync_for_device(struct swiotlb_context *ctx, void *dev_addr) {
+    return swiotlb_bounce_range(ctx, dev_addr, 0, 0, true, false);
+}
+
+/* Sync [offset, offset + len) of a mapping for CPU access */
+static int swiotlb_sync_single_range_for_cpu(struct swiotlb_context *ctx,
+                                             void *dev_addr, size_t offset,
+                                             size_t len) {
+    return swiotlb_bounce_range(ctx, dev_addr, offset, len, false, true);
+}
+
+/* Sync [offset, offset + len) of a mapping for device access */
+static int swiotlb_sync_single_range_for_device(struct swiotlb_context *ctx,
+                                                void *dev_addr, size_t offset,
+                                                size_t len) {
+    return swiotlb_bounce_range(ctx, dev_addr, offset, len, false, false);
+}
+
+/* Find slot by device address */
+static struct swiotlb_slot *find_slot(struct swiotlb_pool *pool, void *addr) {
+    size_t offset;
     struct swiotlb_slot *slot;
     
-    if (!ctx || !ctx->initialized)
-        return SWIOTLB_EINVAL;
+    if (!is_swiotlb_buffer(pool, addr))
+        return NULL;
     
-    slot = find_slot(ctx, dev_addr);
-    if (!slot)
-        return SWIOTLB_EINVAL;
+    offset = (char *)addr - (char *)pool->vaddr;
+    if (offset % SLOT_SIZE)
+        return NULL;
     
-    if (slot->direction == DMA_FROM_DEVICE) {
-        memcpy(slot->orig_addr, slot->buffer, slot->size);
-        ctx->stats.bounces++;
-    }
+    slot = &pool->slots[offset / SLOT_SIZE];
+    if (!slot->used || slot->buffer != addr)
+        return NULL;
     
-    ctx->stats.sync_for_cpu++;
-    return SWIOTLB_OK;
+    return slot;
 }
 
-/* Sync buffer for device access */
-static int swiotlb_sync_for_device(struct swiotlb_context *ctx, void *dev_addr) {
-    struct swiotlb_slot *slot;
-    
-    if (!ctx || !ctx->initialized)
-        return SWIOTLB_EINVAL;
+/* Sum the per-thread counter slots */
+static void swiotlb_read_stats(struct swiotlb_context *ctx,
+                               struct swiotlb_stats *out) {
+    const uint64_t *src;
+    uint64_t *dst = (uint64_t *)out;
+    size_t i, n = sizeof(*out) / sizeof(uint64_t);
     
-    slot = find_slot(ctx, dev_addr);
-    if (!slot)
-        return SWIOTLB_EINVAL;
+    memset(out, 0, sizeof(*out));
+    for (unsigned int slot = 0; slot < SWIOTLB_STAT_SLOTS; slot++) {
+        src = (const uint64_t *)&ctx->stats[slot].stats;
+        for (i = 0; i < n; i++)
+            dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+/* Longest run of clear bits in the first nbits of a bitmap */
+static unsigned int slot_largest_free_run(const unsigned long *map,
+                                          unsigned int nbits) {
+    unsigned int i = 0, run = 0, best = 0;
     
-    if (slot->direction == DMA_TO_DEVICE) {
-        memcpy(slot->buffer, slot->orig_addr, slot->size);
-        ctx->stats.bounces++;
+    while (i < nbits) {
+        /* Whole free words are counted without looking at each bit */
+        if (!(i % BITS_PER_LONG) && i + BITS_PER_LONG <= nbits &&
+            !map[i / BITS_PER_LONG]) {
+            run += BITS_PER_LONG;
+            i += BITS_PER_LONG;
+        } else if (slot_test_bit(map, i++)) {
+            run = 0;
+        } else {
+            run++;
+        }
+        if (run > best)
+            best = run;
     }
     
-    ctx->stats.sync_for_device++;
-    return SWIOTLB_OK;
+    return best;
 }
 
-/* Find slot by device address */
-static struct swiotlb_slot *find_slot(struct swiotlb_context *ctx, void *addr) {
-    unsigned int i;
+/*
+ * Compute occupancy over all pools. The time-weighted utilization is the
+ * average fraction of slots in use since each pool was created.
+ */
+static void swiotlb_read_usage(struct swiotlb_context *ctx,
+                               struct swiotlb_usage *out) {
+    uint64_t now = swiotlb_now_ns();
+    double used_ns = 0, total_ns = 0;
+    unsigned int i, a;
     
-    for (i = 0; i < ctx->nr_slots; i++) {
-        if (ctx->slots[i].used && ctx->slots[i].buffer == addr)
-            return &ctx->slots[i];
+    memset(out, 0, sizeof(*out));
+    pthread_rwlock_rdlock(&ctx->pools_lock);
+    for (i = 0; i < ctx->nr_pools; i++) {
+        struct swiotlb_pool *pool = ctx->pools[i];
+        
+        for (a = 0; a < pool->nr_areas; a++) {
+            struct swiotlb_area *area = &pool->areas[a];
+            unsigned int run;
+            
+            pthread_mutex_lock(&area->lock);
+            swiotlb_area_account(area, now);
+            out->used_slots += area->used;
+            used_ns += area->used_slot_ns;
+            run = slot_largest_free_run(area->bitmap, pool->area_nslots);
+            pthread_mutex_unlock(&area->lock);
+            
+            if (run > out->largest_free_run)
+                out->largest_free_run = run;
+        }
+        out->total_slots += pool->nr_slots;
+        total_ns += (double)pool->nr_slots * (now - pool->created_ns);
     }
+    pthread_rwlock_unlock(&ctx->pools_lock);
     
-    return NULL;
+    out->used_hiwater = __atomic_load_n(&ctx->used_hiwater, __ATOMIC_RELAXED);
+    out->utilization = total_ns > 0 ? used_ns / total_ns : 0.0;
 }
 
 /* Dump statistics */
-static void dump_stats(const struct swiotlb_context *ctx) {
+static void dump_stats(struct swiotlb_context *ctx) {
+    struct swiotlb_stats stats;
+    struct swiotlb_usage usage;
+    
+    swiotlb_read_stats(ctx, &stats);
+    swiotlb_read_usage(ctx, &usage);
+    
     printf("\nSWIOTLB Statistics:\n");
     printf("==================\n");
-    printf("Total slots: %u\n", ctx->nr_slots);
-    printf("Used slots: %u\n", ctx->used_slots);
-    printf("Maps: %lu\n", ctx->stats.maps);
-    printf("Unmaps: %lu\n", ctx->stats.unmaps);
-    printf("Bounces: %lu\n", ctx->stats.bounces);
-    printf("Sync for CPU: %lu\n", ctx->stats.sync_for_cpu);
-    printf("Sync for device: %lu\n", ctx->stats.sync_for_device);
-    printf("Errors: %lu\n", ctx->stats.errors);
+    printf("Total slots: %u\n", usage.total_slots);
+    printf("Areas: %u (%u slots each)\n", ctx->default_pool->nr_areas,
+           ctx->default_pool->area_nslots);
+    printf("Pools: %u\n", swiotlb_nr_pools(ctx));
+    printf("Used slots: %u\n", usage.used_slots);
+    printf("Used slots high watermark: %u\n", usage.used_hiwater);
+    printf("Largest free run: %u slots\n", usage.largest_free_run);
+    printf("Average utilization: %.2f%%\n", usage.utilization * 100);
+    printf("Maps: %lu\n", stats.maps);
+    printf("Unmaps: %lu\n", stats.unmaps);
+    printf("Bounces: %lu\n", stats.bounces);
+    printf("Sync for CPU: %lu\n", stats.sync_for_cpu);
+    printf("Sync for device: %lu\n", stats.sync_for_device);
+    printf("Direct maps: %lu\n", stats.direct_maps);
+    printf("Pools grown: %lu\n", stats.pools_grown);
+    printf("Transient pools: %lu\n", stats.transient_pools);
+    printf("Pools reclaimed: %lu\n", stats.pools_reclaimed);
+    printf("Errors: %lu\n", stats.errors);
+    printf("Mapping sizes (slots):");
+    for (int i = 0; i < SWIOTLB_HIST_BUCKETS; i++)
+        printf(" <=%u:%lu", 1U << i, stats.alloc_hist[i]);
+    printf("\n");
+}
+
+/* Dump statistics as a single JSON object */
+static void dump_stats_json(struct swiotlb_context *ctx, FILE *out) {
+    struct swiotlb_stats stats;
+    struct swiotlb_usage usage;
+    
+    swiotlb_read_stats(ctx, &stats);
+    swiotlb_read_usage(ctx, &usage);
+    
+    fprintf(out, "{\"total_slots\": %u, \"used_slots\": %u, "
+            "\"used_hiwater\": %u, \"largest_free_run\": %u, "
+            "\"utilization\": %.4f, \"pools\": %u, ",
+            usage.total_slots, usage.used_slots, usage.used_hiwater,
+            usage.largest_free_run, usage.utilization, swiotlb_nr_pools(ctx));
+    fprintf(out, "\"maps\": %lu, \"unmaps\": %lu, \"bounces\": %lu, "
+            "\"sync_for_cpu\": %lu, \"sync_for_device\": %lu, "
+            "\"direct_maps\": %lu, \"pools_grown\": %lu, "
+            "\"transient_pools\": %lu, \"pools_reclaimed\": %lu, "
+            "\"errors\": %lu, \"alloc_hist\": {",
+            stats.maps, stats.unmaps, stats.bounces, stats.sync_for_cpu,
+            stats.sync_for_device, stats.direct_maps, stats.pools_grown,
+            stats.transient_pools, stats.pools_reclaimed, stats.errors);
+    for (int i = 0; i < SWIOTLB_HIST_BUCKETS; i++)
+        fprintf(out, "%s\"%u\": %lu", i ? ", " : "", 1U << i,
+                stats.alloc_hist[i]);
+    fprintf(out, "}}\n");
 }
 
 /* Hex dump utility */
@@ -299,6 +1465,11 @@ static void hexdump(const void *data, size_t size) {
 }
 
 /* Test functions */
+static const struct swiotlb_device bounce_dev = {
+    .dma_mask  = DMA_BIT_MASK(64),
+    .flags     = SWIOTLB_FORCE,
+};
+
 static void test_basic_mapping(struct swiotlb_context *ctx) {
     printf("\nTesting basic mapping...\n");
     
@@ -311,7 +1482,7 @@ static void test_basic_mapping(struct swiotlb_context *ctx) {
     
     /* Map for device access */
     printf("Mapping buffer for device access...\n");
-    void *dev_addr = swiotlb_map(ctx, src_buf, sizeof(src_buf), DMA_TO_DEVICE);
+    void *dev_addr = swiotlb_map(ctx, &bounce_dev, src_buf, sizeof(src_buf), DMA_TO_DEVICE);
     if (!dev_addr) {
         printf("Mapping failed\n");
         return;
@@ -347,7 +1518,7 @@ static void test_bidirectional(struct swiotlb_context *ctx) {
     
     /* Map for bidirectional access */
     printf("Mapping buffer for bidirectional access...\n");
-    void *dev_addr = swiotlb_map(ctx, src_buf, sizeof(src_buf),
+    void *dev_addr = swiotlb_map(ctx, &bounce_dev, src_buf, sizeof(src_buf),
                                 DMA_BIDIRECTIONAL);
     if (!dev_addr) {
         printf("Mapping failed\n");
@@ -371,7 +1542,7 @@ static void test_bidirectional(struct swiotlb_context *ctx) {
     /* Verify data */
     bool match = true;
     for (int i = 0; i < sizeof(src_buf); i++) {
-        if (dst_buf[i] != (i & 0xFF)) {
+        if (dst_buf[i] != (char)(i & 0xFF)) {
             match = false;
             break;
         }
@@ -383,6 +1554,523 @@ static void test_bidirectional(struct swiotlb_context *ctx) {
     swiotlb_unmap(ctx, dev_addr);
 }
 
+static void test_partial_sync(struct swiotlb_context *ctx) {
+    printf("\nTesting partial range sync...\n");
+    
+    /* Ring buffer with a small header written by the device */
+    char ring[4096];
+    const size_t hdr_off = 512, hdr_len = 100;
+    bool match = true;
+    
+    memset(ring, 0, sizeof(ring));
+    void *dev_addr = swiotlb_map(ctx, &bounce_dev, ring, sizeof(ring), DMA_FROM_DEVICE);
+    if (!dev_addr) {
+        printf("Mapping failed\n");
+        return;
+    }
+    
+    /* Device writes the whole ring, CPU only syncs the header */
+    memset(dev_addr, 0xA5, sizeof(ring));
+    swiotlb_sync_single_range_for_cpu(ctx, dev_addr, hdr_off, hdr_len);
+    
+    for (size_t i = 0; i < sizeof(ring); i++) {
+        bool in_hdr = i >= hdr_off && i < hdr_off + hdr_len;
+        if (ring[i] != (in_hdr ? (char)0xA5 : 0)) {
+            match = false;
+            break;
+        }
+    }
+    printf("Header-only sync: %s\n", match ? "PASS" : "FAIL");
+    
+    /* Ranges past the end of the mapping are rejected */
+    printf("Out-of-range sync rejected: %s\n",
+           swiotlb_sync_single_range_for_cpu(ctx, dev_addr, sizeof(ring) - 8,
+                                             16) == SWIOTLB_EINVAL ?
+           "PASS" : "FAIL");
+    
+    swiotlb_unmap(ctx, dev_addr);
+    
+    /* CPU updates one descriptor and pushes only that range to the device */
+    memset(ring, 0, sizeof(ring));
+    dev_addr = swiotlb_map(ctx, &bounce_dev, ring, sizeof(ring), DMA_TO_DEVICE);
+    if (!dev_addr) {
+        printf("Mapping failed\n");
+        return;
+    }
+    
+    swiotlb_sync_for_device(ctx, dev_addr);
+    memset(ring + hdr_off, 0x3C, hdr_len);
+    swiotlb_sync_single_range_for_device(ctx, dev_addr, hdr_off, hdr_len);
+    
+    match = true;
+    for (size_t i = 0; i < sizeof(ring); i++) {
+        bool in_hdr = i >= hdr_off && i < hdr_off + hdr_len;
+        if (((char *)dev_addr)[i] != (in_hdr ? (char)0x3C : 0)) {
+            match = false;
+            break;
+        }
+    }
+    printf("Descriptor-only sync for device: %s\n", match ? "PASS" : "FAIL");
+    
+    swiotlb_unmap(ctx, dev_addr);
+}
+    
+#define BIG_BUF_SIZE      (1024 * 1024)
+
+static void test_direct_mapping(struct swiotlb_context *ctx) {
+    printf("\nTesting direct mapping bypass...\n");
+    
+    struct swiotlb_device coherent_dev = {
+        .dma_mask  = DMA_BIT_MASK(64),
+        .flags     = SWIOTLB_COHERENT,
+    };
+    struct swiotlb_device noncoherent_dev = {
+        .dma_mask  = DMA_BIT_MASK(64),
+    };
+    struct swiotlb_device aligned_dev = {
+        .dma_mask  = DMA_BIT_MASK(64),
+        .min_align = 1024,
+        .flags     = SWIOTLB_COHERENT,
+    };
+    char *buf = aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+    char *big;
+    void *dev_addr;
+    
+    if (!buf) {
+        printf("Buffer allocation failed\n");
+        return;
+    }
+    
+    /* Reachable, coherent: no bounce */
+    dev_addr = swiotlb_map(ctx, &coherent_dev, buf, 200, DMA_BIDIRECTIONAL);
+    printf("Coherent device maps directly: %s\n",
+           dev_addr == buf ? "PASS" : "FAIL");
+    swiotlb_unmap(ctx, dev_addr);
+    
+    /* Partial cache lines on a non-coherent device must bounce */
+    dev_addr = swiotlb_map(ctx, &noncoherent_dev, buf, 200, DMA_TO_DEVICE);
+    printf("Non-coherent unaligned size bounces: %s\n",
+           dev_addr && dev_addr != buf ? "PASS" : "FAIL");
+    swiotlb_unmap(ctx, dev_addr);
+    
+    dev_addr = swiotlb_map(ctx, &noncoherent_dev, buf, 256, DMA_TO_DEVICE);
+    printf("Non-coherent aligned buffer maps directly: %s\n",
+           dev_addr == buf ? "PASS" : "FAIL");
+    swiotlb_unmap(ctx, dev_addr);
+    
+    /* Misaligned buffer bounces into a slot honouring the alignment */
+    dev_addr = swiotlb_map(ctx, &aligned_dev, buf + 128, 256, DMA_TO_DEVICE);
+    printf("Misaligned buffer bounces aligned: %s\n",
+           dev_addr && dev_addr != buf + 128 &&
+           !((uintptr_t)dev_addr & (aligned_dev.min_align - 1)) ?
+           "PASS" : "FAIL");
+    swiotlb_unmap(ctx, dev_addr);
+    
+    /* Only bounced mappings are limited to one segment of slots */
+    big = aligned_alloc(PAGE_SIZE, BIG_BUF_SIZE);
+    if (big) {
+        struct scatterlist sg = { .addr = big, .length = BIG_BUF_SIZE };
+        
+        dev_addr = swiotlb_map(ctx, &coherent_dev, big, BIG_BUF_SIZE,
+                               DMA_BIDIRECTIONAL);
+        printf("Large reachable buffer maps directly: %s\n",
+               dev_addr == big ? "PASS" : "FAIL");
+        swiotlb_unmap(ctx, dev_addr);
+        
+        printf("Large reachable sg entry maps directly: %s\n",
+               swiotlb_map_sg(ctx, &coherent_dev, &sg, 1, DMA_TO_DEVICE) == 1 &&
+               sg.dma_address == big && sg.dma_length == BIG_BUF_SIZE ?
+               "PASS" : "FAIL");
+        swiotlb_unmap_sg(ctx, &sg, 1);
+        
+        printf("Large buffer that must bounce is rejected: %s\n",
+               !swiotlb_map(ctx, &bounce_dev, big, BIG_BUF_SIZE,
+                            DMA_TO_DEVICE) ? "PASS" : "FAIL");
+        free(big);
+    }
+    
+    /* Buffers beyond the DMA mask bounce */
+    coherent_dev.dma_mask = (uintptr_t)buf - 1;
+    dev_addr = swiotlb_map(ctx, &coherent_dev, buf, 256, DMA_TO_DEVICE);
+    printf("Unreachable buffer bounces: %s\n",
+           dev_addr && dev_addr != buf ? "PASS" : "FAIL");
+    swiotlb_unmap(ctx, dev_addr);
+    
+    free(buf);
+}
+
+#define SG_NENTS          32
+#define SG_ENTRY_SIZE     512
+#define SG_BENCH_ITERS    20000
+
+static void test_map_sg(struct swiotlb_context *ctx) {
+    printf("\nTesting scatter-gather mapping...\n");
+    
+    static char req[SG_NENTS * SG_ENTRY_SIZE];
+    static char split[SG_NENTS][SG_ENTRY_SIZE * 2];
+    struct scatterlist sgl[SG_NENTS];
+    struct timespec t0, t1;
+    void *dev_addrs[SG_NENTS];
+    double t_sg, t_single;
+    bool match = true;
+    int count;
+    
+    /* 32 adjacent 512-byte segments of one request */
+    for (int i = 0; i < SG_NENTS; i++) {
+        sgl[i].addr = req + i * SG_ENTRY_SIZE;
+        sgl[i].length = SG_ENTRY_SIZE;
+        memset(sgl[i].addr, i, SG_ENTRY_SIZE);
+    }
+    count = swiotlb_map_sg(ctx, &bounce_dev, sgl, SG_NENTS, DMA_FROM_DEVICE);
+    printf("Adjacent entries coalesced: %s (%d segments)\n",
+           count == SG_NENTS * SG_ENTRY_SIZE / (SWIOTLB_SEGSIZE * SLOT_SIZE) ?
+           "PASS" : "FAIL", count);
+    
+    /* Device fills the bounce buffers, unmap copies them back */
+    for (int i = 0; i < count; i++)
+        memset(sgl[i].dma_address, 0x5A, sgl[i].dma_length);
+    swiotlb_unmap_sg(ctx, sgl, SG_NENTS);
+    for (size_t i = 0; i < sizeof(req); i++) {
+        if (req[i] != 0x5A) {
+            match = false;
+            break;
+        }
+    }
+    printf("Coalesced data copied back: %s\n", match ? "PASS" : "FAIL");
+    
+    /* Disjoint entries each get their own segment */
+    for (int i = 0; i < SG_NENTS; i++) {
+        sgl[i].addr = split[i];
+        sgl[i].length = SG_ENTRY_SIZE;
+        memset(split[i], i, SG_ENTRY_SIZE);
+    }
+    count = swiotlb_map_sg(ctx, &bounce_dev, sgl, SG_NENTS, DMA_BIDIRECTIONAL);
+    match = count == SG_NENTS;
+    for (int i = 0; match && i < count; i++)
+        match = ((char *)sgl[i].dma_address)[0] == (char)i;
+    printf("Disjoint entries mapped: %s (%d segments)\n",
+           match ? "PASS" : "FAIL", count);
+    swiotlb_unmap_sg(ctx, sgl, SG_NENTS);
+    printf("All slots released: %s\n",
+           swiotlb_used_slots(ctx) == 0 ? "PASS" : "FAIL");
+    
+    /* Batch versus one call per segment */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int iter = 0; iter < SG_BENCH_ITERS; iter++) {
+        swiotlb_map_sg(ctx, &bounce_dev, sgl, SG_NENTS, DMA_TO_DEVICE);
+        swiotlb_unmap_sg(ctx, sgl, SG_NENTS);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    t_sg = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int iter = 0; iter < SG_BENCH_ITERS; iter++) {
+        for (int i = 0; i < SG_NENTS; i++)
+            dev_addrs[i] = swiotlb_map(ctx, &bounce_dev, split[i],
+                                       SG_ENTRY_SIZE, DMA_TO_DEVICE);
+        for (int i = 0; i < SG_NENTS; i++)
+            swiotlb_unmap(ctx, dev_addrs[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    t_single = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    
+    printf("%d-entry lists: map_sg %.0f ns/list, per-entry %.0f ns/list\n",
+           SG_NENTS, t_sg * 1e9 / SG_BENCH_ITERS,
+           t_single * 1e9 / SG_BENCH_ITERS);
+}
+
+#define DYN_POOL_SIZE     (64 * 1024)
+#define DYN_NR_MAPS       1024
+
+static void test_dynamic_pools(void) {
+    struct swiotlb_context *ctx;
+    static char bufs[DYN_NR_MAPS][SLOT_SIZE];
+    void *dev_addrs[DYN_NR_MAPS];
+    unsigned int failures = 0;
+    
+    printf("\nTesting dynamic pool growth...\n");
+    ctx = swiotlb_init_areas(DYN_POOL_SIZE, 1);
+    if (!ctx) {
+        printf("Failed to initialize SWIOTLB\n");
+        return;
+    }
+    
+    /* Twice the default pool capacity, all mappings must succeed */
+    for (int i = 0; i < DYN_NR_MAPS; i++) {
+        memset(bufs[i], i, SLOT_SIZE);
+        dev_addrs[i] = swiotlb_map(ctx, &bounce_dev, bufs[i], SLOT_SIZE,
+                                   DMA_BIDIRECTIONAL);
+        if (!dev_addrs[i] || ((unsigned char *)dev_addrs[i])[0] != (i & 0xFF))
+            failures++;
+    }
+    printf("Burst of %d mappings over %u pools: %s\n", DYN_NR_MAPS,
+           swiotlb_nr_pools(ctx), !failures && swiotlb_nr_pools(ctx) > 1 ?
+           "PASS" : "FAIL");
+    
+    for (int i = 0; i < DYN_NR_MAPS; i++)
+        swiotlb_unmap(ctx, dev_addrs[i]);
+    
+    /* Nothing is reclaimed inside the grace period */
+    printf("Idle pools kept during grace period: %s\n",
+           swiotlb_reclaim_pools(ctx) == 0 ? "PASS" : "FAIL");
+    ctx->reclaim_grace_ns = 0;
+    swiotlb_reclaim_pools(ctx);
+    printf("Idle pools reclaimed after grace period: %s\n",
+           swiotlb_nr_pools(ctx) == 1 ? "PASS" : "FAIL");
+    
+    /* With growth capped, exhaustion falls back to transient pools */
+    ctx->max_pools = 1;
+    failures = 0;
+    for (int i = 0; i < DYN_NR_MAPS; i++) {
+        dev_addrs[i] = swiotlb_map(ctx, &bounce_dev, bufs[i], SLOT_SIZE,
+                                   DMA_TO_DEVICE);
+        if (!dev_addrs[i])
+            failures++;
+    }
+    struct swiotlb_stats stats;
+    uint64_t grown;
+    void *extra;
+    
+    swiotlb_read_stats(ctx, &stats);
+    printf("Transient pools on exhaustion: %s (%lu created)\n",
+           !failures && stats.transient_pools ? "PASS" : "FAIL",
+           stats.transient_pools);
+    
+    /* Raising the cap lets the pool grow again despite the transient pools */
+    ctx->max_pools = 2;
+    grown = stats.pools_grown;
+    extra = swiotlb_map(ctx, &bounce_dev, bufs[0], SLOT_SIZE, DMA_TO_DEVICE);
+    swiotlb_read_stats(ctx, &stats);
+    printf("Transient pools not counted against the cap: %s\n",
+           extra && stats.pools_grown == grown + 1 ? "PASS" : "FAIL");
+    swiotlb_unmap(ctx, extra);
+    for (int i = 0; i < DYN_NR_MAPS; i++)
+        swiotlb_unmap(ctx, dev_addrs[i]);
+    /* The pool grown above is idle and past the (zero) grace period */
+    swiotlb_reclaim_pools(ctx);
+    printf("Transient pools freed on unmap: %s\n",
+           swiotlb_nr_pools(ctx) == 1 ? "PASS" : "FAIL");
+    
+    swiotlb_cleanup(ctx);
+}
+
+#define MIXED_SG_NENTS    8
+#define MIXED_SG_ITERS    2000
+
+struct usage_reader_arg {
+    struct swiotlb_context *ctx;
+    int stop;
+};
+
+static void *usage_reader(void *data) {
+    struct usage_reader_arg *arg = data;
+    struct swiotlb_usage usage;
+    
+    while (!__atomic_load_n(&arg->stop, __ATOMIC_ACQUIRE))
+        swiotlb_read_usage(arg->ctx, &usage);
+    return NULL;
+}
+
+static void test_mixed_sg(void) {
+    struct swiotlb_context *ctx;
+    static char fill[PAGE_SIZE];
+    static char bufs[MIXED_SG_NENTS][2 * SLOT_SIZE];
+    struct scatterlist sgl[MIXED_SG_NENTS];
+    void *dev_addrs[PAGE_SIZE / SLOT_SIZE];
+    struct usage_reader_arg reader;
+    unsigned int nr_fill = PAGE_SIZE / SLOT_SIZE - MIXED_SG_NENTS / 2;
+    unsigned int failures = 0;
+    pthread_t thread;
+    
+    printf("\nTesting scatter-gather over several pools...\n");
+    ctx = swiotlb_init_areas(PAGE_SIZE, 1);
+    if (!ctx) {
+        printf("Failed to initialize SWIOTLB\n");
+        return;
+    }
+    
+    /* Leave room for half the list, the rest goes to transient pools */
+    ctx->max_pools = 1;
+    for (unsigned int i = 0; i < nr_fill; i++)
+        dev_addrs[i] = swiotlb_map(ctx, &bounce_dev, fill + i * SLOT_SIZE,
+                                   SLOT_SIZE, DMA_TO_DEVICE);
+    
+    reader.ctx = ctx;
+    reader.stop = 0;
+    pthread_create(&thread, NULL, usage_reader, &reader);
+    for (int iter = 0; iter < MIXED_SG_ITERS; iter++) {
+        struct swiotlb_stats stats;
+        
+        for (int i = 0; i < MIXED_SG_NENTS; i++) {
+            sgl[i].addr = bufs[i];
+            sgl[i].length = SLOT_SIZE;
+        }
+        if (swiotlb_map_sg(ctx, &bounce_dev, sgl, MIXED_SG_NENTS,
+                           DMA_FROM_DEVICE) != MIXED_SG_NENTS) {
+            failures++;
+            continue;
+        }
+        for (int i = 0; i < MIXED_SG_NENTS; i++)
+            memset(sgl[i].dma_address, iter + i, SLOT_SIZE);
+        swiotlb_read_stats(ctx, &stats);
+        if (!iter && !stats.transient_pools)
+            failures++;
+        swiotlb_unmap_sg(ctx, sgl, MIXED_SG_NENTS);
+        for (int i = 0; i < MIXED_SG_NENTS; i++)
+            failures += bufs[i][SLOT_SIZE - 1] != (char)(iter + i);
+    }
+    __atomic_store_n(&reader.stop, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    
+    for (unsigned int i = 0; i < nr_fill; i++)
+        swiotlb_unmap(ctx, dev_addrs[i]);
+    printf("Default and transient segments unmapped: %s\n",
+           !failures && swiotlb_nr_pools(ctx) == 1 &&
+           !swiotlb_used_slots(ctx) ? "PASS" : "FAIL");
+    
+    swiotlb_cleanup(ctx);
+}
+
+static void test_telemetry(void) {
+    struct swiotlb_context *ctx;
+    struct swiotlb_usage usage;
+    struct swiotlb_stats stats;
+    static char buf[4 * SLOT_SIZE];
+    static char big[SWIOTLB_SEGSIZE * SLOT_SIZE];
+    void *a, *b, *c;
+    
+    printf("\nTesting utilization telemetry...\n");
+    ctx = swiotlb_init_areas(PAGE_SIZE * 4, 1);
+    if (!ctx) {
+        printf("Failed to initialize SWIOTLB\n");
+        return;
+    }
+    
+    /* Three back-to-back mappings, then free the middle one */
+    a = swiotlb_map(ctx, &bounce_dev, buf, SLOT_SIZE, DMA_TO_DEVICE);
+    b = swiotlb_map(ctx, &bounce_dev, buf, 4 * SLOT_SIZE, DMA_TO_DEVICE);
+    c = swiotlb_map(ctx, &bounce_dev, buf, 2 * SLOT_SIZE, DMA_TO_DEVICE);
+    swiotlb_unmap(ctx, b);
+    
+    swiotlb_read_usage(ctx, &usage);
+    swiotlb_read_stats(ctx, &stats);
+    printf("High watermark: %s (%u)\n",
+           usage.used_hiwater == 7 && usage.used_slots == 3 ? "PASS" : "FAIL",
+           usage.used_hiwater);
+    printf("Largest free run: %s (%u)\n",
+           usage.largest_free_run == usage.total_slots - 7 ? "PASS" : "FAIL",
+           usage.largest_free_run);
+    printf("Size histogram: %s\n",
+           stats.alloc_hist[0] == 1 && stats.alloc_hist[1] == 1 &&
+           stats.alloc_hist[2] == 1 ? "PASS" : "FAIL");
+    printf("Utilization gauge in range: %s\n",
+           usage.utilization > 0 && usage.utilization <= 1 ? "PASS" : "FAIL");
+    
+    swiotlb_unmap(ctx, a);
+    swiotlb_unmap(ctx, c);
+    swiotlb_cleanup(ctx);
+    
+    /* Two areas that peak at different times: 100 + 120 slots, then 128 */
+    ctx = swiotlb_init_areas(2 * SWIOTLB_SEGSIZE * SLOT_SIZE, 2);
+    if (!ctx) {
+        printf("Failed to initialize SWIOTLB\n");
+        return;
+    }
+    
+    a = swiotlb_map(ctx, &bounce_dev, big, 100 * SLOT_SIZE, DMA_TO_DEVICE);
+    b = swiotlb_map(ctx, &bounce_dev, big, 120 * SLOT_SIZE, DMA_TO_DEVICE);
+    swiotlb_unmap(ctx, a);
+    swiotlb_unmap(ctx, b);
+    c = swiotlb_map(ctx, &bounce_dev, big, 128 * SLOT_SIZE, DMA_TO_DEVICE);
+    swiotlb_unmap(ctx, c);
+    
+    swiotlb_read_usage(ctx, &usage);
+    printf("High watermark across areas: %s (%u)\n",
+           a && b && c && usage.used_hiwater == 220 ? "PASS" : "FAIL",
+           usage.used_hiwater);
+    swiotlb_cleanup(ctx);
+}
+
+#define NR_TEST_THREADS   8
+#define NR_TEST_ITERS     20000
+
+struct concurrent_arg {
+    struct swiotlb_context *ctx;
+    unsigned int seed;
+    unsigned long failures;
+};
+
+static void *concurrent_worker(void *data) {
+    struct concurrent_arg *arg = data;
+    char buf[1024];
+    
+    for (int iter = 0; iter < NR_TEST_ITERS; iter++) {
+        size_t size = rand_r(&arg->seed) % sizeof(buf) + 1;
+        char pattern = (char)rand_r(&arg->seed);
+        void *dev_addr;
+        
+        memset(buf, pattern, size);
+        dev_addr = swiotlb_map(arg->ctx, &bounce_dev, buf, size, DMA_BIDIRECTIONAL);
+        if (!dev_addr) {
+            arg->failures++;
+            continue;
+        }
+        
+        /* Device inverts the buffer, CPU must see it after unmap */
+        for (size_t i = 0; i < size; i++)
+            ((char *)dev_addr)[i] = ~((char *)dev_addr)[i];
+        swiotlb_unmap(arg->ctx, dev_addr);
+        
+        for (size_t i = 0; i < size; i++) {
+            if (buf[i] != (char)~pattern) {
+                arg->failures++;
+                break;
+            }
+        }
+    }
+    
+    return NULL;
+}
+
+static void test_concurrent_mapping(void) {
+    struct swiotlb_context *ctx;
+    pthread_t threads[NR_TEST_THREADS];
+    struct concurrent_arg args[NR_TEST_THREADS];
+    unsigned long failures = 0;
+    struct timespec t0, t1;
+    double elapsed;
+    
+    printf("\nTesting concurrent mapping...\n");
+    ctx = swiotlb_init_areas(SWIOTLB_SIZE, NR_TEST_THREADS);
+    if (!ctx) {
+        printf("Failed to initialize SWIOTLB\n");
+        return;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < NR_TEST_THREADS; i++) {
+        args[i].ctx = ctx;
+        args[i].seed = i + 1;
+        args[i].failures = 0;
+        pthread_create(&threads[i], NULL, concurrent_worker, &args[i]);
+    }
+    for (int i = 0; i < NR_TEST_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        failures += args[i].failures;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    
+    elapsed = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("%d map/unmap pairs in %.3f s (%.0f ops/s)\n",
+           NR_TEST_THREADS * NR_TEST_ITERS, elapsed,
+           NR_TEST_THREADS * NR_TEST_ITERS / elapsed);
+    printf("Concurrent mapping: %s (failures: %lu, slots in use: %u)\n",
+           !failures && !swiotlb_used_slots(ctx) ? "PASS" : "FAIL",
+           failures, swiotlb_used_slots(ctx));
+    
+    swiotlb_cleanup(ctx);
+}
+
 int main(void) {
     printf("Software I/O TLB Test Program\n");
     printf("============================\n\n");
@@ -397,13 +2085,22 @@ int main(void) {
     /* Run tests */
     test_basic_mapping(ctx);
     test_bidirectional(ctx);
+    test_partial_sync(ctx);
+    test_direct_mapping(ctx);
+    test_map_sg(ctx);
     
     /* Display statistics */
     dump_stats(ctx);
+    dump_stats_json(ctx, stdout);
     
     /* Cleanup */
     swiotlb_cleanup(ctx);
     
+    test_dynamic_pools();
+    test_mixed_sg();
+    test_telemetry();
+    test_concurrent_mapping();
+    
     printf("\nTest completed successfully!\n");
     return 0;
 }
@@ -4,6 +4,10 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <stddef.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
 
 #define BITS_PER_LONG (sizeof(long) * 8)
 #define BITS_PER_XA_VALUE (BITS_PER_LONG - 1)
@@ -11,12 +15,202 @@
 #define XA_CHUNK_SIZE (1UL << XA_CHUNK_SHIFT)
 #define XA_CHUNK_MASK (XA_CHUNK_SIZE - 1)
 #define XA_MAX_MARKS 3
+#define XA_MARK_LONGS ((XA_CHUNK_SIZE + BITS_PER_LONG - 1) / BITS_PER_LONG)
 #define GFP_KERNEL 0
+#define GFP_NOWAIT 1
+
+#define XA_NODE_SLAB_BYTES (64 * 1024)  // slab size, and its alignment
+#define XA_NODE_CACHE_SIZE 32           // free nodes a thread keeps for itself
+#define XA_NODE_CACHE_BATCH 16          // nodes moved per trip to the slabs
 
 typedef unsigned int gfp_t;
 typedef unsigned char u8;
 typedef unsigned int u32;
 
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define rcu_dereference(p) __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() do {} while (0)
+#endif
+
+// Test-and-test-and-set spinlock; only writers take xa_lock
+typedef int spinlock_t;
+#define spin_lock_init(lock) __atomic_store_n((lock), 0, __ATOMIC_RELAXED)
+
+static inline void spin_lock(spinlock_t *lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+        while (__atomic_load_n(lock, __ATOMIC_RELAXED))
+            cpu_relax();
+    }
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Epoch-based reclamation standing in for RCU. Readers publish the global
+ * epoch they started in; an object retired in epoch e is unreachable for
+ * readers that start later, so it is freed once the global epoch reaches
+ * e + 2, which needs every reader active at the time to have moved on.
+ * Retired objects wait on one of three limbo lists, indexed by epoch.
+ */
+struct rcu_reader {
+    struct rcu_reader *next;
+    unsigned long epoch;
+    int active;
+    int in_use;
+};
+
+struct rcu_head {
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+static struct rcu_reader *rcu_readers;
+static unsigned long rcu_epoch;
+static spinlock_t rcu_limbo_lock;
+static struct rcu_head *rcu_limbo[3];
+static pthread_key_t rcu_reader_key;
+static pthread_once_t rcu_reader_once = PTHREAD_ONCE_INIT;
+static __thread struct rcu_reader *this_reader;
+static __thread int rcu_nesting;
+
+static void rcu_reader_exit(void *data)
+{
+    struct rcu_reader *r = data;
+
+    __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void rcu_reader_key_init(void)
+{
+    pthread_key_create(&rcu_reader_key, rcu_reader_exit);
+}
+
+// Claim a record left by an exited thread, or add a new one
+static struct rcu_reader *rcu_reader_register(void)
+{
+    struct rcu_reader *r;
+    int unused = 0;
+
+    pthread_once(&rcu_reader_once, rcu_reader_key_init);
+    for (r = rcu_dereference(rcu_readers); r; r = r->next) {
+        if (__atomic_compare_exchange_n(&r->in_use, &unused, 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        unused = 0;
+    }
+    if (!r) {
+        r = calloc(1, sizeof(*r));
+        if (!r)
+            abort();
+        r->in_use = 1;
+        r->next = READ_ONCE(rcu_readers);
+        while (!__atomic_compare_exchange_n(&rcu_readers, &r->next, r, false,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific(rcu_reader_key, r);
+    return r;
+}
+
+static inline void rcu_read_lock(void)
+{
+    struct rcu_reader *r = this_reader;
+
+    if (rcu_nesting++)
+        return;
+    if (!r)
+        r = this_reader = rcu_reader_register();
+    __atomic_store_n(&r->epoch, __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST),
+                     __ATOMIC_SEQ_CST);
+    __atomic_store_n(&r->active, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void rcu_read_unlock(void)
+{
+    if (--rcu_nesting)
+        return;
+    __atomic_store_n(&this_reader->active, 0, __ATOMIC_RELEASE);
+}
+
+static void rcu_free_list(struct rcu_head *head)
+{
+    while (head) {
+        struct rcu_head *next = head->next;
+
+        head->func(head);
+        head = next;
+    }
+}
+
+// Advance the epoch if every active reader is in it; rcu_limbo_lock held
+static struct rcu_head *rcu_try_advance(void)
+{
+    unsigned long epoch = __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST);
+    struct rcu_head *expired;
+    struct rcu_reader *r;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (r = rcu_dereference(rcu_readers); r; r = r->next) {
+        if (__atomic_load_n(&r->active, __ATOMIC_SEQ_CST) &&
+            __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST) != epoch)
+            return NULL;
+    }
+
+    // Objects retired two epochs ago can no longer be reached
+    __atomic_store_n(&rcu_epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    expired = rcu_limbo[(epoch + 1) % 3];
+    rcu_limbo[(epoch + 1) % 3] = NULL;
+    return expired;
+}
+
+// Free head with func once no reader can still see it
+static void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+    struct rcu_head *expired;
+    unsigned long epoch;
+
+    head->func = func;
+    spin_lock(&rcu_limbo_lock);
+    expired = rcu_try_advance();
+    epoch = READ_ONCE(rcu_epoch);
+    head->next = rcu_limbo[epoch % 3];
+    rcu_limbo[epoch % 3] = head;
+    spin_unlock(&rcu_limbo_lock);
+
+    rcu_free_list(expired);
+}
+
+// Wait until everything retired so far has been freed
+static void rcu_barrier(void)
+{
+    for (;;) {
+        struct rcu_head *expired;
+        bool empty;
+
+        spin_lock(&rcu_limbo_lock);
+        expired = rcu_try_advance();
+        empty = !rcu_limbo[0] && !rcu_limbo[1] && !rcu_limbo[2];
+        spin_unlock(&rcu_limbo_lock);
+
+        rcu_free_list(expired);
+        if (empty)
+            return;
+        if (!expired)
+            sched_yield();
+    }
+}
+
 enum xa_lock_type {
     XA_LOCK_IRQ = 1,
     XA_LOCK_BH
@@ -28,6 +222,31 @@ enum xa_mark_type {
     XA_MARK_2,
 };
 typedef enum xa_mark_type xa_mark_t;
+#define XA_MARK_MAX XA_MARK_2
+#define XA_PRESENT ((xa_mark_t)8U)
+
+// A mark is set in xa_flags when any entry in the array carries it
+#define XA_FLAGS_MARK_SHIFT 8
+#define XA_FLAGS_MARK(mark) (1U << (XA_FLAGS_MARK_SHIFT + (unsigned int)(mark)))
+
+/*
+ * An allocating array keeps XA_FREE_MARK on every free slot instead of
+ * on entries, so the propagated bits lead a search to the lowest free
+ * index. The root mark means there is a free slot somewhere in the tree,
+ * or that the head is free.
+ */
+#define XA_FREE_MARK XA_MARK_0
+#define XA_FLAGS_TRACK_FREE (1U << 0)
+#define XA_FLAGS_ALLOC_WRAPPED (1U << 2)
+#define XA_FLAGS_ALLOC (XA_FLAGS_TRACK_FREE | XA_FLAGS_MARK(XA_FREE_MARK))
+
+struct xa_limit {
+    u32 max;
+    u32 min;
+};
+
+#define XA_LIMIT(_min, _max) (struct xa_limit) { .min = _min, .max = _max }
+#define xa_limit_32b XA_LIMIT(0, UINT32_MAX)
 
 struct xa_node {
     unsigned char shift;
@@ -35,8 +254,9 @@ struct xa_node {
     unsigned char count;
     unsigned char nr_values;
     struct xa_node *parent;
+    struct rcu_head rcu;
     void *slots[XA_CHUNK_SIZE];
-    unsigned long *marks[XA_MAX_MARKS];
+    unsigned long marks[XA_MAX_MARKS][XA_MARK_LONGS];
 };
 
 struct xarray {
@@ -57,12 +277,6 @@ struct xa_state {
     void **xa_entry;
 };
 
-// Simplified spinlock implementation for demonstration
-typedef int spinlock_t;
-#define spin_lock(lock) (*(lock) = 1)
-#define spin_unlock(lock) (*(lock) = 0)
-#define spin_lock_init(lock) (*(lock) = 0)
-
 static inline void *xa_mk_value(unsigned long v)
 {
     return (void *)((v << 1) | 1);
@@ -78,65 +292,2784 @@ static inline bool xa_is_value(const void *entry)
     return (unsigned long)entry & 1;
 }
 
-void xa_init(struct xarray *xa)
+/*
+ * Internal entries have the bottom two bits set to 10. They are never
+ * stored by users, so the tree can use them for pointers to nodes and
+ * for errors returned in place of an entry.
+ */
+static inline void *xa_mk_internal(unsigned long v)
 {
-    spin_lock_init(&xa->xa_lock);
-    xa->xa_head = NULL;
-    xa->xa_flags = 0;
+    return (void *)((v << 2) | 2);
 }
 
-void *xa_load(struct xarray *xa, unsigned long index)
+static inline unsigned long xa_to_internal(const void *entry)
 {
-    void *entry;
-    spin_lock(&xa->xa_lock);
-    entry = xa->xa_head;
-    if (xa_is_value(entry))
-        entry = (index == 0) ? entry : NULL;
-    spin_unlock(&xa->xa_lock);
-    return entry;
+    return (unsigned long)entry >> 2;
 }
 
-void xa_store(struct xarray *xa, unsigned long index, void *entry)
+static inline bool xa_is_internal(const void *entry)
 {
-    spin_lock(&xa->xa_lock);
-    if (index == 0)
-        xa->xa_head = entry;
-    spin_unlock(&xa->xa_lock);
+    return ((unsigned long)entry & 3) == 2;
 }
 
-// Simple test program
-int main()
+static inline bool xa_is_node(const void *entry)
 {
-    struct xarray xa;
-    unsigned long test_values[] = {42, 100, 255, 1000};
-    int i;
+    return xa_is_internal(entry) && (unsigned long)entry > 4096;
+}
 
-    // Initialize xarray
-    xa_init(&xa);
-    printf("XArray initialized\n");
+static inline void *xa_mk_node(const struct xa_node *node)
+{
+    return (void *)((unsigned long)node | 2);
+}
 
-    // Store some values
-    for (i = 0; i < sizeof(test_values)/sizeof(test_values[0]); i++) {
-        xa_store(&xa, i, xa_mk_value(test_values[i]));
-        printf("Stored value %lu at index %d\n", test_values[i], i);
+static inline struct xa_node *xa_to_node(const void *entry)
+{
+    return (struct xa_node *)((unsigned long)entry - 2);
+}
+
+/*
+ * A lone entry at index 0 moves from the top node into the head when the
+ * tree shrinks. The old slot is left holding XA_RETRY_ENTRY so that a
+ * reader still inside that node starts its walk again from the head.
+ */
+#define XA_RETRY_ENTRY xa_mk_internal(256)
+
+static inline bool xa_is_retry(const void *entry)
+{
+    return entry == XA_RETRY_ENTRY;
+}
+
+static inline bool xa_is_err(const void *entry)
+{
+    return xa_is_internal(entry) && entry >= xa_mk_internal(-4095);
+}
+
+static inline int xa_err(void *entry)
+{
+    if (xa_is_err(entry))
+        return (long)entry >> 2;
+    return 0;
+}
+
+#define xa_mk_err(err) xa_mk_internal(-(err))
+
+/*
+ * A multi-index entry covers an aligned range of 1 << order indices. It
+ * sits in the slot for its first index in the node whose level is order
+ * rounded down to a multiple of XA_CHUNK_SHIFT, and the rest of the range
+ * in that node holds sibling entries naming the first slot.
+ */
+static inline void *xa_mk_sibling(unsigned int offset)
+{
+    return xa_mk_internal(offset);
+}
+
+static inline unsigned int xa_to_sibling(const void *entry)
+{
+    return xa_to_internal(entry);
+}
+
+static inline bool xa_is_sibling(const void *entry)
+{
+    return xa_is_internal(entry) && entry < xa_mk_sibling(XA_CHUNK_SIZE - 1);
+}
+
+/*
+ * Besides a node, xas->xa_node may be NULL for an entry in the head,
+ * XAS_BOUNDS past the end of the tree, XAS_RESTART to walk again from
+ * the root, or an error from XA_ERROR().
+ */
+#define XAS_BOUNDS ((struct xa_node *)1UL)
+#define XAS_RESTART ((struct xa_node *)3UL)
+#define XA_ERROR(err) ((struct xa_node *)(((unsigned long)(err) << 2) | 2UL))
+
+#define __XA_STATE(array, index, shift, sibs) {   \
+    .xa = array,                                  \
+    .xa_index = index,                            \
+    .xa_shift = shift,                            \
+    .xa_sibs = sibs,                              \
+    .xa_offset = 0,                               \
+    .xa_pad = 0,                                  \
+    .xa_node = XAS_RESTART,                       \
+    .xa_alloc = NULL,                             \
+    .xa_entry = NULL,                             \
+}
+
+#define XA_STATE(name, array, index) \
+    struct xa_state name = __XA_STATE(array, index, 0, 0)
+
+#define XA_STATE_ORDER(name, array, index, order)                 \
+    struct xa_state name = __XA_STATE(array,                      \
+            ((index) >> (order)) << (order),                      \
+            (order) - ((order) % XA_CHUNK_SHIFT),                 \
+            (1U << ((order) % XA_CHUNK_SHIFT)) - 1)
+
+static inline int xas_error(const struct xa_state *xas)
+{
+    return xa_err(xas->xa_node);
+}
+
+static inline void xas_set_err(struct xa_state *xas, long err)
+{
+    xas->xa_node = XA_ERROR(err);
+}
+
+static inline bool xas_invalid(const struct xa_state *xas)
+{
+    return (unsigned long)xas->xa_node & 3;
+}
+
+static inline bool xas_is_node(const struct xa_state *xas)
+{
+    return !xas_invalid(xas) && xas->xa_node;
+}
+
+static inline void xas_reset(struct xa_state *xas)
+{
+    xas->xa_node = XAS_RESTART;
+}
+
+static inline void xas_set(struct xa_state *xas, unsigned long index)
+{
+    xas->xa_index = index;
+    xas->xa_node = XAS_RESTART;
+}
+
+// The entry to hand back from a store: the error, if there was one
+static inline void *xas_result(struct xa_state *xas, void *curr)
+{
+    return xas_error(xas) ? (void *)xas->xa_node : curr;
+}
+
+#define xas_lock(xas) spin_lock(&(xas)->xa->xa_lock)
+#define xas_unlock(xas) spin_unlock(&(xas)->xa->xa_lock)
+
+// Point xas at the aligned range of 1 << order indices holding index
+static inline void xas_set_order(struct xa_state *xas, unsigned long index,
+                                 unsigned int order)
+{
+    xas->xa_index = order < BITS_PER_LONG ? (index >> order) << order : 0;
+    xas->xa_shift = order - (order % XA_CHUNK_SHIFT);
+    xas->xa_sibs = (1U << (order % XA_CHUNK_SHIFT)) - 1;
+    xas->xa_node = XAS_RESTART;
+}
+
+// Highest index the tree below entry can hold
+static inline unsigned long xa_max_index(void *entry)
+{
+    if (!xa_is_node(entry))
+        return 0;
+    return (XA_CHUNK_SIZE << xa_to_node(entry)->shift) - 1;
+}
+
+/*
+ * Nodes come from a dedicated cache rather than straight from malloc.
+ * Slabs of XA_NODE_SLAB_BYTES, aligned to their size so that a node finds
+ * its slab by masking its address, are carved into nodes. Each thread
+ * keeps up to XA_NODE_CACHE_SIZE free nodes of its own and trades them
+ * with the slabs XA_NODE_CACHE_BATCH at a time under the cache lock.
+ * Magazines sit on a list under the cache lock so the shrinker can empty
+ * those of idle threads; each has a lock of its own, taken after the
+ * cache lock, which only the shrinker ever contends. Slabs whose nodes
+ * are all free stay around for reuse until the shrinker hands them back.
+ */
+struct xa_node_slab {
+    struct xa_node_slab *next;
+    struct xa_node_slab **pprev;        // NULL while every node is in use
+    struct xa_node *free;               // linked through node->parent
+    unsigned int inuse;
+    struct xa_node nodes[];
+};
+
+#define XA_NODES_PER_SLAB \
+    ((XA_NODE_SLAB_BYTES - sizeof(struct xa_node_slab)) / sizeof(struct xa_node))
+
+struct xa_node_magazine {
+    spinlock_t lock;
+    unsigned int nr;
+    struct xa_node_magazine *next;      // on xa_node_cache.magazines
+    struct xa_node_magazine **pprev;
+    struct xa_node *nodes[XA_NODE_CACHE_SIZE];
+};
+
+static struct {
+    spinlock_t lock;
+    struct xa_node_slab *partial;       // some nodes free
+    struct xa_node_slab *empty;         // all nodes free
+    struct xa_node_magazine *magazines; // one per thread that has used the cache
+    unsigned long nr_slabs;
+    unsigned long nr_empty;
+    unsigned long nr_free;              // free in slabs, not counting magazines
+} xa_node_cache;
+
+static pthread_key_t xa_node_magazine_key;
+static pthread_once_t xa_node_magazine_once = PTHREAD_ONCE_INIT;
+static __thread struct xa_node_magazine *this_magazine;
+
+static inline struct xa_node_slab *xa_node_slab(struct xa_node *node)
+{
+    return (struct xa_node_slab *)((uintptr_t)node & ~(uintptr_t)(XA_NODE_SLAB_BYTES - 1));
+}
+
+static void slab_list_add(struct xa_node_slab **list, struct xa_node_slab *slab)
+{
+    slab->next = *list;
+    if (*list)
+        (*list)->pprev = &slab->next;
+    slab->pprev = list;
+    *list = slab;
+}
+
+static void slab_list_del(struct xa_node_slab *slab)
+{
+    *slab->pprev = slab->next;
+    if (slab->next)
+        slab->next->pprev = slab->pprev;
+    slab->pprev = NULL;
+}
+
+// Take a free node from a partly used slab, or failing that an empty one
+static struct xa_node *slab_get_node(void)
+{
+    struct xa_node_slab *slab = xa_node_cache.partial;
+    struct xa_node *node;
+
+    if (!slab) {
+        slab = xa_node_cache.empty;
+        if (!slab)
+            return NULL;
+        slab_list_del(slab);
+        slab_list_add(&xa_node_cache.partial, slab);
+        xa_node_cache.nr_empty--;
     }
+    node = slab->free;
+    slab->free = node->parent;
+    slab->inuse++;
+    xa_node_cache.nr_free--;
+    if (!slab->free)
+        slab_list_del(slab);
+    return node;
+}
 
-    // Retrieve and verify values
-    printf("\nRetrieving values:\n");
-    for (i = 0; i < sizeof(test_values)/sizeof(test_values[0]); i++) {
-        void *entry = xa_load(&xa, i);
-        if (entry && xa_is_value(entry)) {
-            unsigned long value = xa_to_value(entry);
-            printf("Retrieved value %lu from index %d\n", value, i);
-            if (value != test_values[i]) {
-                printf("Error: Value mismatch at index %d\n", i);
-                return 1;
-            }
-        } else {
-            printf("Error: Failed to retrieve value at index %d\n", i);
-            return 1;
+static void slab_put_node(struct xa_node *node)
+{
+    struct xa_node_slab *slab = xa_node_slab(node);
+
+    node->parent = slab->free;
+    slab->free = node;
+    xa_node_cache.nr_free++;
+    if (--slab->inuse == 0) {
+        if (slab->pprev)
+            slab_list_del(slab);
+        slab_list_add(&xa_node_cache.empty, slab);
+        xa_node_cache.nr_empty++;
+    } else if (!slab->pprev) {
+        slab_list_add(&xa_node_cache.partial, slab);
+    }
+}
+
+static bool xa_node_slab_grow(void)
+{
+    struct xa_node_slab *slab;
+
+    if (posix_memalign((void **)&slab, XA_NODE_SLAB_BYTES, XA_NODE_SLAB_BYTES))
+        return false;
+    slab->free = NULL;
+    slab->inuse = 0;
+    for (unsigned long i = XA_NODES_PER_SLAB; i-- > 0; ) {
+        slab->nodes[i].parent = slab->free;
+        slab->free = &slab->nodes[i];
+    }
+
+    spin_lock(&xa_node_cache.lock);
+    slab_list_add(&xa_node_cache.empty, slab);
+    xa_node_cache.nr_slabs++;
+    xa_node_cache.nr_empty++;
+    xa_node_cache.nr_free += XA_NODES_PER_SLAB;
+    spin_unlock(&xa_node_cache.lock);
+    return true;
+}
+
+// Return a magazine's nodes to the slabs; cache lock held
+static void xa_node_magazine_empty(struct xa_node_magazine *mag)
+{
+    spin_lock(&mag->lock);
+    while (mag->nr)
+        slab_put_node(mag->nodes[--mag->nr]);
+    spin_unlock(&mag->lock);
+}
+
+// Called at thread exit: hand the thread's cached nodes back to the slabs
+static void xa_node_magazine_release(void *data)
+{
+    struct xa_node_magazine *mag = data;
+
+    spin_lock(&xa_node_cache.lock);
+    *mag->pprev = mag->next;
+    if (mag->next)
+        mag->next->pprev = mag->pprev;
+    xa_node_magazine_empty(mag);
+    spin_unlock(&xa_node_cache.lock);
+    free(mag);
+}
+
+static void xa_node_magazine_key_init(void)
+{
+    pthread_key_create(&xa_node_magazine_key, xa_node_magazine_release);
+}
+
+static struct xa_node_magazine *xa_node_magazine_get(void)
+{
+    struct xa_node_magazine *mag = this_magazine;
+
+    if (mag)
+        return mag;
+    pthread_once(&xa_node_magazine_once, xa_node_magazine_key_init);
+    mag = calloc(1, sizeof(*mag));
+    if (!mag)
+        return NULL;
+    if (pthread_setspecific(xa_node_magazine_key, mag)) {
+        free(mag);
+        return NULL;
+    }
+    spin_lock(&xa_node_cache.lock);
+    mag->next = xa_node_cache.magazines;
+    if (mag->next)
+        mag->next->pprev = &mag->next;
+    mag->pprev = &xa_node_cache.magazines;
+    xa_node_cache.magazines = mag;
+    spin_unlock(&xa_node_cache.lock);
+    this_magazine = mag;
+    return mag;
+}
+
+static struct xa_node *xa_node_cache_alloc(void)
+{
+    struct xa_node_magazine *mag = xa_node_magazine_get();
+    struct xa_node *node;
+
+    if (mag) {
+        spin_lock(&mag->lock);
+        node = mag->nr ? mag->nodes[--mag->nr] : NULL;
+        spin_unlock(&mag->lock);
+        if (node)
+            goto out;
+    }
+
+    spin_lock(&xa_node_cache.lock);
+    while (!(node = slab_get_node())) {
+        spin_unlock(&xa_node_cache.lock);
+        if (!xa_node_slab_grow())
+            return NULL;
+        spin_lock(&xa_node_cache.lock);
+    }
+    if (mag) {
+        spin_lock(&mag->lock);
+        while (mag->nr < XA_NODE_CACHE_BATCH) {
+            struct xa_node *extra = slab_get_node();
+
+            if (!extra)
+                break;
+            mag->nodes[mag->nr++] = extra;
+        }
+        spin_unlock(&mag->lock);
+    }
+    spin_unlock(&xa_node_cache.lock);
+out:
+    memset(node, 0, sizeof(*node));
+    return node;
+}
+
+static void xa_node_cache_free(struct xa_node *node)
+{
+    struct xa_node_magazine *mag = xa_node_magazine_get();
+
+    if (mag) {
+        spin_lock(&mag->lock);
+        if (mag->nr < XA_NODE_CACHE_SIZE) {
+            mag->nodes[mag->nr++] = node;
+            node = NULL;
         }
+        spin_unlock(&mag->lock);
+        if (!node)
+            return;
+    }
+
+    spin_lock(&xa_node_cache.lock);
+    slab_put_node(node);
+    if (mag) {
+        spin_lock(&mag->lock);
+        while (mag->nr > XA_NODE_CACHE_SIZE - XA_NODE_CACHE_BATCH)
+            slab_put_node(mag->nodes[--mag->nr]);
+        spin_unlock(&mag->lock);
+    }
+    spin_unlock(&xa_node_cache.lock);
+}
+
+// Give every thread's cached nodes back to the slabs
+void xa_node_cache_drain(void)
+{
+    struct xa_node_magazine *mag;
+
+    spin_lock(&xa_node_cache.lock);
+    for (mag = xa_node_cache.magazines; mag; mag = mag->next)
+        xa_node_magazine_empty(mag);
+    spin_unlock(&xa_node_cache.lock);
+}
+
+/*
+ * Shrinker for the node cache. Under memory pressure shrink_slab() asks
+ * how much could go, then scans in batches of a slab's worth of nodes;
+ * each scan empties every thread's magazine and releases whole empty
+ * slabs.
+ */
+struct shrink_control {
+    unsigned long nr_to_scan;
+    unsigned long nr_scanned;
+};
+
+struct shrinker {
+    unsigned long (*count_objects)(struct shrinker *shrinker, struct shrink_control *sc);
+    unsigned long (*scan_objects)(struct shrinker *shrinker, struct shrink_control *sc);
+    long batch;
+};
+
+#define SHRINK_STOP (~0UL)
+
+static unsigned long xa_node_count_objects(struct shrinker *shrinker,
+                                           struct shrink_control *sc)
+{
+    struct xa_node_magazine *mag;
+    unsigned long count;
+
+    spin_lock(&xa_node_cache.lock);
+    count = xa_node_cache.nr_empty * XA_NODES_PER_SLAB;
+    for (mag = xa_node_cache.magazines; mag; mag = mag->next) {
+        spin_lock(&mag->lock);
+        count += mag->nr;
+        spin_unlock(&mag->lock);
+    }
+    spin_unlock(&xa_node_cache.lock);
+    return count;
+}
+
+static unsigned long xa_node_scan_objects(struct shrinker *shrinker,
+                                          struct shrink_control *sc)
+{
+    struct xa_node_slab *slab, *victims = NULL;
+    unsigned long freed = 0;
+
+    xa_node_cache_drain();
+    spin_lock(&xa_node_cache.lock);
+    while (freed < sc->nr_to_scan && (slab = xa_node_cache.empty)) {
+        slab_list_del(slab);
+        xa_node_cache.nr_slabs--;
+        xa_node_cache.nr_empty--;
+        xa_node_cache.nr_free -= XA_NODES_PER_SLAB;
+        slab->next = victims;
+        victims = slab;
+        freed += XA_NODES_PER_SLAB;
     }
+    spin_unlock(&xa_node_cache.lock);
+
+    while ((slab = victims)) {
+        victims = slab->next;
+        free(slab);
+    }
+    sc->nr_scanned = freed;
+    return freed ? freed : SHRINK_STOP;
+}
+
+static struct shrinker xa_node_shrinker = {
+    .count_objects = xa_node_count_objects,
+    .scan_objects = xa_node_scan_objects,
+    .batch = XA_NODES_PER_SLAB,
+};
+
+// Scan shrinker a batch at a time until nr_to_scan objects go or it stops
+static unsigned long shrink_slab(struct shrinker *shrinker, unsigned long nr_to_scan)
+{
+    struct shrink_control sc;
+    unsigned long freed = 0, ret;
+
+    while (freed < nr_to_scan && shrinker->count_objects(shrinker, &sc)) {
+        sc.nr_to_scan = nr_to_scan - freed < (unsigned long)shrinker->batch ?
+                        nr_to_scan - freed : (unsigned long)shrinker->batch;
+        ret = shrinker->scan_objects(shrinker, &sc);
+        if (ret == SHRINK_STOP)
+            break;
+        freed += ret;
+    }
+    return freed;
+}
+
+// Node memory accounting
+struct xa_node_cache_stats {
+    unsigned long active;               // nodes in trees or waiting out RCU
+    unsigned long active_bytes;
+    unsigned long slabs;
+    unsigned long slab_bytes;           // everything the cache holds from malloc
+    unsigned long free;                 // free in slabs, not counting magazines
+};
+
+static unsigned long nr_xa_nodes;       // nodes not yet freed, to catch leaks in tests
+static int xa_nowait_fail;              // test hook: fail this many GFP_NOWAIT allocations
+
+void xa_node_cache_stats(struct xa_node_cache_stats *stats)
+{
+    spin_lock(&xa_node_cache.lock);
+    stats->slabs = xa_node_cache.nr_slabs;
+    stats->free = xa_node_cache.nr_free;
+    spin_unlock(&xa_node_cache.lock);
+    stats->slab_bytes = stats->slabs * XA_NODE_SLAB_BYTES;
+    stats->active = __atomic_load_n(&nr_xa_nodes, __ATOMIC_RELAXED);
+    stats->active_bytes = stats->active * sizeof(struct xa_node);
+}
+
+static struct xa_node *xa_node_alloc(struct xa_node *parent, unsigned char shift,
+                                     unsigned char offset, gfp_t gfp)
+{
+    struct xa_node *node;
+
+    if (gfp == GFP_NOWAIT && xa_nowait_fail > 0) {
+        xa_nowait_fail--;
+        return NULL;
+    }
+    node = xa_node_cache_alloc();
+    if (!node)
+        return NULL;
+    node->shift = shift;
+    node->offset = offset;
+    node->parent = parent;
+    __atomic_fetch_add(&nr_xa_nodes, 1, __ATOMIC_RELAXED);
+    return node;
+}
+
+static void xa_node_rcu_free(struct rcu_head *head)
+{
+    __atomic_fetch_sub(&nr_xa_nodes, 1, __ATOMIC_RELAXED);
+    xa_node_cache_free((struct xa_node *)((char *)head - offsetof(struct xa_node, rcu)));
+}
+
+// Lock-free readers may still be walking the node, so defer the free
+static void xa_node_free(struct xa_node *node)
+{
+    call_rcu(&node->rcu, xa_node_rcu_free);
+}
+
+/*
+ * A mark bit in a node is set for each slot whose entry is marked, or
+ * whose child node has that mark on any slot, so a marked search can skip
+ * whole subtrees. Marks change under xa_lock and are read without it.
+ */
+static inline bool node_get_mark(struct xa_node *node, unsigned int offset,
+                                 xa_mark_t mark)
+{
+    return READ_ONCE(node->marks[mark][offset / BITS_PER_LONG]) &
+           (1UL << (offset % BITS_PER_LONG));
+}
+
+// Returns true if the mark was already set
+static inline bool node_set_mark(struct xa_node *node, unsigned int offset,
+                                 xa_mark_t mark)
+{
+    unsigned long bit = 1UL << (offset % BITS_PER_LONG);
+
+    return __atomic_fetch_or(&node->marks[mark][offset / BITS_PER_LONG], bit,
+                             __ATOMIC_RELAXED) & bit;
+}
+
+// Returns true if the mark was set
+static inline bool node_clear_mark(struct xa_node *node, unsigned int offset,
+                                   xa_mark_t mark)
+{
+    unsigned long bit = 1UL << (offset % BITS_PER_LONG);
+
+    return __atomic_fetch_and(&node->marks[mark][offset / BITS_PER_LONG], ~bit,
+                              __ATOMIC_RELAXED) & bit;
+}
+
+static inline bool node_any_mark(struct xa_node *node, xa_mark_t mark)
+{
+    for (unsigned int i = 0; i < XA_MARK_LONGS; i++) {
+        if (READ_ONCE(node->marks[mark][i]))
+            return true;
+    }
+    return false;
+}
+
+// First slot at or after offset carrying mark, or XA_CHUNK_SIZE
+static unsigned int node_find_mark(struct xa_node *node, unsigned int offset,
+                                   xa_mark_t mark)
+{
+    while (offset < XA_CHUNK_SIZE) {
+        unsigned int i = offset / BITS_PER_LONG;
+        unsigned long word = READ_ONCE(node->marks[mark][i]) &
+                             (~0UL << (offset % BITS_PER_LONG));
+
+        if (word) {
+            offset = i * BITS_PER_LONG + __builtin_ctzl(word);
+            return offset < XA_CHUNK_SIZE ? offset : XA_CHUNK_SIZE;
+        }
+        offset = (i + 1) * BITS_PER_LONG;
+    }
+    return XA_CHUNK_SIZE;
+}
+
+static inline bool xa_marked(const struct xarray *xa, xa_mark_t mark)
+{
+    return READ_ONCE(xa->xa_flags) & XA_FLAGS_MARK(mark);
+}
+
+static inline void xa_mark_set(struct xarray *xa, xa_mark_t mark)
+{
+    __atomic_fetch_or(&xa->xa_flags, XA_FLAGS_MARK(mark), __ATOMIC_RELAXED);
+}
+
+static inline void xa_mark_clear(struct xarray *xa, xa_mark_t mark)
+{
+    __atomic_fetch_and(&xa->xa_flags, ~XA_FLAGS_MARK(mark), __ATOMIC_RELAXED);
+}
+
+static inline bool xa_track_free(const struct xarray *xa)
+{
+    return READ_ONCE(xa->xa_flags) & XA_FLAGS_TRACK_FREE;
+}
+
+static inline void node_mark_all(struct xa_node *node, xa_mark_t mark)
+{
+    for (unsigned int i = 0; i < XA_MARK_LONGS; i++) {
+        unsigned int bits = XA_CHUNK_SIZE - i * BITS_PER_LONG;
+
+        WRITE_ONCE(node->marks[mark][i],
+                   bits >= BITS_PER_LONG ? ~0UL : (1UL << bits) - 1);
+    }
+}
+
+// Marks of an empty array: only XA_FREE_MARK, and only when tracking free slots
+static void xa_init_root_marks(struct xarray *xa)
+{
+    for (xa_mark_t mark = XA_MARK_0; mark <= XA_MARK_MAX; mark++) {
+        if (mark == XA_FREE_MARK && xa_track_free(xa))
+            xa_mark_set(xa, mark);
+        else
+            xa_mark_clear(xa, mark);
+    }
+}
+
+void xa_init_flags(struct xarray *xa, unsigned int flags)
+{
+    spin_lock_init(&xa->xa_lock);
+    xa->xa_head = NULL;
+    xa->xa_flags = flags;
+}
+
+void xa_init(struct xarray *xa)
+{
+    xa_init_flags(xa, 0);
+}
+
+/*
+ * Allocate a node with xa_lock held. This cannot sleep, so it takes the
+ * node left by xas_nomem() if there is one, and otherwise makes a
+ * GFP_NOWAIT attempt that the caller retries after xas_nomem() on failure.
+ */
+static struct xa_node *xas_alloc(struct xa_state *xas, struct xa_node *parent,
+                                 unsigned char shift, unsigned char offset)
+{
+    struct xa_node *node = xas->xa_alloc;
+
+    if (node) {
+        xas->xa_alloc = NULL;
+        node->shift = shift;
+        node->offset = offset;
+        node->parent = parent;
+    } else {
+        node = xa_node_alloc(parent, shift, offset, GFP_NOWAIT);
+        if (!node)
+            return NULL;
+    }
+    if (xa_track_free(xas->xa))
+        node_mark_all(node, XA_FREE_MARK);
+    return node;
+}
+
+// Free a node xas_nomem() allocated that no store used
+static void xas_destroy(struct xa_state *xas)
+{
+    struct xa_node *node = xas->xa_alloc;
+
+    if (node) {
+        xas->xa_alloc = NULL;
+        xa_node_rcu_free(&node->rcu);
+    }
+}
+
+/*
+ * Call after a store made with xa_lock dropped. If it ran out of memory,
+ * allocate a node with gfp, which may sleep, and return true so the
+ * caller retries the store. Otherwise free any unused node and return
+ * false.
+ */
+bool xas_nomem(struct xa_state *xas, gfp_t gfp)
+{
+    if (xas->xa_node != XA_ERROR(-ENOMEM)) {
+        xas_destroy(xas);
+        return false;
+    }
+    xas->xa_alloc = xa_node_alloc(NULL, 0, 0, gfp);
+    if (!xas->xa_alloc)
+        return false;
+    xas->xa_node = XAS_RESTART;
+    return true;
+}
+
+/*
+ * Add levels on top until the tree can hold max, and has a node at level
+ * xas->xa_shift for a multi-index entry to go in. An existing tree, or a
+ * lone entry at index 0 in the head, moves down into slot 0 of the new
+ * top node. An empty array gets a top node of the right height at once.
+ */
+static int xa_expand(struct xa_state *xas, unsigned long max)
+{
+    struct xarray *xa = xas->xa;
+    void *head = xa->xa_head;
+    unsigned char top = 0;
+    struct xa_node *node;
+
+    if (!head) {
+        if (max == 0)
+            return 0;
+        while (top + XA_CHUNK_SHIFT < BITS_PER_LONG &&
+               ((max >> top) >= XA_CHUNK_SIZE || top < xas->xa_shift))
+            top += XA_CHUNK_SHIFT;
+        node = xas_alloc(xas, NULL, top, 0);
+        if (!node)
+            return -ENOMEM;
+        rcu_assign_pointer(xa->xa_head, xa_mk_node(node));
+        return 0;
+    }
+
+    if (xa_is_node(head))
+        top = xa_to_node(head)->shift + XA_CHUNK_SHIFT;
+
+    while (max > xa_max_index(head) ||
+           (xa_is_node(head) && xa_to_node(head)->shift < xas->xa_shift)) {
+        node = xas_alloc(xas, NULL, top, 0);
+        if (!node)
+            return -ENOMEM;
+        node->slots[0] = head;
+        node->count = 1;
+        for (xa_mark_t mark = XA_MARK_0; mark <= XA_MARK_MAX; mark++) {
+            if (mark == XA_FREE_MARK && xa_track_free(xa)) {
+                // Slots 1 and up are free; slot 0 is as free as the old root
+                if (!xa_marked(xa, mark)) {
+                    node_clear_mark(node, 0, mark);
+                    xa_mark_set(xa, mark);
+                }
+            } else if (xa_marked(xa, mark)) {
+                node_set_mark(node, 0, mark);
+            }
+        }
+        if (xa_is_node(head)) {
+            WRITE_ONCE(xa_to_node(head)->parent, node);
+            xa_to_node(head)->offset = 0;
+        } else if (xa_is_value(head)) {
+            node->nr_values = 1;
+        }
+        head = xa_mk_node(node);
+        rcu_assign_pointer(xa->xa_head, head);
+        top += XA_CHUNK_SHIFT;
+    }
+    return 0;
+}
+
+/*
+ * Free node if it is empty, and then each ancestor left empty by that.
+ * Emptying the top node empties the array.
+ */
+static void xa_delete_node(struct xarray *xa, struct xa_node *node)
+{
+    while (node && node->count == 0) {
+        struct xa_node *parent = node->parent;
+
+        if (parent) {
+            WRITE_ONCE(parent->slots[node->offset], NULL);
+            parent->count--;
+        } else {
+            WRITE_ONCE(xa->xa_head, NULL);
+        }
+        xa_node_free(node);
+        node = parent;
+    }
+}
+
+/*
+ * Drop top nodes whose only entry is in slot 0, so the tree is no taller
+ * than its highest index needs. A lone entry at index 0 goes back into
+ * the head. Returns true if any node went.
+ */
+static bool xa_shrink(struct xarray *xa)
+{
+    bool shrunk = false;
+
+    while (xa_is_node(xa->xa_head)) {
+        struct xa_node *node = xa_to_node(xa->xa_head);
+        void *entry = node->slots[0];
+
+        if (node->count != 1 || !entry)
+            break;
+        if (!xa_is_node(entry) && node->shift)
+            break;
+
+        rcu_assign_pointer(xa->xa_head, entry);
+        if (xa_track_free(xa) && !node_get_mark(node, 0, XA_FREE_MARK))
+            xa_mark_clear(xa, XA_FREE_MARK);
+        if (xa_is_node(entry))
+            WRITE_ONCE(xa_to_node(entry)->parent, NULL);
+        else
+            WRITE_ONCE(node->slots[0], XA_RETRY_ENTRY);
+        xa_node_free(node);
+        shrunk = true;
+    }
+    return shrunk;
+}
+
+/*
+ * Set mark on slot offset of node and on the path above it, stopping at
+ * the first ancestor that already has it.
+ */
+static void xa_node_set_mark(struct xarray *xa, struct xa_node *node,
+                             unsigned int offset, xa_mark_t mark)
+{
+    while (node) {
+        if (node_set_mark(node, offset, mark))
+            return;
+        offset = node->offset;
+        node = node->parent;
+    }
+    xa_mark_set(xa, mark);
+}
+
+/*
+ * Clear mark on slot offset of node, and on each ancestor whose subtree
+ * no longer has any entry with that mark.
+ */
+static void xa_node_clear_mark(struct xarray *xa, struct xa_node *node,
+                               unsigned int offset, xa_mark_t mark)
+{
+    while (node) {
+        if (!node_clear_mark(node, offset, mark))
+            return;
+        if (node_any_mark(node, mark))
+            return;
+        offset = node->offset;
+        node = node->parent;
+    }
+    xa_mark_clear(xa, mark);
+}
+
+/*
+ * Load the entry for index from node, following a sibling back to the
+ * first slot of its multi-index entry. *offsetp is set to that slot.
+ */
+static inline void *xa_descend(struct xa_node *node, unsigned long index,
+                               unsigned int *offsetp)
+{
+    unsigned int offset = (index >> node->shift) & XA_CHUNK_MASK;
+    void *entry = rcu_dereference(node->slots[offset]);
+
+    if (xa_is_sibling(entry)) {
+        offset = xa_to_sibling(entry);
+        entry = rcu_dereference(node->slots[offset]);
+    }
+    *offsetp = offset;
+    return entry;
+}
+
+/*
+ * Find the node and first slot holding the entry for index; xa_lock held.
+ * Returns the entry, with *nodep NULL if it lives in the head.
+ */
+static void *xa_lookup_slot(struct xarray *xa, unsigned long index,
+                            struct xa_node **nodep, unsigned int *offsetp)
+{
+    void *entry = xa->xa_head;
+    struct xa_node *node = NULL;
+    unsigned int offset = 0;
+
+    if (!xa_is_node(entry)) {
+        if (index)
+            entry = NULL;
+    } else if (index > xa_max_index(entry)) {
+        entry = NULL;
+    } else {
+        do {
+            node = xa_to_node(entry);
+            entry = xa_descend(node, index, &offset);
+        } while (xa_is_node(entry));
+    }
+    *nodep = node;
+    *offsetp = offset;
+    return entry;
+}
+
+static void xa_destroy_node(struct xa_node *node);
+
+// Empty slot offset of node, leaving it marked free if the array tracks that
+static void xa_node_clear_slot(struct xarray *xa, struct xa_node *node,
+                               unsigned int offset)
+{
+    for (xa_mark_t mark = XA_MARK_0; mark <= XA_MARK_MAX; mark++)
+        xa_node_clear_mark(xa, node, offset, mark);
+    WRITE_ONCE(node->slots[offset], NULL);
+    node->count--;
+    if (xa_track_free(xa))
+        xa_node_set_mark(xa, node, offset, XA_FREE_MARK);
+}
+
+/*
+ * Remove the entry or subtree whose first slot is offset, along with its
+ * siblings and marks; xa_lock held. Leaves freeing an emptied node to the
+ * caller.
+ */
+static void xa_node_erase_entry(struct xarray *xa, struct xa_node *node,
+                                unsigned int offset)
+{
+    void *entry = node->slots[offset];
+    unsigned int i;
+
+    xa_node_clear_slot(xa, node, offset);
+    if (xa_is_node(entry)) {
+        xa_destroy_node(xa_to_node(entry));
+        return;
+    }
+    if (xa_is_value(entry))
+        node->nr_values--;
+    for (i = offset + 1; i < XA_CHUNK_SIZE && node->slots[i] == xa_mk_sibling(offset); i++)
+        xa_node_clear_slot(xa, node, i);
+}
+
+// Number of sibling slots following the entry at offset
+static unsigned int xa_entry_sibs(struct xa_node *node, unsigned int offset)
+{
+    unsigned int i = offset + 1;
+
+    while (i < XA_CHUNK_SIZE && node->slots[i] == xa_mk_sibling(offset))
+        i++;
+    return i - offset - 1;
+}
+
+static void *__xa_erase(struct xarray *xa, unsigned long index)
+{
+    struct xa_node *node;
+    unsigned int offset;
+    void *entry;
+
+    entry = xa_lookup_slot(xa, index, &node, &offset);
+    if (!entry)
+        return NULL;
+    if (!node) {
+        WRITE_ONCE(xa->xa_head, NULL);
+        xa_init_root_marks(xa);
+        return entry;
+    }
+
+    xa_node_erase_entry(xa, node, offset);
+    xa_delete_node(xa, node);
+    xa_shrink(xa);
+    return entry;
+}
+
+/*
+ * Remove the entry at index and return it, freeing nodes left empty. A
+ * multi-index entry is removed from its whole range.
+ */
+void *xa_erase(struct xarray *xa, unsigned long index)
+{
+    void *entry;
+
+    spin_lock(&xa->xa_lock);
+    entry = __xa_erase(xa, index);
+    spin_unlock(&xa->xa_lock);
+    return entry;
+}
+
+/*
+ * Step xas into node: load the slot for xas->xa_index, following a
+ * sibling back to the first slot of its entry.
+ */
+static inline void *xas_descend(struct xa_state *xas, struct xa_node *node)
+{
+    unsigned int offset;
+    void *entry = xa_descend(node, xas->xa_index, &offset);
+
+    xas->xa_node = node;
+    xas->xa_offset = offset;
+    return entry;
+}
+
+/*
+ * Walk from the root. Leaves xas->xa_node NULL for an entry in the head
+ * and XAS_BOUNDS for an index past the end of the tree.
+ */
+static void *xas_start(struct xa_state *xas)
+{
+    void *entry;
+
+    if (xas_is_node(xas))
+        return rcu_dereference(xas->xa_node->slots[xas->xa_offset]);
+    if (xas_error(xas))
+        return NULL;
+
+    entry = rcu_dereference(xas->xa->xa_head);
+    if (xa_is_node(entry) ? xas->xa_index > xa_max_index(entry) : xas->xa_index != 0) {
+        xas->xa_node = XAS_BOUNDS;
+        return NULL;
+    }
+    xas->xa_node = NULL;
+    return entry;
+}
+
+/*
+ * Load the entry at xas->xa_index, stopping at level xas->xa_shift. From
+ * XAS_RESTART this walks from the root; from a node it reloads the slot
+ * xas is on and carries on down. Call under rcu_read_lock() or xa_lock,
+ * and check the result with xas_retry().
+ */
+void *xas_load(struct xa_state *xas)
+{
+    void *entry = xas_start(xas);
+
+    while (xa_is_node(entry)) {
+        struct xa_node *node = xa_to_node(entry);
+
+        if (xas->xa_shift > node->shift)
+            break;
+        entry = xas_descend(xas, node);
+        if (node->shift == 0)
+            break;
+    }
+    return entry;
+}
+
+static inline bool xas_retry(struct xa_state *xas, const void *entry)
+{
+    if (!xa_is_retry(entry))
+        return false;
+    xas_reset(xas);
+    return true;
+}
+
+/*
+ * Move to xas->xa_index + 1, or - 1, and return its entry. Only the nodes
+ * whose range the step leaves are climbed out of, so walking a run of
+ * indices touches each node once instead of starting again from the root.
+ */
+void *xas_next(struct xa_state *xas)
+{
+    struct xa_node *node = xas->xa_node;
+    void *entry;
+
+    xas->xa_index++;
+    if (!xas_is_node(xas) || !xas->xa_index) {
+        xas_reset(xas);
+        return xas_load(xas);
+    }
+    while (node && !(xas->xa_index & ((XA_CHUNK_SIZE << node->shift) - 1)))
+        node = READ_ONCE(node->parent);
+    if (!node) {
+        xas_reset(xas);
+        return xas_load(xas);
+    }
+    for (;;) {
+        entry = xas_descend(xas, node);
+        if (!xa_is_node(entry) || node->shift == 0)
+            return entry;
+        node = xa_to_node(entry);
+    }
+}
+
+void *xas_prev(struct xa_state *xas)
+{
+    struct xa_node *node = xas->xa_node;
+    unsigned long mask;
+    void *entry;
+
+    xas->xa_index--;
+    if (!xas_is_node(xas) || xas->xa_index == ~0UL) {
+        xas_reset(xas);
+        return xas_load(xas);
+    }
+    while (node) {
+        mask = (XA_CHUNK_SIZE << node->shift) - 1;
+        if ((xas->xa_index & mask) != mask)
+            break;
+        node = READ_ONCE(node->parent);
+    }
+    if (!node) {
+        xas_reset(xas);
+        return xas_load(xas);
+    }
+    for (;;) {
+        entry = xas_descend(xas, node);
+        if (!xa_is_node(entry) || node->shift == 0)
+            return entry;
+        node = xa_to_node(entry);
+    }
+}
+
+/*
+ * Readers take no lock. Writers publish a node only once it is fully set
+ * up, and retired nodes outlive any reader that might still hold them.
+ */
+void *xa_load(struct xarray *xa, unsigned long index)
+{
+    XA_STATE(xas, xa, index);
+    void *entry;
+
+    rcu_read_lock();
+    do {
+        entry = xas_load(&xas);
+    } while (xas_retry(&xas, entry));
+    rcu_read_unlock();
+    return entry;
+}
+
+/*
+ * Is the entry at index marked? Like xa_load(), this takes no lock, and
+ * stops at the first level where the mark is clear.
+ */
+bool xa_get_mark(struct xarray *xa, unsigned long index, xa_mark_t mark)
+{
+    struct xa_node *node;
+    unsigned int offset;
+    bool marked = false;
+    void *entry;
+
+    if (mark > XA_MARK_MAX)
+        return false;
+
+    rcu_read_lock();
+retry:
+    entry = rcu_dereference(xa->xa_head);
+    if (!xa_is_node(entry)) {
+        marked = !index && entry && xa_marked(xa, mark);
+        goto out;
+    }
+    if (index > xa_max_index(entry))
+        goto out;
+
+    do {
+        node = xa_to_node(entry);
+        entry = xa_descend(node, index, &offset);
+        if (xa_is_retry(entry))
+            goto retry;
+        if (!entry || !node_get_mark(node, offset, mark))
+            goto out;
+    } while (xa_is_node(entry));
+    marked = true;
+out:
+    rcu_read_unlock();
+    return marked;
+}
+
+// Set mark on the entry at index, if there is one
+void xa_set_mark(struct xarray *xa, unsigned long index, xa_mark_t mark)
+{
+    struct xa_node *node;
+    unsigned int offset;
+
+    if (mark > XA_MARK_MAX)
+        return;
+
+    spin_lock(&xa->xa_lock);
+    if (xa_lookup_slot(xa, index, &node, &offset)) {
+        if (node)
+            xa_node_set_mark(xa, node, offset, mark);
+        else
+            xa_mark_set(xa, mark);
+    }
+    spin_unlock(&xa->xa_lock);
+}
+
+void xa_clear_mark(struct xarray *xa, unsigned long index, xa_mark_t mark)
+{
+    struct xa_node *node;
+    unsigned int offset;
+
+    if (mark > XA_MARK_MAX)
+        return;
+
+    spin_lock(&xa->xa_lock);
+    if (xa_lookup_slot(xa, index, &node, &offset)) {
+        if (node)
+            xa_node_clear_mark(xa, node, offset, mark);
+        else
+            xa_mark_clear(xa, mark);
+    }
+    spin_unlock(&xa->xa_lock);
+}
+
+static inline bool xa_node_match(struct xa_node *node, unsigned int offset,
+                                 xa_mark_t filter)
+{
+    return filter == XA_PRESENT || node_get_mark(node, offset, filter);
+}
+
+// First slot at or after offset that is in use, or marked with filter
+static unsigned int xa_node_find(struct xa_node *node, unsigned int offset,
+                                 xa_mark_t filter)
+{
+    if (filter != XA_PRESENT)
+        return node_find_mark(node, offset, filter);
+    while (offset < XA_CHUNK_SIZE && !rcu_dereference(node->slots[offset]))
+        offset++;
+    return offset;
+}
+
+/*
+ * Search for the first entry at an index between *indexp and max that is
+ * present (filter XA_PRESENT) or carries the mark filter. On success
+ * *indexp is set to its index. A marked search follows the mark bits and
+ * so never enters a subtree without the mark. A multi-index entry that
+ * starts below *indexp is returned as found at *indexp unless after is
+ * set. Takes no lock: the entry returned was present at some point during
+ * the call.
+ */
+static void *__xa_find(struct xarray *xa, unsigned long *indexp, unsigned long max,
+                       xa_mark_t filter, bool after)
+{
+    unsigned long index = *indexp, span;
+    unsigned int offset, start;
+    struct xa_node *node;
+    void *entry = NULL;
+
+    if ((filter != XA_PRESENT && filter > XA_MARK_MAX) || index > max)
+        return NULL;
+
+    rcu_read_lock();
+restart:
+    entry = rcu_dereference(xa->xa_head);
+    if (filter != XA_PRESENT && !xa_marked(xa, filter)) {
+        entry = NULL;
+        goto out;
+    }
+    if (!xa_is_node(entry)) {
+        if (index)
+            entry = NULL;
+        goto out;
+    }
+    if (index > xa_max_index(entry)) {
+        entry = NULL;
+        goto out;
+    }
+
+    node = xa_to_node(entry);
+    for (;;) {
+        start = (index >> node->shift) & XA_CHUNK_MASK;
+        entry = xa_descend(node, index, &offset);
+        if (xa_is_retry(entry))
+            goto restart;
+        if (entry && !xa_is_node(entry) &&
+            (offset != start || (index & ((1UL << node->shift) - 1)))) {
+            // A multi-index entry that began below index
+            if (!after && xa_node_match(node, offset, filter))
+                break;
+            offset = start + 1;
+        } else {
+            offset = start;
+        }
+
+        for (;;) {
+            offset = xa_node_find(node, offset, filter);
+            entry = NULL;
+            if (offset == XA_CHUNK_SIZE)
+                break;
+            // A mark may be seen just before its entry is erased
+            entry = rcu_dereference(node->slots[offset]);
+            if (entry && !xa_is_sibling(entry))
+                break;
+            offset++;
+        }
+
+        if (!entry) {
+            // Nothing left in this node: go on from the start of the next one
+            if (node->shift + XA_CHUNK_SHIFT >= BITS_PER_LONG)
+                goto out;
+            span = node->shift + XA_CHUNK_SHIFT;
+            index = ((index >> span) + 1) << span;
+            if (!index || index > max)
+                goto out;
+            goto restart;
+        }
+        if (xa_is_retry(entry))
+            goto restart;
+        if (offset != start)
+            index = (index & ~((XA_CHUNK_SIZE << node->shift) - 1)) |
+                    ((unsigned long)offset << node->shift);
+        if (index > max) {
+            entry = NULL;
+            goto out;
+        }
+        if (!xa_is_node(entry))
+            break;
+        node = xa_to_node(entry);
+    }
+    *indexp = index;
+out:
+    rcu_read_unlock();
+    return entry;
+}
+
+void *xa_find(struct xarray *xa, unsigned long *indexp, unsigned long max,
+              xa_mark_t filter)
+{
+    return __xa_find(xa, indexp, max, filter, false);
+}
+
+// As xa_find(), but for the first entry that starts after *indexp
+void *xa_find_after(struct xarray *xa, unsigned long *indexp, unsigned long max,
+                    xa_mark_t filter)
+{
+    unsigned long index = *indexp + 1;
+    void *entry;
+
+    if (!index)
+        return NULL;
+    entry = __xa_find(xa, &index, max, filter, true);
+    if (entry)
+        *indexp = index;
+    return entry;
+}
+
+#define xa_for_each_range(xa, index, entry, start, last)                  \
+    for (index = start, entry = xa_find(xa, &index, last, XA_PRESENT);      \
+         entry;                                                            \
+         entry = xa_find_after(xa, &index, last, XA_PRESENT))
+
+#define xa_for_each(xa, index, entry) \
+    xa_for_each_range(xa, index, entry, 0, ~0UL)
+
+#define xa_for_each_marked(xa, index, entry, filter)                   \
+    for (index = 0, entry = xa_find(xa, &index, ~0UL, filter);          \
+         entry;                                                        \
+         entry = xa_find_after(xa, &index, ~0UL, filter))
+
+/*
+ * Allocate the nodes that go below node on the way down to the level
+ * xas->xa_shift, each linked into its parent but the first not yet linked
+ * into node, so none of them is visible. Returns the first node and the
+ * last in *bottom, or NULL with nothing allocated.
+ */
+static struct xa_node *xas_alloc_path(struct xa_state *xas, struct xa_node *node,
+                                      struct xa_node **bottom)
+{
+    struct xa_node *parent = node, *child;
+    unsigned int offset;
+
+    while (parent->shift > xas->xa_shift) {
+        offset = (xas->xa_index >> parent->shift) & XA_CHUNK_MASK;
+        child = xas_alloc(xas, parent, parent->shift - XA_CHUNK_SHIFT, offset);
+        if (!child) {
+            while (parent != node) {
+                child = parent;
+                parent = parent->parent;
+                xa_node_rcu_free(&child->rcu);
+            }
+            return NULL;
+        }
+        if (parent != node) {
+            parent->slots[offset] = xa_mk_node(child);
+            parent->count++;
+        }
+        parent = child;
+    }
+
+    *bottom = parent;
+    while (parent->parent != node)
+        parent = parent->parent;
+    return parent;
+}
+
+/*
+ * Store entry over the range described by xas; xa_lock held. The walk
+ * starts from the node xas is on if it has one, so consecutive stores
+ * along xas_next() do not go back to the root. An entry covering exactly
+ * the range is replaced and keeps its marks. Anything else overlapping
+ * the range, including a larger multi-index entry, is erased in full
+ * first. Returns the entry that was at xas->xa_index.
+ */
+static void *__xas_store(struct xa_state *xas, void *entry)
+{
+    struct xarray *xa = xas->xa;
+    unsigned long index = xas->xa_index;
+    unsigned long last = index + (((unsigned long)xas->xa_sibs + 1) << xas->xa_shift) - 1;
+    struct xa_node *node = xas->xa_node, *child, *bottom;
+    unsigned int offset, slot, i;
+    void *curr = NULL, *next;
+
+    if (!xas_is_node(xas) || node->shift < xas->xa_shift) {
+        if (!last && !xa_is_node(xa->xa_head)) {
+            curr = xa->xa_head;
+            rcu_assign_pointer(xa->xa_head, entry);
+            if (xa_track_free(xa))
+                xa_mark_clear(xa, XA_FREE_MARK);
+            xas->xa_node = NULL;
+            return curr;
+        }
+        if (xa_expand(xas, last)) {
+            xas_set_err(xas, -ENOMEM);
+            return NULL;
+        }
+        node = xa_to_node(xa->xa_head);
+    }
+
+    for (;;) {
+        next = xa_descend(node, index, &offset);
+        if (node->shift == xas->xa_shift)
+            break;
+        if (xa_is_node(next)) {
+            node = xa_to_node(next);
+            continue;
+        }
+        /*
+         * An empty slot, or a larger entry which has to make way. The
+         * whole path down is allocated before the larger entry is
+         * erased, so running out of memory leaves it in place.
+         */
+        child = xas_alloc_path(xas, node, &bottom);
+        if (!child) {
+            xa_delete_node(xa, node);
+            xa_shrink(xa);
+            xas_set_err(xas, -ENOMEM);
+            return NULL;
+        }
+        if (next) {
+            curr = next;
+            xa_node_erase_entry(xa, node, offset);
+        }
+        rcu_assign_pointer(node->slots[child->offset], xa_mk_node(child));
+        node->count++;
+        node = bottom;
+        next = NULL;
+        break;
+    }
+
+    slot = (index >> node->shift) & XA_CHUNK_MASK;
+    if (next && !xa_is_node(next) && offset == slot &&
+        xa_entry_sibs(node, offset) == xas->xa_sibs) {
+        rcu_assign_pointer(node->slots[offset], entry);
+        node->nr_values += xa_is_value(entry) - xa_is_value(next);
+        xas->xa_node = node;
+        xas->xa_offset = offset;
+        return next;
+    }
+
+    // The old entry at index, which may be further down a subtree
+    for (curr = next ? next : curr; xa_is_node(curr); )
+        curr = xa_descend(xa_to_node(curr), index, &i);
+
+    for (i = slot; i <= slot + xas->xa_sibs; i++) {
+        next = node->slots[i];
+        if (xa_is_sibling(next))
+            xa_node_erase_entry(xa, node, xa_to_sibling(next));
+        else if (next)
+            xa_node_erase_entry(xa, node, i);
+    }
+
+    rcu_assign_pointer(node->slots[slot], entry);
+    for (i = 1; i <= xas->xa_sibs; i++)
+        rcu_assign_pointer(node->slots[slot + i], xa_mk_sibling(slot));
+    node->count += xas->xa_sibs + 1;
+    node->nr_values += xa_is_value(entry);
+    if (xa_track_free(xa)) {
+        for (i = slot; i <= slot + xas->xa_sibs; i++)
+            xa_node_clear_mark(xa, node, i, XA_FREE_MARK);
+    }
+    xas->xa_node = node;
+    xas->xa_offset = slot;
+    if (xa_shrink(xa))
+        xas_reset(xas);
+    return curr;
+}
+
+/*
+ * Store entry over the range xas describes, with xa_lock held, and return
+ * the entry that was at its start. Storing NULL erases every entry in the
+ * range. If a node cannot be allocated without sleeping, xas is left in
+ * an error state for xas_nomem() to deal with.
+ */
+void *xas_store(struct xa_state *xas, void *entry)
+{
+    unsigned long index, last;
+    void *curr;
+
+    if (xas_error(xas))
+        return NULL;
+    if (entry)
+        return __xas_store(xas, entry);
+
+    index = xas->xa_index;
+    last = index + (((unsigned long)xas->xa_sibs + 1) << xas->xa_shift) - 1;
+    curr = __xa_erase(xas->xa, index);
+    while (last != index && xa_find(xas->xa, &index, last, XA_PRESENT))
+        __xa_erase(xas->xa, index);
+    xas_reset(xas);
+    return curr;
+}
+
+/*
+ * Store entry over the aligned range of 1 << order indices holding index,
+ * growing the tree as needed, and return the entry that was at the start
+ * of the range. Storing NULL erases every entry in the range. On failure
+ * an error entry is returned; check it with xa_err().
+ */
+void *xa_store_order(struct xarray *xa, unsigned long index, unsigned int order,
+                     void *entry, gfp_t gfp)
+{
+    void *curr;
+
+    if (order >= BITS_PER_LONG || xa_is_internal(entry))
+        return xa_mk_err(EINVAL);
+
+    XA_STATE_ORDER(xas, xa, index, order);
+    do {
+        xas_lock(&xas);
+        curr = xas_store(&xas, entry);
+        xas_unlock(&xas);
+    } while (xas_nomem(&xas, gfp));
+    return xas_result(&xas, curr);
+}
+
+/*
+ * Store entry at index, growing the tree as needed, and return the entry
+ * that was there. Storing NULL erases. On failure an error entry is
+ * returned; check it with xa_err().
+ */
+void *xa_store(struct xarray *xa, unsigned long index, void *entry, gfp_t gfp)
+{
+    return xa_store_order(xa, index, 0, entry, gfp);
+}
+
+/*
+ * Store entry at every index from first to last, as the fewest aligned
+ * multi-index entries that tile the range. Storing NULL erases the range.
+ * Returns NULL, or an error entry.
+ */
+void *xa_store_range(struct xarray *xa, unsigned long first, unsigned long last,
+                     void *entry, gfp_t gfp)
+{
+    XA_STATE(xas, xa, 0);
+    unsigned int order;
+    bool done = false;
+
+    if (xa_is_internal(entry) || first > last)
+        return xa_mk_err(EINVAL);
+
+    do {
+        xas_lock(&xas);
+        while (!done && !xas_error(&xas)) {
+            order = first ? __builtin_ctzl(first) : BITS_PER_LONG - 1;
+            while (last - first < (1UL << order) - 1)
+                order--;
+            xas_set_order(&xas, first, order);
+            xas_store(&xas, entry);
+            if (xas_error(&xas))
+                break;
+            done = last - first == (1UL << order) - 1;
+            first += 1UL << order;
+        }
+        xas_unlock(&xas);
+    } while (xas_nomem(&xas, gfp));
+    return xas_result(&xas, NULL);
+}
+
+/*
+ * Find the lowest free index between min and max in an allocating array;
+ * xa_lock held. Follows XA_FREE_MARK down from the root, and treats any
+ * index beyond the top of the tree as free. Returns false if there is
+ * none.
+ */
+static bool xa_find_free(struct xarray *xa, unsigned long min, unsigned long max,
+                         unsigned long *indexp)
+{
+    unsigned long index = min, span;
+    unsigned int offset, start;
+    struct xa_node *node;
+    void *head;
+
+restart:
+    head = xa->xa_head;
+    if (!xa_is_node(head)) {
+        if (index == 0 && head)
+            index = 1;
+        goto found;
+    }
+    if (index > xa_max_index(head))
+        goto found;
+    if (!xa_marked(xa, XA_FREE_MARK)) {
+        index = xa_max_index(head) + 1;
+        if (!index)
+            return false;
+        goto found;
+    }
+
+    node = xa_to_node(head);
+    for (;;) {
+        start = (index >> node->shift) & XA_CHUNK_MASK;
+        offset = node_find_mark(node, start, XA_FREE_MARK);
+        if (offset == XA_CHUNK_SIZE) {
+            // Full from index on: carry on from the start of the next node
+            span = node->shift + XA_CHUNK_SHIFT;
+            if (span >= BITS_PER_LONG)
+                return false;
+            index = ((index >> span) + 1) << span;
+            if (!index || index > max)
+                return false;
+            goto restart;
+        }
+        if (offset != start)
+            index = (index & ~((XA_CHUNK_SIZE << node->shift) - 1)) |
+                    ((unsigned long)offset << node->shift);
+        if (!xa_is_node(node->slots[offset]))
+            break;
+        node = xa_to_node(node->slots[offset]);
+    }
+found:
+    if (index > max)
+        return false;
+    *indexp = index;
+    return true;
+}
+
+/*
+ * Store entry at the lowest free index in limit; xa_lock held, and
+ * dropped to allocate if a node cannot be had without sleeping.
+ */
+static int __xa_alloc(struct xarray *xa, u32 *id, void *entry,
+                      struct xa_limit limit, gfp_t gfp)
+{
+    XA_STATE(xas, xa, 0);
+    unsigned long index;
+    bool retry;
+
+    for (;;) {
+        if (!xa_find_free(xa, limit.min, limit.max, &index)) {
+            xas_destroy(&xas);
+            return -EBUSY;
+        }
+        xas_set(&xas, index);
+        xas_store(&xas, entry);
+        if (!xas_error(&xas))
+            break;
+        spin_unlock(&xa->xa_lock);
+        retry = xas_nomem(&xas, gfp);
+        spin_lock(&xa->xa_lock);
+        if (!retry)
+            return xas_error(&xas);
+    }
+    xas_destroy(&xas);
+    *id = index;
+    return 0;
+}
+
+/*
+ * Allocate the lowest free ID in limit for entry and store it in *id.
+ * The array must have been set up with XA_FLAGS_ALLOC. Returns 0,
+ * -EBUSY if limit is full, -ENOMEM, or -EINVAL. Reserving an ID with a
+ * NULL entry is not supported here.
+ */
+int xa_alloc(struct xarray *xa, u32 *id, void *entry, struct xa_limit limit,
+             gfp_t gfp)
+{
+    int ret;
+
+    if (!xa_track_free(xa) || !entry || xa_is_internal(entry))
+        return -EINVAL;
+
+    spin_lock(&xa->xa_lock);
+    ret = __xa_alloc(xa, id, entry, limit, gfp);
+    spin_unlock(&xa->xa_lock);
+    return ret;
+}
+
+/*
+ * As xa_alloc(), but search from *next first and wrap around to
+ * limit.min, so a freed ID is not handed out again straight away. *next
+ * is moved past the new ID. Returns 1 if the allocation wrapped, 0 if it
+ * did not, or a negative errno.
+ */
+int xa_alloc_cyclic(struct xarray *xa, u32 *id, void *entry, struct xa_limit limit,
+                    u32 *next, gfp_t gfp)
+{
+    u32 min = limit.min;
+    int ret;
+
+    if (!xa_track_free(xa) || !entry || xa_is_internal(entry))
+        return -EINVAL;
+
+    spin_lock(&xa->xa_lock);
+    limit.min = *next > min ? *next : min;
+    ret = __xa_alloc(xa, id, entry, limit, gfp);
+    if ((xa->xa_flags & XA_FLAGS_ALLOC_WRAPPED) && ret == 0) {
+        __atomic_fetch_and(&xa->xa_flags, ~XA_FLAGS_ALLOC_WRAPPED, __ATOMIC_RELAXED);
+        ret = 1;
+    }
+    if (ret == -EBUSY && limit.min > min) {
+        limit.min = min;
+        ret = __xa_alloc(xa, id, entry, limit, gfp);
+        if (ret == 0)
+            ret = 1;
+    }
+    if (ret >= 0) {
+        *next = *id + 1;
+        if (*next == 0)
+            __atomic_fetch_or(&xa->xa_flags, XA_FLAGS_ALLOC_WRAPPED, __ATOMIC_RELAXED);
+    }
+    spin_unlock(&xa->xa_lock);
+    return ret;
+}
+
+static void xa_destroy_node(struct xa_node *node)
+{
+    for (unsigned int i = 0; node->shift && i < XA_CHUNK_SIZE; i++) {
+        if (xa_is_node(node->slots[i]))
+            xa_destroy_node(xa_to_node(node->slots[i]));
+    }
+    xa_node_free(node);
+}
+
+// Free every node; the entries themselves belong to the caller
+void xa_destroy(struct xarray *xa)
+{
+    void *head;
+
+    spin_lock(&xa->xa_lock);
+    head = xa->xa_head;
+    WRITE_ONCE(xa->xa_head, NULL);
+    xa_init_root_marks(xa);
+    if (xa_is_node(head))
+        xa_destroy_node(xa_to_node(head));
+    spin_unlock(&xa->xa_lock);
+}
+
+static unsigned int xa_height(struct xarray *xa)
+{
+    void *head = xa->xa_head;
+
+    return xa_is_node(head) ? xa_to_node(head)->shift / XA_CHUNK_SHIFT + 1 : 0;
+}
+
+// Sparse 64-bit indices: the tree grows for each and shrinks back to empty
+static int test_sparse_indices(void)
+{
+    static const unsigned long indices[] = {
+        0, 1, 63, 64, 4095, 4096, 1UL << 20, 1UL << 40, (1UL << 40) + 7, ~0UL,
+    };
+    const int n = sizeof(indices) / sizeof(indices[0]);
+    struct xarray xa;
+    int i, failures = 0;
+
+    printf("\nSparse indices:\n");
+    xa_init(&xa);
+    for (i = 0; i < n; i++) {
+        if (xa_store(&xa, indices[i], xa_mk_value(i), GFP_KERNEL) != NULL)
+            failures++;
+        printf("Stored index %#lx, height now %u\n", indices[i], xa_height(&xa));
+    }
+    for (i = 0; i < n; i++)
+        failures += xa_load(&xa, indices[i]) != xa_mk_value(i);
+    failures += xa_load(&xa, 2) != NULL || xa_load(&xa, 1UL << 39) != NULL;
+    failures += xa_store(&xa, 64, xa_mk_value(99), GFP_KERNEL) != xa_mk_value(3);
+
+    // Erasing from the top shrinks the tree level by level
+    for (i = n - 1; i >= 0; i--) {
+        if (xa_erase(&xa, indices[i]) == NULL)
+            failures++;
+        if (i == 5 && xa_height(&xa) != 2)
+            failures++;
+        if (i == 3 && xa_height(&xa) != 1)
+            failures++;
+        if (i == 1 && (xa_height(&xa) != 0 || xa_load(&xa, 0) != xa_mk_value(0)))
+            failures++;
+    }
+    rcu_barrier();
+    failures += xa.xa_head != NULL || nr_xa_nodes != 0;
+    failures += xa_erase(&xa, 5) != NULL;
+
+    printf("sparse store/load/erase: %s\n", failures ? "FAIL" : "PASS");
+    return failures;
+}
+
+#define RANDOM_OPS 200000
+#define RANDOM_SLOTS 4096
+
+// Random stores and erases checked against a flat shadow array
+static int test_random_ops(void)
+{
+    static unsigned long index_of[RANDOM_SLOTS];
+    static bool present[RANDOM_SLOTS];
+    struct xarray xa;
+    int i, failures = 0;
+
+    xa_init(&xa);
+    srand(1);
+    for (i = 0; i < RANDOM_SLOTS; i++) {
+        // A mix of dense low indices and sparse indices across 64 bits
+        index_of[i] = i % 2 ? (unsigned long)i :
+                      ((unsigned long)rand() << 33) ^ ((unsigned long)rand() << 2) ^ i;
+    }
+
+    for (i = 0; i < RANDOM_OPS; i++) {
+        int n = rand() % RANDOM_SLOTS;
+        void *old;
+
+        if (rand() % 3) {
+            old = xa_store(&xa, index_of[n], xa_mk_value(n), GFP_KERNEL);
+            failures += old != (present[n] ? xa_mk_value(n) : NULL);
+            present[n] = true;
+        } else {
+            old = xa_erase(&xa, index_of[n]);
+            failures += old != (present[n] ? xa_mk_value(n) : NULL);
+            present[n] = false;
+        }
+    }
+    for (i = 0; i < RANDOM_SLOTS; i++)
+        failures += xa_load(&xa, index_of[i]) != (present[i] ? xa_mk_value(i) : NULL);
+
+    for (i = 0; i < RANDOM_SLOTS; i++)
+        xa_erase(&xa, index_of[i]);
+    rcu_barrier();
+    failures += xa.xa_head != NULL || nr_xa_nodes != 0;
+
+    printf("random store/erase against a shadow array: %s\n", failures ? "FAIL" : "PASS");
+    xa_destroy(&xa);
+    return failures;
+}
+
+// Walk every entry with xa_for_each and compare against the stored set
+static int test_iteration(void)
+{
+    static const unsigned long indices[] = {
+        0, 5, 63, 64, 200, 4095, 4097, 1UL << 30, (1UL << 30) + 1, ~0UL - 1, ~0UL,
+    };
+    const int n = sizeof(indices) / sizeof(indices[0]);
+    unsigned long index;
+    struct xarray xa;
+    void *entry;
+    int i = 0, failures = 0;
+
+    xa_init(&xa);
+    xa_for_each(&xa, index, entry)
+        failures++;
+    for (i = 0; i < n; i++)
+        xa_store(&xa, indices[i], xa_mk_value(i), GFP_KERNEL);
+
+    i = 0;
+    xa_for_each(&xa, index, entry) {
+        if (i >= n || index != indices[i] || entry != xa_mk_value(i))
+            failures++;
+        i++;
+    }
+    failures += i != n;
+
+    // A range starting mid-node and ending before the last entry
+    i = 2;
+    xa_for_each_range(&xa, index, entry, 6, 1UL << 30) {
+        if (index != indices[i] || entry != xa_mk_value(i))
+            failures++;
+        i++;
+    }
+    failures += i != 8;
+
+    index = 4096;
+    failures += xa_find(&xa, &index, 4096, XA_PRESENT) != NULL || index != 4096;
+    index = 4096;
+    failures += xa_find_after(&xa, &index, ~0UL, XA_PRESENT) != xa_mk_value(6) || index != 4097;
+
+    xa_destroy(&xa);
+    rcu_barrier();
+    failures += nr_xa_nodes != 0;
+    printf("xa_for_each and xa_find: %s\n", failures ? "FAIL" : "PASS");
+    return failures;
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Every mark bit on an internal slot must match its child having the
+ * mark. Free slots carry only XA_FREE_MARK, and only if free is tracked.
+ */
+static int xa_check_marks(struct xa_node *node, bool track_free)
+{
+    int failures = 0;
+
+    for (unsigned int i = 0; i < XA_CHUNK_SIZE; i++) {
+        void *entry = node->slots[i];
+
+        for (xa_mark_t mark = XA_MARK_0; mark <= XA_MARK_MAX; mark++) {
+            if (xa_is_node(entry))
+                failures += node_get_mark(node, i, mark) !=
+                            node_any_mark(xa_to_node(entry), mark);
+            else if (mark == XA_FREE_MARK && track_free)
+                failures += node_get_mark(node, i, mark) != !entry;
+            else if (!entry || xa_is_sibling(entry))
+                failures += node_get_mark(node, i, mark);
+        }
+        if (xa_is_node(entry))
+            failures += xa_check_marks(xa_to_node(entry), track_free);
+    }
+    return failures;
+}
+
+static int xa_marks_valid(struct xarray *xa)
+{
+    bool track_free = xa_track_free(xa);
+    void *head = xa->xa_head;
+    int failures = 0;
+
+    if (!xa_is_node(head)) {
+        for (xa_mark_t mark = XA_MARK_0; mark <= XA_MARK_MAX; mark++) {
+            if (mark == XA_FREE_MARK && track_free)
+                failures += xa_marked(xa, mark) != !head;
+            else
+                failures += !head && xa_marked(xa, mark);
+        }
+        return failures;
+    }
+    for (xa_mark_t mark = XA_MARK_0; mark <= XA_MARK_MAX; mark++)
+        failures += xa_marked(xa, mark) != node_any_mark(xa_to_node(head), mark);
+    return failures + xa_check_marks(xa_to_node(head), track_free);
+}
+
+#define MARK_SLOTS 2048
+
+/*
+ * Random mark changes and erases checked against shadow bitmaps, with the
+ * propagated bits checked after every batch. Also checks that marks ride
+ * along when the tree grows above, and shrinks back into, the head.
+ */
+static int test_marks(void)
+{
+    static bool present[MARK_SLOTS], marked[MARK_SLOTS][XA_MAX_MARKS];
+    unsigned long index;
+    struct xarray xa;
+    void *entry;
+    int i, n, failures = 0;
+    xa_mark_t mark;
+
+    xa_init(&xa);
+    xa_store(&xa, 0, xa_mk_value(0), GFP_KERNEL);
+    xa_set_mark(&xa, 0, XA_MARK_1);
+    xa_set_mark(&xa, 1, XA_MARK_1);         // no entry: ignored
+    failures += !xa_get_mark(&xa, 0, XA_MARK_1) || xa_get_mark(&xa, 0, XA_MARK_0);
+    xa_store(&xa, 1UL << 40, xa_mk_value(1), GFP_KERNEL);
+    failures += !xa_get_mark(&xa, 0, XA_MARK_1) || xa_get_mark(&xa, 1UL << 40, XA_MARK_1);
+    failures += xa_marks_valid(&xa);
+    xa_erase(&xa, 1UL << 40);
+    failures += xa_height(&xa) != 0 || !xa_get_mark(&xa, 0, XA_MARK_1);
+    index = 0;
+    failures += xa_find(&xa, &index, ~0UL, XA_MARK_1) != xa_mk_value(0);
+    xa_erase(&xa, 0);
+    failures += xa_marked(&xa, XA_MARK_1);
+
+    srand(3);
+    for (i = 0; i < MARK_SLOTS; i++) {
+        present[i] = true;
+        xa_store(&xa, (unsigned long)i * 37, xa_mk_value(i), GFP_KERNEL);
+    }
+    for (i = 0; i < 100000; i++) {
+        n = rand() % MARK_SLOTS;
+        mark = (xa_mark_t)(rand() % XA_MAX_MARKS);
+        switch (rand() % 8) {
+        case 0:
+            xa_erase(&xa, (unsigned long)n * 37);
+            present[n] = false;
+            memset(marked[n], 0, sizeof(marked[n]));
+            break;
+        case 1:
+            xa_store(&xa, (unsigned long)n * 37, xa_mk_value(n), GFP_KERNEL);
+            present[n] = true;
+            break;
+        case 2: case 3: case 4:
+            xa_set_mark(&xa, (unsigned long)n * 37, mark);
+            marked[n][mark] = present[n];
+            break;
+        default:
+            xa_clear_mark(&xa, (unsigned long)n * 37, mark);
+            marked[n][mark] = false;
+            break;
+        }
+        if (i % 10000 == 0)
+            failures += xa_marks_valid(&xa);
+    }
+    failures += xa_marks_valid(&xa);
+
+    for (n = 0; n < MARK_SLOTS; n++) {
+        for (mark = XA_MARK_0; mark <= XA_MARK_MAX; mark++)
+            failures += xa_get_mark(&xa, (unsigned long)n * 37, mark) != marked[n][mark];
+    }
+    for (mark = XA_MARK_0; mark <= XA_MARK_MAX; mark++) {
+        n = 0;
+        xa_for_each_marked(&xa, index, entry, mark) {
+            while (n < MARK_SLOTS && !marked[n][mark])
+                n++;
+            if (n == MARK_SLOTS || index != (unsigned long)n * 37 ||
+                entry != xa_mk_value(n))
+                failures++;
+            n++;
+        }
+        while (n < MARK_SLOTS && !marked[n][mark])
+            n++;
+        failures += n != MARK_SLOTS;
+    }
+
+    // Erasing everything leaves no marks behind
+    for (n = 0; n < MARK_SLOTS; n++)
+        xa_erase(&xa, (unsigned long)n * 37);
+    for (mark = XA_MARK_0; mark <= XA_MARK_MAX; mark++)
+        failures += xa_marked(&xa, mark);
+    rcu_barrier();
+    failures += nr_xa_nodes != 0;
+
+    printf("marks against shadow bitmaps: %s\n", failures ? "FAIL" : "PASS");
+    return failures;
+}
+
+#define MULTI_SPACE 4096
+#define MULTI_OPS 20000
+
+/*
+ * Multi-index entries: one entry answers for its whole range, a store
+ * over part of a larger entry replaces it, and iteration sees each entry
+ * once. Random stores of mixed orders are then checked against a shadow
+ * array of owners.
+ */
+static int test_multi_index(void)
+{
+    static unsigned long first[MULTI_SPACE], order_of[MULTI_SPACE];
+    static bool used[MULTI_SPACE];
+    unsigned long index, nodes;
+    struct xarray xa;
+    void *entry;
+    int i, failures = 0;
+
+    xa_init(&xa);
+
+    // A 2 MiB folio of 4 KiB pages: order 9 takes 8 slots in one node
+    failures += xa_store_order(&xa, 3 << 9, 9, xa_mk_value(9), GFP_KERNEL) != NULL;
+    nodes = nr_xa_nodes;
+    for (index = 3 << 9; index < 4 << 9; index++)
+        failures += xa_load(&xa, index) != xa_mk_value(9);
+    failures += xa_load(&xa, (3 << 9) - 1) != NULL || xa_load(&xa, 4 << 9) != NULL;
+    printf("order-9 entry uses %lu node(s), %lu as 512 single entries\n",
+           nodes, 1 + 512 / XA_CHUNK_SIZE);
+
+    xa_set_mark(&xa, (3 << 9) + 100, XA_MARK_0);
+    failures += !xa_get_mark(&xa, 3 << 9, XA_MARK_0) ||
+                !xa_get_mark(&xa, (4 << 9) - 1, XA_MARK_0);
+    i = 0;
+    xa_for_each_marked(&xa, index, entry, XA_MARK_0)
+        failures += index != 3 << 9 || i++;
+
+    // Same range: replaced in place, marks kept
+    failures += xa_store_order(&xa, (3 << 9) + 7, 9, xa_mk_value(10), GFP_KERNEL) != xa_mk_value(9);
+    failures += xa_load(&xa, (4 << 9) - 1) != xa_mk_value(10) ||
+                !xa_get_mark(&xa, 3 << 9, XA_MARK_0);
+
+    // Part of it: the whole order-9 entry goes
+    failures += xa_store(&xa, (3 << 9) + 5, xa_mk_value(5), GFP_KERNEL) != xa_mk_value(10);
+    failures += xa_load(&xa, 3 << 9) != NULL || xa_load(&xa, (3 << 9) + 6) != NULL;
+    failures += xa_load(&xa, (3 << 9) + 5) != xa_mk_value(5) || xa_marked(&xa, XA_MARK_0);
+
+    // And a larger store swallows the small entries beneath it
+    xa_store(&xa, (3 << 9) + 200, xa_mk_value(200), GFP_KERNEL);
+    failures += xa_store_order(&xa, 3 << 9, 12, xa_mk_value(12), GFP_KERNEL) != NULL;
+    failures += xa_load(&xa, (3 << 9) + 200) != xa_mk_value(12) ||
+                xa_load(&xa, 0) != xa_mk_value(12) || xa_load(&xa, 4095) != xa_mk_value(12);
+
+    // Iteration sees each entry once, at its first index
+    xa_store_order(&xa, 4096 + 16, 4, xa_mk_value(4), GFP_KERNEL);
+    xa_store_order(&xa, 4096 + 128, 7, xa_mk_value(7), GFP_KERNEL);
+    i = 0;
+    xa_for_each(&xa, index, entry) {
+        static const unsigned long want[] = { 0, 4096 + 16, 4096 + 128 };
+
+        failures += i >= 3 || index != want[i];
+        i++;
+    }
+    failures += i != 3;
+    index = 4096 + 20;
+    failures += xa_find(&xa, &index, ~0UL, XA_PRESENT) != xa_mk_value(4) || index != 4096 + 20;
+    failures += xa_find_after(&xa, &index, ~0UL, XA_PRESENT) != xa_mk_value(7) ||
+                index != 4096 + 128;
+
+    // Erasing any index of an entry erases all of it
+    failures += xa_erase(&xa, 4096 + 255) != xa_mk_value(7) || xa_load(&xa, 4096 + 128) != NULL;
+    failures += xa_store_order(&xa, 0, 13, NULL, GFP_KERNEL) != xa_mk_value(12);
+    failures += xa.xa_head != NULL;
+    failures += xa_err(xa_store_order(&xa, 0, BITS_PER_LONG, xa_mk_value(0), GFP_KERNEL)) != -EINVAL;
+
+    srand(7);
+    for (i = 0; i < MULTI_OPS; i++) {
+        unsigned int order = rand() % 10;
+        unsigned long size = 1UL << order;
+        unsigned long start = (rand() % MULTI_SPACE) & ~(size - 1);
+
+        if (rand() % 4 == 0) {
+            xa_store_order(&xa, start, order, NULL, GFP_KERNEL);
+        } else {
+            xa_store_order(&xa, start, order, xa_mk_value(start), GFP_KERNEL);
+        }
+        // Drop every shadow entry overlapping the range, then add the new one
+        for (index = start; index < start + size; index++) {
+            if (used[index]) {
+                unsigned long f = first[index], end = f + (1UL << order_of[index]);
+
+                for (unsigned long j = f; j < end; j++)
+                    used[j] = false;
+            }
+        }
+        if (xa_load(&xa, start)) {
+            for (index = start; index < start + size; index++) {
+                used[index] = true;
+                first[index] = start;
+                order_of[index] = order;
+            }
+        }
+        if (i % 1000 == 0)
+            failures += xa_marks_valid(&xa);
+    }
+    for (index = 0; index < MULTI_SPACE; index++)
+        failures += xa_load(&xa, index) != (used[index] ? xa_mk_value(first[index]) : NULL);
+    index = 0;
+    xa_for_each(&xa, index, entry) {
+        failures += !used[index] || first[index] != index;
+    }
+
+    xa_destroy(&xa);
+    rcu_barrier();
+    failures += nr_xa_nodes != 0;
+    printf("multi-index entries: %s\n", failures ? "FAIL" : "PASS");
+    return failures;
+}
+
+#define XAS_WALK_ENTRIES 5000
+
+// Fill [0, n) through one xa_state, retrying from where it stopped on ENOMEM
+static void xas_fill(struct xarray *xa, unsigned long n)
+{
+    XA_STATE(xas, xa, 0);
+
+    do {
+        xas_lock(&xas);
+        while (xas.xa_index < n) {
+            xas_store(&xas, xa_mk_value(xas.xa_index));
+            if (xas_error(&xas))
+                break;
+            xas_next(&xas);
+        }
+        xas_unlock(&xas);
+    } while (xas_nomem(&xas, GFP_KERNEL));
+}
+
+/*
+ * The advanced API: walking with xas_next()/xas_prev(), filling through
+ * one xa_state with allocations failing under the lock, xas_nomem()
+ * retries, and xa_store_range().
+ */
+static int test_xas(void)
+{
+    XA_STATE(xas, NULL, 0);
+    unsigned long index, n;
+    struct xarray xa;
+    void *entry;
+    int failures = 0;
+
+    xa_init(&xa);
+    xas.xa = &xa;
+
+    // Sparse entries, walked both ways across node boundaries
+    for (index = 0; index < XAS_WALK_ENTRIES; index += 7)
+        xa_store(&xa, index, xa_mk_value(index), GFP_KERNEL);
+    xa_store(&xa, 1UL << 30, xa_mk_value(1), GFP_KERNEL);
+    rcu_read_lock();
+    xas_set(&xas, 0);
+    entry = xas_load(&xas);
+    for (index = 0; index <= XAS_WALK_ENTRIES; index++) {
+        failures += xas.xa_index != index || entry != xa_load(&xa, index);
+        entry = xas_next(&xas);
+    }
+    xas_set(&xas, (1UL << 30) + 2);
+    for (index = (1UL << 30) + 2; index >= (1UL << 30) - 2; index--) {
+        entry = index == (1UL << 30) + 2 ? xas_load(&xas) : xas_prev(&xas);
+        failures += xas.xa_index != index || entry != xa_load(&xa, index);
+    }
+    xas_set(&xas, XAS_WALK_ENTRIES);
+    entry = xas_load(&xas);
+    for (index = XAS_WALK_ENTRIES; index > 0; index--)
+        failures += xas_prev(&xas) != xa_load(&xa, index - 1);
+    rcu_read_unlock();
+    xa_destroy(&xa);
+
+    // An allocation that fails under the lock is retried after xas_nomem()
+    xa_nowait_fail = 1;
+    xas_set(&xas, 1UL << 20);
+    xas_lock(&xas);
+    failures += xas_store(&xas, xa_mk_value(7)) != NULL || xas_error(&xas) != -ENOMEM;
+    xas_unlock(&xas);
+    failures += !xas_nomem(&xas, GFP_KERNEL) || xas_error(&xas);
+    xas_lock(&xas);
+    xas_store(&xas, xa_mk_value(7));
+    xas_unlock(&xas);
+    failures += xas_nomem(&xas, GFP_KERNEL) || xa_load(&xa, 1UL << 20) != xa_mk_value(7);
+    xa_erase(&xa, 1UL << 20);
+
+    for (n = 0; n < 40; n++) {
+        xa_nowait_fail = n % 3;
+        xa_store(&xa, n << (n % 50), xa_mk_value(n), GFP_KERNEL);
+    }
+    for (n = 0; n < 40; n++)
+        failures += xa_load(&xa, n << (n % 50)) != xa_mk_value(n);
+    xa_destroy(&xa);
+
+    // Splitting a larger entry must not lose it if the path down cannot be built
+    xa_store_order(&xa, 0, 12, xa_mk_value(12), GFP_KERNEL);
+    xa_nowait_fail = 1;
+    xas_set(&xas, 5);
+    xas_lock(&xas);
+    failures += xas_store(&xas, xa_mk_value(5)) != NULL || xas_error(&xas) != -ENOMEM;
+    xas_unlock(&xas);
+    failures += xa_load(&xa, 5) != xa_mk_value(12) || xa_load(&xa, 4095) != xa_mk_value(12);
+    xas_destroy(&xas);
+    xa_nowait_fail = 2;
+    failures += xa_store(&xa, 5, xa_mk_value(5), GFP_KERNEL) != xa_mk_value(12);
+    failures += xa_load(&xa, 5) != xa_mk_value(5) || xa_load(&xa, 4) != NULL;
+    xa_destroy(&xa);
+
+    xa_nowait_fail = 5;
+    xas_fill(&xa, 100000);
+    for (index = 0; index < 100000; index++)
+        failures += xa_load(&xa, index) != xa_mk_value(index);
+    failures += xa_load(&xa, 100000) != NULL;
+    xa_destroy(&xa);
+
+    // A range becomes a handful of aligned multi-index entries
+    failures += xa_store_range(&xa, 5, 1000, xa_mk_value(5), GFP_KERNEL) != NULL;
+    failures += xa_load(&xa, 4) != NULL || xa_load(&xa, 1001) != NULL;
+    for (index = 5; index <= 1000; index++)
+        failures += xa_load(&xa, index) != xa_mk_value(5);
+    n = 0;
+    xa_for_each(&xa, index, entry)
+        n++;
+    failures += n != 14;        // 5, 6-7, 8-15, ... 960-991, 992-999, 1000
+    failures += xa_store_range(&xa, 128, 255, NULL, GFP_KERNEL) != NULL;
+    failures += xa_load(&xa, 127) != xa_mk_value(5) || xa_load(&xa, 128) != NULL ||
+                xa_load(&xa, 255) != NULL || xa_load(&xa, 256) != xa_mk_value(5);
+    failures += xa_store_range(&xa, ~0UL - 70, ~0UL, xa_mk_value(6), GFP_KERNEL) != NULL;
+    failures += xa_load(&xa, ~0UL) != xa_mk_value(6) || xa_load(&xa, ~0UL - 71) != NULL;
+    failures += xa_err(xa_store_range(&xa, 9, 8, xa_mk_value(0), GFP_KERNEL)) != -EINVAL;
+    xa_destroy(&xa);
+
+    rcu_barrier();
+    failures += nr_xa_nodes != 0 || xa_nowait_fail != 0;
+    printf("xas walk, xas_nomem and xa_store_range: %s\n", failures ? "FAIL" : "PASS");
+    return failures;
+}
+
+#define ALLOC_IDS 4096
+#define ALLOC_OPS 100000
+
+/*
+ * xa_alloc() hands out the lowest free ID in the limit, checked against
+ * a shadow bitmap through random allocations and frees; then limits at
+ * the top of the 32-bit range, and xa_alloc_cyclic() wrapping.
+ */
+static int test_alloc(void)
+{
+    static bool used[ALLOC_IDS];
+    struct xarray xa;
+    u32 id, next = 0, lowest;
+    int i, ret, failures = 0;
+
+    xa_init(&xa);
+    failures += xa_alloc(&xa, &id, xa_mk_value(0), xa_limit_32b, GFP_KERNEL) != -EINVAL;
+
+    xa_init_flags(&xa, XA_FLAGS_ALLOC);
+    failures += xa_alloc(&xa, &id, NULL, xa_limit_32b, GFP_KERNEL) != -EINVAL;
+    srand(11);
+    for (i = 0; i < ALLOC_OPS; i++) {
+        u32 n = rand() % ALLOC_IDS;
+
+        if (rand() % 3 == 0 && used[n]) {
+            failures += xa_erase(&xa, n) != xa_mk_value(n);
+            used[n] = false;
+            continue;
+        }
+        for (lowest = 0; lowest < ALLOC_IDS && used[lowest]; lowest++)
+            ;
+        if (i % 7 == 0)
+            xa_nowait_fail = 1;
+        ret = xa_alloc(&xa, &id, xa_mk_value(lowest), XA_LIMIT(0, ALLOC_IDS - 1), GFP_KERNEL);
+        if (lowest == ALLOC_IDS) {
+            failures += ret != -EBUSY;
+            continue;
+        }
+        failures += ret != 0 || id != lowest;
+        used[lowest] = true;
+        if (i % 5000 == 0)
+            failures += xa_marks_valid(&xa);
+    }
+    xa_nowait_fail = 0;
+    failures += xa_marks_valid(&xa);
+    for (i = 0; i < ALLOC_IDS; i++)
+        failures += xa_load(&xa, i) != (used[i] ? xa_mk_value(i) : NULL);
+    xa_destroy(&xa);
+    failures += xa_marks_valid(&xa);
+
+    // A small limit fills up; one freed ID is found again
+    for (i = 10; i <= 20; i++)
+        failures += xa_alloc(&xa, &id, xa_mk_value(i), XA_LIMIT(10, 20), GFP_KERNEL) || id != (u32)i;
+    failures += xa_alloc(&xa, &id, xa_mk_value(0), XA_LIMIT(10, 20), GFP_KERNEL) != -EBUSY;
+    xa_erase(&xa, 15);
+    failures += xa_alloc(&xa, &id, xa_mk_value(15), XA_LIMIT(10, 20), GFP_KERNEL) || id != 15;
+    failures += xa_alloc(&xa, &id, xa_mk_value(0), XA_LIMIT(0, 100), GFP_KERNEL) || id != 0;
+    xa_destroy(&xa);
+
+    // The top of the 32-bit range
+    for (i = 0; i < 3; i++) {
+        failures += xa_alloc(&xa, &id, xa_mk_value(i), XA_LIMIT(UINT32_MAX - 2, UINT32_MAX),
+                             GFP_KERNEL) || id != UINT32_MAX - 2 + (u32)i;
+    }
+    failures += xa_alloc(&xa, &id, xa_mk_value(0), XA_LIMIT(UINT32_MAX - 2, UINT32_MAX),
+                         GFP_KERNEL) != -EBUSY;
+    failures += xa_marks_valid(&xa);
+    xa_destroy(&xa);
+
+    // Cyclic: carries on past freed IDs, then wraps back to them
+    for (i = 1; i <= 8; i++)
+        failures += xa_alloc_cyclic(&xa, &id, xa_mk_value(i), XA_LIMIT(1, 8), &next, GFP_KERNEL) ||
+                    id != (u32)i;
+    xa_erase(&xa, 3);
+    xa_erase(&xa, 6);
+    failures += xa_alloc_cyclic(&xa, &id, xa_mk_value(3), XA_LIMIT(1, 8), &next, GFP_KERNEL) != 1 ||
+                id != 3 || next != 4;
+    failures += xa_alloc_cyclic(&xa, &id, xa_mk_value(6), XA_LIMIT(1, 8), &next, GFP_KERNEL) != 0 ||
+                id != 6;
+    failures += xa_alloc_cyclic(&xa, &id, xa_mk_value(0), XA_LIMIT(1, 8), &next, GFP_KERNEL) != -EBUSY;
+    xa_destroy(&xa);
+
+    next = UINT32_MAX;
+    failures += xa_alloc_cyclic(&xa, &id, xa_mk_value(0), xa_limit_32b, &next, GFP_KERNEL) != 0 ||
+                id != UINT32_MAX || next != 0;
+    failures += xa_alloc_cyclic(&xa, &id, xa_mk_value(0), xa_limit_32b, &next, GFP_KERNEL) != 1 ||
+                id != 0;
+    xa_destroy(&xa);
+
+    // Running out of memory past *next is not a reason to wrap
+    for (i = 1; i <= 3; i++)
+        failures += xa_alloc_cyclic(&xa, &id, xa_mk_value(i), XA_LIMIT(1, 2000), &next, GFP_KERNEL) < 0;
+    next = 1000;
+    xa_nowait_fail = 2;
+    failures += xa_alloc_cyclic(&xa, &id, xa_mk_value(4), XA_LIMIT(1, 2000), &next, GFP_NOWAIT) != -ENOMEM ||
+                next != 1000 || xa_load(&xa, 4) != NULL;
+    xa_nowait_fail = 0;
+    xa_destroy(&xa);
+
+    rcu_barrier();
+    failures += nr_xa_nodes != 0;
+    printf("xa_alloc and xa_alloc_cyclic: %s\n", failures ? "FAIL" : "PASS");
+    return failures;
+}
+
+#define ALLOC_BENCH_LIVE 10000
+#define ALLOC_BENCH_OPS 1000000
+
+// Steady-state churn of a handle table: free a random live ID, allocate one
+static void bench_alloc(void)
+{
+    static u32 live[ALLOC_BENCH_LIVE];
+    unsigned long long t0;
+    struct xarray xa;
+    u32 id, next = 0;
+    int i;
+
+    xa_init_flags(&xa, XA_FLAGS_ALLOC);
+    for (i = 0; i < ALLOC_BENCH_LIVE; i++)
+        xa_alloc(&xa, &live[i], xa_mk_value(i), xa_limit_32b, GFP_KERNEL);
+
+    srand(13);
+    t0 = now_ns();
+    for (i = 0; i < ALLOC_BENCH_OPS; i++) {
+        int n = rand() % ALLOC_BENCH_LIVE;
+
+        xa_erase(&xa, live[n]);
+        xa_alloc(&xa, &live[n], xa_mk_value(n), xa_limit_32b, GFP_KERNEL);
+    }
+    t0 = now_ns() - t0;
+    printf("xa_alloc with %d live IDs: %llu ns per free + alloc\n",
+           ALLOC_BENCH_LIVE, t0 / ALLOC_BENCH_OPS);
+
+    t0 = now_ns();
+    for (i = 0; i < ALLOC_BENCH_OPS; i++) {
+        int n = rand() % ALLOC_BENCH_LIVE;
+
+        xa_erase(&xa, live[n]);
+        xa_alloc_cyclic(&xa, &id, xa_mk_value(n), xa_limit_32b, &next, GFP_KERNEL);
+        live[n] = id;
+    }
+    t0 = now_ns() - t0;
+    printf("xa_alloc_cyclic with %d live IDs: %llu ns per free + alloc\n",
+           ALLOC_BENCH_LIVE, t0 / ALLOC_BENCH_OPS);
+    xa_destroy(&xa);
+    rcu_barrier();
+}
+
+#define CACHE_THREADS 4
+#define CACHE_THREAD_OPS 50000
+
+// Each thread churns its own array, so nodes move through its magazine
+static void *node_cache_thread(void *arg)
+{
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    struct xarray xa;
+    long failures = 0;
+    int i;
+
+    xa_init(&xa);
+    for (i = 0; i < CACHE_THREAD_OPS; i++) {
+        unsigned long index = (unsigned long)(rand_r(&seed) % 512) << 6;
+
+        if (rand_r(&seed) % 2)
+            xa_store(&xa, index, xa_mk_value(index), GFP_KERNEL);
+        else
+            failures += xa_erase(&xa, index) && xa_load(&xa, index);
+    }
+    xa_destroy(&xa);
+    rcu_barrier();
+    return (void *)failures;
+}
+
+static pthread_barrier_t node_cache_idle;
+
+// As node_cache_thread(), then sit on a full magazine until released
+static void *node_cache_idle_thread(void *arg)
+{
+    void *ret = node_cache_thread(arg);
+
+    pthread_barrier_wait(&node_cache_idle);
+    pthread_barrier_wait(&node_cache_idle);
+    return ret;
+}
+
+/*
+ * Nodes come back from the cache zeroed and are recycled; the accounting
+ * follows the trees; threads hand their cached nodes back on exit; and
+ * the shrinker releases every idle slab once the trees are gone, even
+ * those pinned by the magazine of a thread that is still alive.
+ */
+static int test_node_cache(void)
+{
+    struct xa_node_cache_stats st;
+    pthread_t threads[CACHE_THREADS], idle;
+    struct xarray xa;
+    unsigned long index, slabs;
+    void *ret;
+    int i, failures = 0;
+
+    xa_init(&xa);
+    for (index = 0; index < 100000; index += 3)
+        xa_store(&xa, index, xa_mk_value(index), GFP_KERNEL);
+    xa_node_cache_stats(&st);
+    failures += st.active != nr_xa_nodes || st.active_bytes != st.active * sizeof(struct xa_node);
+    failures += st.slabs * XA_NODES_PER_SLAB < st.active + st.free ||
+                st.slab_bytes != st.slabs * XA_NODE_SLAB_BYTES;
+    printf("%lu nodes (%lu KiB) in %lu slabs of %lu\n", st.active, st.active_bytes / 1024,
+           st.slabs, (unsigned long)XA_NODES_PER_SLAB);
+    slabs = st.slabs;
+
+    // Recycled nodes must be indistinguishable from fresh ones
+    for (index = 0; index < 100000; index += 3)
+        xa_erase(&xa, index);
+    rcu_barrier();
+    for (index = 0; index < 100000; index += 5)
+        xa_store(&xa, index, xa_mk_value(index), GFP_KERNEL);
+    for (index = 0; index < 100000; index++)
+        failures += xa_load(&xa, index) != (index % 5 ? NULL : xa_mk_value(index));
+    failures += xa_marks_valid(&xa);
+    xa_node_cache_stats(&st);
+    failures += st.slabs > slabs;
+    xa_destroy(&xa);
+
+    for (i = 0; i < CACHE_THREADS; i++)
+        pthread_create(&threads[i], NULL, node_cache_thread, (void *)(uintptr_t)(i + 1));
+    for (i = 0; i < CACHE_THREADS; i++) {
+        pthread_join(threads[i], &ret);
+        failures += ret != NULL;
+    }
+    pthread_barrier_init(&node_cache_idle, NULL, 2);
+    pthread_create(&idle, NULL, node_cache_idle_thread, (void *)(uintptr_t)(CACHE_THREADS + 1));
+    pthread_barrier_wait(&node_cache_idle);
+
+    rcu_barrier();
+    xa_node_cache_stats(&st);
+    failures += st.active != 0 || nr_xa_nodes != 0;
+    index = shrink_slab(&xa_node_shrinker, ~0UL);
+    xa_node_cache_stats(&st);
+    failures += st.slabs != 0 || st.free != 0 || index == 0;
+    printf("shrinker released %lu idle nodes\n", index);
+
+    pthread_barrier_wait(&node_cache_idle);
+    pthread_join(idle, &ret);
+    failures += ret != NULL;
+    pthread_barrier_destroy(&node_cache_idle);
+
+    printf("node cache: %s\n", failures ? "FAIL" : "PASS");
+    return failures;
+}
+
+#define NODE_BENCH_OPS 1000000
+#define NODE_BENCH_LIVE 64
+
+// Node alloc/free churn through the cache against calloc()/free()
+static void bench_node_cache(void)
+{
+    static struct xa_node *live[NODE_BENCH_LIVE];
+    unsigned long long t0, t1;
+    int i;
+
+    t0 = now_ns();
+    for (i = 0; i < NODE_BENCH_OPS; i++) {
+        int n = i % NODE_BENCH_LIVE;
+
+        if (live[n])
+            xa_node_cache_free(live[n]);
+        live[n] = xa_node_cache_alloc();
+    }
+    for (i = 0; i < NODE_BENCH_LIVE; i++) {
+        xa_node_cache_free(live[i]);
+        live[i] = NULL;
+    }
+    t0 = now_ns() - t0;
+
+    t1 = now_ns();
+    for (i = 0; i < NODE_BENCH_OPS; i++) {
+        int n = i % NODE_BENCH_LIVE;
+
+        free(live[n]);
+        live[n] = calloc(1, sizeof(struct xa_node));
+    }
+    for (i = 0; i < NODE_BENCH_LIVE; i++)
+        free(live[i]);
+    t1 = now_ns() - t1;
+
+    printf("node alloc + free: cache %llu ns, calloc %llu ns\n",
+           t0 / NODE_BENCH_OPS, t1 / NODE_BENCH_OPS);
+    shrink_slab(&xa_node_shrinker, ~0UL);
+}
+
+#define FILL_BENCH_ENTRIES (1UL << 20)
+
+// Filling through an xa_state against a root-to-leaf descent per index
+static void bench_fill(void)
+{
+    unsigned long long t0, t1, t2;
+    struct xarray xa;
+    unsigned long index;
+
+    xa_init(&xa);
+    t0 = now_ns();
+    for (index = 0; index < FILL_BENCH_ENTRIES; index++)
+        xa_store(&xa, index, xa_mk_value(index), GFP_KERNEL);
+    t1 = now_ns();
+    xa_destroy(&xa);
+    rcu_barrier();
+
+    t2 = now_ns();
+    xas_fill(&xa, FILL_BENCH_ENTRIES);
+    t2 = now_ns() - t2;
+    xa_destroy(&xa);
+    rcu_barrier();
+
+    printf("fill %lu entries: xa_store %llu ns/entry, xas walk %llu ns/entry\n",
+           FILL_BENCH_ENTRIES, (t1 - t0) / FILL_BENCH_ENTRIES, t2 / FILL_BENCH_ENTRIES);
+}
+
+#define MARK_BENCH_ENTRIES (1UL << 20)
+#define MARK_BENCH_MARKED 64
+
+// A marked walk over a sparse mark visits a few paths, not every leaf
+static void bench_find_marked(void)
+{
+    unsigned long long t0, t1, t2;
+    unsigned long index, seen = 0, found = 0;
+    struct xarray xa;
+    void *entry;
+
+    xa_init(&xa);
+    for (index = 0; index < MARK_BENCH_ENTRIES; index++)
+        xa_store(&xa, index, xa_mk_value(index), GFP_KERNEL);
+    for (index = 0; index < MARK_BENCH_MARKED; index++)
+        xa_set_mark(&xa, index * (MARK_BENCH_ENTRIES / MARK_BENCH_MARKED) + 17, XA_MARK_0);
+
+    t0 = now_ns();
+    xa_for_each(&xa, index, entry)
+        seen += xa_get_mark(&xa, index, XA_MARK_0);
+    t1 = now_ns();
+    xa_for_each_marked(&xa, index, entry, XA_MARK_0)
+        found++;
+    t2 = now_ns();
+
+    printf("%lu entries, %lu marked: full scan %llu us, marked walk %llu us\n",
+           MARK_BENCH_ENTRIES, found, (t1 - t0) / 1000, (t2 - t1) / 1000);
+    if (seen != found)
+        printf("marked walk disagrees with full scan: FAIL\n");
+    xa_destroy(&xa);
+    rcu_barrier();
+}
+
+#define RCU_READERS 4
+#define RCU_SLOTS 8192
+#define RCU_WRITER_OPS 300000
+
+struct rcu_test {
+    struct xarray xa;
+    int stop;
+    unsigned long lookups;
+    int failures;
+};
+
+static unsigned long rcu_test_index(unsigned int n)
+{
+    // Spread entries over several levels so nodes come and go
+    return n % 4 ? n : (unsigned long)n << 24;
+}
+
+static void *rcu_reader_thread(void *arg)
+{
+    struct rcu_test *t = arg;
+    unsigned int seed = (unsigned int)(uintptr_t)&seed;
+    unsigned long lookups = 0, index;
+    void *entry;
+    int failures = 0;
+
+    while (!__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+        unsigned int n = rand_r(&seed) % RCU_SLOTS;
+
+        entry = xa_load(&t->xa, rcu_test_index(n));
+        if (entry && entry != xa_mk_value(n))
+            failures++;
+        lookups++;
+
+        if (lookups % 1024 == 0) {
+            xa_for_each(&t->xa, index, entry) {
+                if (!xa_is_value(entry) ||
+                    rcu_test_index(xa_to_value(entry)) != index)
+                    failures++;
+            }
+        }
+    }
+    __atomic_fetch_add(&t->lookups, lookups, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->failures, failures, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/*
+ * Lock-free readers race one writer that stores and erases entries across
+ * several tree levels. A reader must only ever see NULL or the value that
+ * belongs at the index it looked up, and no node may be leaked or freed
+ * while a reader can still reach it (run under ASan/TSan to check).
+ */
+static int test_rcu_readers(void)
+{
+    pthread_t readers[RCU_READERS];
+    struct rcu_test t;
+    unsigned long long start, elapsed;
+    unsigned int seed = 1;
+    int i, failures = 0;
+
+    memset(&t, 0, sizeof(t));
+    xa_init(&t.xa);
+    start = now_ns();
+    for (i = 0; i < RCU_READERS; i++)
+        pthread_create(&readers[i], NULL, rcu_reader_thread, &t);
+
+    for (i = 0; i < RCU_WRITER_OPS; i++) {
+        unsigned int n = rand_r(&seed) % RCU_SLOTS;
+        void *old;
+
+        if (rand_r(&seed) % 2)
+            old = xa_store(&t.xa, rcu_test_index(n), xa_mk_value(n), GFP_KERNEL);
+        else
+            old = xa_erase(&t.xa, rcu_test_index(n));
+        if (old && old != xa_mk_value(n))
+            failures++;
+    }
+
+    __atomic_store_n(&t.stop, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < RCU_READERS; i++)
+        pthread_join(readers[i], NULL);
+    elapsed = now_ns() - start;
+
+    xa_destroy(&t.xa);
+    rcu_barrier();
+    failures += t.failures + (nr_xa_nodes != 0);
+    printf("%d lock-free readers: %lu lookups against %d writes in %llu ms\n",
+           RCU_READERS, t.lookups, RCU_WRITER_OPS, elapsed / 1000000);
+    printf("concurrent readers and writer: %s\n", failures ? "FAIL" : "PASS");
+    return failures;
+}
+
+// Simple test program
+int main()
+{
+    struct xarray xa;
+    unsigned long test_values[] = {42, 100, 255, 1000};
+    int i;
+
+    // Initialize xarray
+    xa_init(&xa);
+    printf("XArray initialized\n");
+
+    // Store some values
+    for (i = 0; i < sizeof(test_values)/sizeof(test_values[0]); i++) {
+        xa_store(&xa, i, xa_mk_value(test_values[i]), GFP_KERNEL);
+        printf("Stored value %lu at index %d\n", test_values[i], i);
+    }
+
+    // Retrieve and verify values
+    printf("\nRetrieving values:\n");
+    for (i = 0; i < sizeof(test_values)/sizeof(test_values[0]); i++) {
+        void *entry = xa_load(&xa, i);
+        if (entry && xa_is_value(entry)) {
+            unsigned long value = xa_to_value(entry);
+            printf("Retrieved value %lu from index %d\n", value, i);
+            if (value != test_values[i]) {
+                printf("Error: Value mismatch at index %d\n", i);
+                return 1;
+            }
+        } else {
+            printf("Error: Failed to retrieve value at index %d\n", i);
+            return 1;
+        }
+    }
+
+    xa_destroy(&xa);
+    if (test_sparse_indices() || test_random_ops() || test_iteration() ||
+        test_marks() || test_multi_index() || test_xas() || test_alloc() ||
+        test_rcu_readers() || test_node_cache())
+        return 1;
+    bench_find_marked();
+    bench_fill();
+    bench_alloc();
+    bench_node_cache();
 
     printf("\nAll tests passed successfully!\n");
     return 0;